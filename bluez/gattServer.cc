@@ -19,6 +19,7 @@
 #include "../rpclogger.h"
 #include "../util.h"
 #include "../jsonrpc.h"
+#include "../rpcsession.h"
 
 #include <exception>
 #include <fstream>
@@ -370,6 +371,14 @@ GattClient::onDataChannelIn(
 {
   XLOG_INFO("onDataChannelIn(offset=%d, len=%zd)", offset, len);
 
+  if (m_framing == RpcFraming::LengthPrefixed)
+  {
+    m_incoming_buff.insert(m_incoming_buff.end(), data + offset, data + offset + len);
+    deliverRecords();
+    gatt_db_attribute_write_result(attr, id, 0);
+    return;
+  }
+
   // TODO: should this use memory_stream?
   for (size_t i = 0; i < len; ++i)
   {
@@ -395,6 +404,37 @@ GattClient::onDataChannelIn(
   gatt_db_attribute_write_result(attr, id, 0);
 }
 
+// hands every whole record at the front of the incoming buffer to the
+// data handler and keeps the rest for the next write
+void
+GattClient::deliverRecords()
+{
+  size_t start = 0;
+  while (m_incoming_buff.size() - start >= RpcSession::kHeaderSize)
+  {
+    size_t n = RpcSession::recordSize(reinterpret_cast<uint8_t const *>(&m_incoming_buff[start]));
+    if (n == 0)
+    {
+      // there's no finding the next record after a bad length
+      XLOG_ERROR("dropping %zd incoming bytes with a bad record length",
+        m_incoming_buff.size() - start);
+      m_incoming_buff.clear();
+      return;
+    }
+
+    if (m_incoming_buff.size() - start < n)
+      break;
+
+    if (m_data_handler)
+      m_data_handler(&m_incoming_buff[start], static_cast<int>(n));
+    else
+      XLOG_WARN("no data handler registered");
+    start += n;
+  }
+
+  m_incoming_buff.erase(m_incoming_buff.begin(), m_incoming_buff.begin() + start);
+}
+
 void
 GattClient::onDataChannelOut(
   gatt_db_attribute*    attr,
@@ -408,19 +448,21 @@ GattClient::onDataChannelOut(
 
   static int32_t const kBufferSize = 256;
   static uint8_t buff[kBufferSize];
+  static int32_t buffLength = 0;
 
   int n = 0;
 
+  // long reads come back for the rest of the chunk at an offset. the
+  // chunk's length is kept, since encrypted records can hold zeros
   if (offset == 0)
   {
     memset(buff, 0, sizeof(buff));
-    n = m_outgoing_queue.get_line((char *)buff, kBufferSize);
+    buffLength = m_outgoing_queue.get_line((char *)buff, kBufferSize);
+    n = buffLength;
   }
   else
   {
-    int bytesToWrite = 0;
-    while ((bytesToWrite + offset) < kBufferSize && (buff[offset + bytesToWrite] != '\0'))
-      bytesToWrite++;
+    int bytesToWrite = (offset < buffLength) ? (buffLength - offset) : 0;
 
     n = bytesToWrite;
     XLOG_INFO("bytesToWrite:%d offset:%d n:%d", bytesToWrite, offset, n);
@@ -720,6 +762,7 @@ GattClient::GattClient(int fd)
   , m_mtu(16)
   , m_outgoing_queue(kRecordDelimiter)
   , m_incoming_buff()
+  , m_framing(RpcFraming::Delimited)
   , m_data_channel(nullptr)
   , m_blepoll(nullptr)
   , m_service_change_enabled(false)
@@ -759,6 +802,18 @@ GattClient::enqueueForSend(char const* buff, int n)
   m_outgoing_queue.put_line(buff, n);
 }
 
+void
+GattClient::enqueueRecord(char const* buff, int n)
+{
+  if (!buff || n <= 0)
+  {
+    XLOG_WARN("invalid record length:%d", n);
+    return;
+  }
+
+  m_outgoing_queue.put(buff, n);
+}
+
 void
 GattClient::onClientDisconnected(int err)
 {
@@ -16,6 +16,7 @@
 #ifndef __GATT_SERVER_H__
 #define __GATT_SERVER_H__
 
+#include <atomic>
 #include <list>
 #include <memory>
 #include <thread>
@@ -49,6 +50,9 @@ public:
 
   virtual void init(DeviceInfoProvider const& provider) override;
   virtual void enqueueForSend(char const* buff, int n) override; 
+  virtual void enqueueRecord(char const* buff, int n) override;
+  virtual void setFraming(RpcFraming framing) override
+    { m_framing = framing; }
   virtual void run() override;
   virtual void setDataHandler(RpcDataHandler const& handler) override
     { m_data_handler = handler; }
@@ -93,6 +97,7 @@ private:
   void addDeviceInfoCharacteristic(gatt_db_attribute* service, uint16_t id,
     std::string const& value);
   void buildJsonRpcService();
+  void deliverRecords();
 
 private:
   int                 m_fd;
@@ -102,6 +107,7 @@ private:
   uint16_t            m_mtu;
   memory_stream       m_outgoing_queue;
   std::vector<char>   m_incoming_buff;
+  std::atomic<RpcFraming> m_framing;
   gatt_db_attribute*  m_data_channel;
   gatt_db_attribute*  m_blepoll;
   uint16_t            m_notify_handle;
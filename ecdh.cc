@@ -19,60 +19,27 @@
 
 #include <string.h>
 #include <errno.h>
-#include <string.h>
+
+#include <algorithm>
 
 #include <cJSON.h>
 #include "rpclogger.h"
 #include "ecdh.h"
 
-#define _DEBUG_CRYPTO_ 0
-
-typedef unsigned char byte_t;
-
-
-typedef struct
-{
-  byte_t* data;
-  int     length;
-} byteArray_t;
-
-void
-baInit(
-  byteArray_t* v,
-  int length);
-
-void
-baClear(
-  byteArray_t* v);
-
-#if _DEBUG_CRYPTO_
-void
-baPrint(
-  byteArray_t const* v,
-  char const* name);
-#endif
-
-char*
-baToString(
-  byteArray_t const* v);
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/kdf.h>
 
-int
-baFromBase64(
-  byteArray_t* decoded_data,
-  char const* encoded_data);
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/x509.h>
 
-int
-ECDH_SharedKeyDerive(
-  EVP_PKEY* private_key,
-  EVP_PKEY* peer_key,
-  byteArray_t* secret_key);
+typedef unsigned char byte_t;
 
-int
-AESDecrypt(
-  byteArray_t const* key,
-  byteArray_t const* iv,
-  byteArray_t const* encrypted_data,
-  byteArray_t*       plain_data);
+// big enough for any Wi-Fi settings
+#define kSettingsBufferSize 2048
 
 EVP_PKEY*
 ECC_ReadPrivateKeyFromFile(
@@ -86,291 +53,9 @@ EVP_PKEY*
 ECC_ReadPublicKeyFromFile(
   char const* fname);
 
-int
-ECDH_Decrypt(
-  char const* private_key_path,
-  char const* peer_public_key,
-  char const* iv,
-  char const* cipher_text,
-  char** clear_text,
-  int* clear_text_length);
-
 static char const*
 CRYPTO_Error();
 
-#if 0
-int main(int argc, char* argv[])
-{
-  FILE*         fin;
-  cJSON*        reply;
-  cJSON*        wifi_settings;
-  byteArray_t   buff;
-
-  fin = NULL;
-  reply = NULL;
-  wifi_settings = NULL;
-  baInit(&buff, 2048);
-
-  // do this on startup
-  ERR_load_crypto_strings();
-
-  fin = fopen(argv[1], "r");
-  fread(buff.data, 1, buff.length, fin);
-  fclose(fin);
-
-  reply = cJSON_Parse((char const *)buff.data);
-  ECDH_DecryptWiFiSettings(reply, &wifi_settings);
-
-  if (wifi_settings)
-  {
-    char* s = cJSON_Print(wifi_settings);
-    printf("%s\n", s);
-    free(s);
-    cJSON_Delete(wifi_settings);
-  }
-
-  baClear(&buff);
-  cJSON_Delete(reply);
-  return 0;
-}
-#endif
-
-int
-ECDH_Decrypt(
-  char const* private_key_path,
-  char const* peer_public_key,
-  char const* iv,
-  char const* cipher_text,
-  char** clear_text,
-  int* clear_text_length)
-{
-  int           ret;
-  char*         p;
-
-  EVP_PKEY*     private_key;
-  EVP_PKEY*     peer_key;
-
-  byteArray_t   shared_secret;
-  byteArray_t   encdata;
-  byteArray_t   ivector;
-  byteArray_t   encrypted;
-  byteArray_t   decrypted;
-
-  ret = 0;
-  p = NULL;
-  private_key = NULL;
-  peer_key = NULL;
-
-  baInit(&shared_secret, 0);
-  baInit(&encdata, 0);
-  baInit(&decrypted, 0);
-
-  baFromBase64(&ivector, iv);
-  baFromBase64(&encrypted, cipher_text);
-
-  // read my private key
-  private_key = ECC_ReadPrivateKeyFromFile(private_key_path);
-  if (!private_key)
-  {
-    XLOG_ERROR("failed to read private key from '%s'", private_key_path);
-    ret = 0;
-    goto error;
-  }
-
-  // parse peer's public key
-  peer_key = ECC_ReadPublicKeyFromPEM(peer_public_key);
-  if (!peer_key)
-  {
-    XLOG_ERROR("failed to read public key from pem data");
-    XLOG_INFO(" --------- PEER PUBLIC KEY -----------\n%s",
-      peer_public_key);
-    ret = 0;
-    goto error;
-  }
-
-  // create shared/derived key
-  ret = ECDH_SharedKeyDerive(private_key, peer_key, &shared_secret);
-  if (!ret)
-  {
-    XLOG_ERROR("failed to derive shared key");
-    goto error;
-  }
-
-  // use shared/derived key to decrypt payload
-  ret = AESDecrypt(&shared_secret, &ivector, &encrypted, &decrypted);
-  if (!ret)
-  {
-    XLOG_ERROR("failed to decrypt data");
-    goto error;
-  }
-
-  // copy payload to output parameters
-  p = (char *) malloc(sizeof(byte_t) * (decrypted.length + 1));
-  memcpy(p, decrypted.data, decrypted.length);
-  p[decrypted.length] = '\0';
-
-  *clear_text = p;
-  *clear_text_length = decrypted.length;
-
-  // cleanup
-error:
-  baClear(&shared_secret);
-  baClear(&encdata);
-  baClear(&ivector);
-  baClear(&encrypted);
-  baClear(&decrypted);
-
-  if (private_key)
-    EVP_PKEY_free(private_key);
-
-  if (peer_key)
-    EVP_PKEY_free(peer_key);
-
-  return ret;
-}
-
-int
-baFromBase64(byteArray_t* decoded_data, char const* encoded_data)
-{
-  BIO*      b64;
-  BIO*      buff;
-  size_t    encoded_length;
-  size_t    bytes_written;
-
-  b64 = NULL;
-  buff = NULL;
-  encoded_length = 0;
-  bytes_written = 0;
-
-  if (!decoded_data)
-  {
-    XLOG_ERROR("no parameter sepcified to base64 decode into");
-    return 0;
-  }
-
-  if (!encoded_data)
-  {
-    XLOG_ERROR("no parameter specified to base64 decode");
-    return 0;
-  }
-
-  encoded_length = strlen(encoded_data);
-
-  b64 = BIO_new(BIO_f_base64());
-  buff = BIO_new_mem_buf(encoded_data, encoded_length);
-  buff = BIO_push(b64, buff);
-  BIO_set_flags(buff, BIO_FLAGS_BASE64_NO_NL);
-  BIO_set_flags(buff, BIO_CLOSE);
-
-  baInit(decoded_data, encoded_length);
-  memset(decoded_data->data, 0, encoded_length);
-  decoded_data->length = 0;
-
-  bytes_written = BIO_read(buff, decoded_data->data, encoded_length);
-  decoded_data->length = bytes_written;
-
-  BIO_free_all(buff);
-
-  return 0;
-}
-
-char*
-baToString(
-  byteArray_t const* v)
-{
-  int i;
-  char* s;
-
-  i = 0;
-  s = (char *) malloc(v->length + 1);
-
-  for (i = 0; i < v->length; ++i)
-    s[i] = (char) v->data[i];
-
-  s[v->length] = '\0';
-  return s;
-}
-
-int
-AESDecrypt(
-  byteArray_t const* key,
-  byteArray_t const* iv,
-  byteArray_t const* encrypted_data,
-  byteArray_t*       plain_data)
-{
-  int                 n;
-  int                 ret;
-  int                 length;
-  EVP_CIPHER_CTX*     cipher_ctx;
-
-  n = 0;
-  ret = 0;
-  length = 0;
-  cipher_ctx = NULL;
-
-  baInit(plain_data, encrypted_data->length);
-
-  #if _DEBUG_CRYPTO_
-  baPrint(key, "KEY");
-  baPrint(iv, "IV");
-  baPrint(encrypted_data, "ENCRYPTED DATA");
-  #endif
-
-  cipher_ctx = EVP_CIPHER_CTX_new();
-  if (!cipher_ctx)
-  {
-    XLOG_ERROR("EVP_CIPHER_CTX_new failed. %s", CRYPTO_Error());
-    baClear(plain_data);
-    return 0;
-  }
-
-  ret = EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key->data, iv->data);
-  if (!ret)
-  {
-    XLOG_ERROR("EVP_DecryptInit_ex failed. %s", CRYPTO_Error());
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return 0;
-  }
-
-#if 0
-  EVP_CIPHER_CTX_set_padding(ctx.get(), 1);
-  EVP_CIPHER_CTX_set_key_length(ctx.get(), 16);
-#endif
-
-  ret = EVP_DecryptUpdate(cipher_ctx, plain_data->data, &n, encrypted_data->data, encrypted_data->length);
-  if (ret == 1)
-  {
-    length += n;
-  }
-  else
-  {
-    XLOG_ERROR("EVP_DecryptUpdate failed. %s", CRYPTO_Error());
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return 0;
-  }
-
-  ret = EVP_DecryptFinal_ex(cipher_ctx, (plain_data->data + length), &n);
-  if (ret == 1)
-  {
-    length += n;
-  }
-  else
-  {
-    XLOG_ERROR("EVP_DecryptFinal_ex failed. %s", CRYPTO_Error());
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return 0;
-  }
-
-  if (length > 0 && length < plain_data->length)
-  {
-    plain_data->length = length;
-    plain_data->data[length] = '\0';
-  }
-
-  EVP_CIPHER_CTX_free(cipher_ctx);
-  return 1;
-}
-
 EVP_PKEY*
 ECC_ReadPublicKeyFromPEM(
   char const* pem_data)
@@ -460,218 +145,707 @@ ECC_ReadPrivateKeyFromFile(char const* fname)
 }
 
 int
-ECDH_SharedKeyDerive(
-  EVP_PKEY* private_key,
-  EVP_PKEY* peer_key,
-  byteArray_t* shared_secret)
+ECDH_DecryptWiFiSettings(
+  cJSON const* server_reply,
+  cJSON** wifi_settings)
 {
-  size_t        len;
-  EVP_PKEY_CTX* key_ctx;
+  int     ret;
+  int     size;
+  cJSON*  iv;
+  cJSON*  peer_key;
+  cJSON*  settings;
+  byte_t* buff;
+  byte_t  stack_buff[kSettingsBufferSize];
 
-  len = 0;
-  baInit(shared_secret, 0);
-  key_ctx = NULL;
+  ret = 0;
+  size = 0;
+  iv = NULL;
+  peer_key = NULL;
+  settings = NULL;
+  buff = stack_buff;
 
-  key_ctx = EVP_PKEY_CTX_new(private_key, NULL);
-  if (!key_ctx)
+  if (!server_reply)
   {
-    unsigned long err = ERR_get_error();
-    XLOG_ERROR("EVP_PKEY_CTX_new failed:%lu", err);
-    return 0;
+    XLOG_ERROR("null server_reply");
+    return 1;
   }
-  
-  if (!EVP_PKEY_derive_init(key_ctx))
+
+  if (!wifi_settings)
   {
-    XLOG_ERROR("EVP_PKEY_derive_init failed. %s", CRYPTO_Error());
-    EVP_PKEY_CTX_free(key_ctx);
+    XLOG_ERROR("null wifi_settings");
+    return 1;
+  }
+
+  settings = cJSON_GetObjectItem(server_reply, "wifi-settings");
+  if (settings)
+  {
+    XLOG_INFO("found un-encrypted settings, using those");
+    *wifi_settings = cJSON_Duplicate(settings, 1); 
+    return 1;
+  }
+
+  settings = cJSON_GetObjectItem(server_reply, "secure-wifi-settings");
+  if (!settings)
+  {
+    XLOG_ERROR("failed to find 'secure-wifi-settings' in wifi settings object");
+    *wifi_settings = NULL;
     return 0;
   }
 
-  if (!EVP_PKEY_derive_set_peer(key_ctx, peer_key))
+  iv = cJSON_GetObjectItem(server_reply, "iv");
+  if (!iv)
   {
-    XLOG_ERROR("EVP_PKEY_derive_set_peer failed. %s", CRYPTO_Error());
-    EVP_PKEY_CTX_free(key_ctx);
+    XLOG_ERROR("failed to find 'iv' in wifi settings object");
+    *wifi_settings = NULL;
     return 0;
   }
 
-  if (!EVP_PKEY_derive(key_ctx, NULL, &len))
+  // without a key of its own, the settings are from the client that
+  // called rpc-set-client-pubkey
+  peer_key = cJSON_GetObjectItem(server_reply, "pubKey");
+  if (!peer_key)
+    XLOG_INFO("no 'pubKey' in wifi settings object, using the session's key");
+
+  // settings fit on the stack. anything bigger goes in the secure heap
+  // rather than the ordinary one
+  size = ECDH_DecryptBufferSize(settings->valuestring);
+  if (size > (int) sizeof(stack_buff))
   {
-    XLOG_ERROR("EVP_PKEY_derive failed. %s", CRYPTO_Error());
-    EVP_PKEY_CTX_free(key_ctx);
+    buff = (byte_t *) OPENSSL_secure_malloc(size);
+    if (!buff)
+    {
+      XLOG_ERROR("failed to allocate %d bytes to decrypt secure wifi settings", size);
+      *wifi_settings = NULL;
+      return 0;
+    }
+  }
+
+  ret = ECDH_DecryptJson(peer_key ? peer_key->valuestring : NULL, iv->valuestring,
+    settings->valuestring, buff, size, wifi_settings);
+
+  if (buff != stack_buff)
+    OPENSSL_secure_free(buff);
+
+  if (!ret)
+  {
+    XLOG_ERROR("failed to decrypt secure wifi settings");
     return 0;
   }
 
-  baInit(shared_secret, len);
+  return 1;
+}
+
+int
+ECDH_DecryptBufferSize(
+  char const* cipher_text)
+{
+  return cipher_text ? (int) (strlen(cipher_text) / 4 * 3 + 1) : 0;
+}
+
+int
+ECDH_DecryptJson(
+  char const* peer_public_key,
+  char const* iv,
+  char const* cipher_text,
+  unsigned char* buff,
+  int buff_size,
+  cJSON** json)
+{
+  int ret;
+  int length;
+
+  *json = NULL;
+  length = 0;
 
-  if (!EVP_PKEY_derive(key_ctx, shared_secret->data, &len))
+  if (!iv || !cipher_text || !buff || buff_size < 1)
+    return 0;
+
+  // the last byte is for the NUL cJSON_Parse needs
+  ret = EcdhKeyManager::keyManager().decryptBase64(peer_public_key ? peer_public_key : "",
+    iv, cipher_text, buff, buff_size - 1, &length);
+  if (ret)
   {
-    XLOG_ERROR("EVP_PKEY_derive failed. %s", CRYPTO_Error());
-    EVP_PKEY_CTX_free(key_ctx);
+    XLOG_ERROR("failed to decrypt data. %s", strerror(ret));
+    OPENSSL_cleanse(buff, buff_size);
     return 0;
   }
-  else
+
+  buff[length] = '\0';
+  *json = cJSON_Parse((char const *) buff);
+  OPENSSL_cleanse(buff, length);
+
+  // the clear text isn't logged, it's likely to hold a password
+  if (!*json)
   {
-    shared_secret->length = len;
+    XLOG_ERROR("failed to parse decrypted json");
+    return 0;
   }
 
-  EVP_PKEY_CTX_free(key_ctx);
   return 1;
 }
 
+char const*
+CRYPTO_Error()
+{
+  static char buff[512];
 
-void
-baInit(
-  byteArray_t* v,
-  int length)
+  unsigned long err = ERR_get_error();
+  ERR_error_string_n(err, buff, sizeof(buff));
+
+  return buff;
+}
+
+
+namespace
 {
-  if (v)
+  // holds the private key's scalar and the derived keys
+  size_t const kSecureHeapSize = 16 * 1024;
+  size_t const kSecureHeapMinSize = 32;
+
+  // a session normally has one peer, this only bounds a misbehaving client
+  size_t const kMaxSharedKeys = 8;
+
+  // base64 is decoded this many characters at a time, which is a whole
+  // number of AES blocks
+  size_t const kBase64Chunk = 1024;
+
+  // decodes n characters of base64, n a multiple of 4, without a BIO.
+  // returns the decoded length or -1
+  int
+  decodeBase64(char const* in, size_t n, byte_t* out)
+  {
+    int length = EVP_DecodeBlock(out, reinterpret_cast<byte_t const *>(in), static_cast<int>(n));
+    if (length < 0)
+      return -1;
+
+    // EVP_DecodeBlock counts the padding as zeros
+    if (n > 0 && in[n - 1] == '=')
+      length--;
+    if (n > 1 && in[n - 2] == '=')
+      length--;
+    return length;
+  }
+
+  // how long to wait before trying again when a key can't be generated
+  int const kKeyRetryInterval = 60;
+
+  EVP_PKEY*
+  generateKey()
   {
-    if (length > 0)
+    EVP_PKEY* key = nullptr;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    bool generated = ctx &&
+      EVP_PKEY_keygen_init(ctx) == 1 &&
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) == 1 &&
+      EVP_PKEY_CTX_set_ec_param_enc(ctx, OPENSSL_EC_NAMED_CURVE) == 1 &&
+      EVP_PKEY_keygen(ctx, &key) == 1;
+
+    if (ctx)
+      EVP_PKEY_CTX_free(ctx);
+
+    if (!generated)
     {
-      size_t n = sizeof(byte_t) * length;
-      v->data = (byte_t *) malloc(n);
-      memset(v->data, 0, n);
-      v->length = length;
+      XLOG_ERROR("failed to generate bootstrap key. %s", CRYPTO_Error());
+      return nullptr;
     }
-    else
+    return key;
+  }
+
+  // writes next to the file and renames over it, so a reader never sees
+  // half a key
+  int
+  writeKeyFile(std::string const& path, mode_t mode, EVP_PKEY* key, bool isPrivate)
+  {
+    std::string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd == -1)
+      return errno;
+
+    FILE* fout = fdopen(fd, "w");
+    if (!fout)
+    {
+      int err = errno;
+      close(fd);
+      unlink(temp.c_str());
+      return err;
+    }
+
+    int written = isPrivate
+      ? PEM_write_PrivateKey(fout, key, nullptr, nullptr, 0, nullptr, nullptr)
+      : PEM_write_PUBKEY(fout, key);
+    if (fclose(fout) != 0 || written != 1)
+    {
+      unlink(temp.c_str());
+      return EIO;
+    }
+
+    if (rename(temp.c_str(), path.c_str()) == -1)
     {
-      v->data = NULL;
-      v->length = 0;
+      int err = errno;
+      unlink(temp.c_str());
+      return err;
     }
+    return 0;
+  }
+
+  int
+  saveKey(EVP_PKEY* key, EcdhKeyOptions const& options)
+  {
+    // the default directory is under /var/run, which is empty after a boot
+    std::string path = options.PrivateKeyPath;
+    std::string dir = dirname(&path[0]);
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+      return errno;
+
+    int ret = writeKeyFile(options.PrivateKeyPath, 0600, key, true);
+    if (ret == 0 && !options.PublicKeyPath.empty())
+      ret = writeKeyFile(options.PublicKeyPath, 0644, key, false);
+    return ret;
   }
 }
 
-void
-baClear(
-  byteArray_t* v)
+struct EcdhKeyManager::SharedKey
 {
-  if (v)
+  SharedKey()
+    : Key(nullptr)
+    , Length(0)
+    , Ctx(nullptr) { }
+
+  ~SharedKey()
   {
-    if (v->data)
-      free(v->data);
-    v->data = NULL;
-    v->length = 0;
+    if (Ctx)
+      EVP_CIPHER_CTX_free(Ctx);
+    if (Key)
+      OPENSSL_secure_clear_free(Key, Length);
   }
+
+  // the context decrypts one message at a time
+  std::mutex      Mutex;
+  byte_t*         Key;
+  size_t          Length;
+  EVP_CIPHER_CTX* Ctx;
+};
+
+EcdhKeyManager&
+EcdhKeyManager::keyManager()
+{
+  static EcdhKeyManager keyManager;
+  return keyManager;
 }
 
-#if _DEBUG_CRYPTO_
-void
-baPrint(
-  byteArray_t const* v,
-  char const* name)
+EcdhKeyManager::EcdhKeyManager()
+  : m_private_key(nullptr)
+  , m_next_key(nullptr)
+  , m_running(false)
+  , m_key_handed_out(false)
+  , m_rotate_due(false)
+  , m_save_due(false)
 {
-  int i;
+  if (!CRYPTO_secure_malloc_initialized())
+  {
+    int ret = CRYPTO_secure_malloc_init(kSecureHeapSize, kSecureHeapMinSize);
+    if (ret == 0)
+      XLOG_WARN("failed to create secure heap, keys will be in ordinary memory");
+    else if (ret == 2)
+      XLOG_WARN("secure heap couldn't be locked in memory");
+  }
+}
+
+EcdhKeyManager::~EcdhKeyManager()
+{
+  stop();
 
-  printf("\n");
-  printf("----- BEGIN %s -----\n", name);
-  for (i = 0; i < v->length; ++i)
+  m_shared_keys.clear();
+  if (m_next_key)
+    EVP_PKEY_free(m_next_key);
+  if (m_private_key)
+    EVP_PKEY_free(m_private_key);
+}
+
+int
+EcdhKeyManager::start(EcdhKeyOptions const& options)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_running)
+    return EALREADY;
+
+  m_options = options;
+  m_running = true;
+  m_thread = std::thread([this] { this->run(); });
+  return 0;
+}
+
+void
+EcdhKeyManager::stop()
+{
   {
-    if (i > 0 && i % 8 == 0)
-      printf("\n");
-    printf("0x%02x ", v->data[i]);
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_running = false;
   }
-  printf("\n----- END %s -----\n", name);
-  printf("\n");
+  m_cond.notify_all();
+  if (m_thread.joinable())
+    m_thread.join();
 }
-#endif
 
 int
-ECDH_DecryptWiFiSettings(
-  cJSON const* server_reply,
-  cJSON** wifi_settings)
+EcdhKeyManager::load(char const* privateKeyPath)
 {
-  int     ret;
-  cJSON*  iv;
-  cJSON*  peer_key;
-  cJSON*  settings;
-  char*   clear_text;
-  int     clear_text_length;
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_private_key)
+    return 0;
 
-  ret = 0;
-  iv = NULL;
-  peer_key = NULL;
-  settings = NULL;
-  clear_text = NULL;
-  clear_text_length = 0;
+  EVP_PKEY* key = ECC_ReadPrivateKeyFromFile(privateKeyPath);
+  if (!key)
+    return ENOENT;
 
-  if (!server_reply)
+  int ret = setKeyLocked(key);
+  if (ret)
+    EVP_PKEY_free(key);
+  return ret;
+}
+
+// takes ownership of key if it succeeds. the caller frees any key it
+// replaces
+int
+EcdhKeyManager::setKeyLocked(EVP_PKEY* key)
+{
+  byte_t* der = nullptr;
+  int n = i2d_PUBKEY(key, &der);
+  if (n <= 0)
   {
-    XLOG_ERROR("null server_reply");
-    return 1;
+    XLOG_ERROR("failed to encode public key. %s", CRYPTO_Error());
+    return EINVAL;
   }
 
-  if (!wifi_settings)
+  std::string encoded(4 * ((n + 2) / 3) + 1, '\0');
+  encoded.resize(EVP_EncodeBlock(reinterpret_cast<byte_t *>(&encoded[0]), der, n));
+  OPENSSL_free(der);
+
+  m_private_key = key;
+  m_public_key = encoded;
+  return 0;
+}
+
+// only swaps pointers, the key was made ahead of time and is saved later
+void
+EcdhKeyManager::rotateLocked()
+{
+  // the background thread rotates once the key is made
+  if (!m_next_key)
   {
-    XLOG_ERROR("null wifi_settings");
-    return 1;
+    XLOG_WARN("next bootstrap key isn't ready, keeping the current one for now");
+    m_rotate_due = true;
+    return;
   }
 
-  settings = cJSON_GetObjectItem(server_reply, "wifi-settings");
-  if (settings)
+  EVP_PKEY* old = m_private_key;
+  if (setKeyLocked(m_next_key) != 0)
+    return;
+
+  m_next_key = nullptr;
+  if (old)
+    EVP_PKEY_free(old);
+
+  m_shared_keys.clear();
+  m_key_handed_out = false;
+  m_rotate_due = false;
+  m_save_due = true;
+  m_cond.notify_all();
+  XLOG_INFO("rotated bootstrap key");
+}
+
+void
+EcdhKeyManager::run()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  if (!m_private_key)
   {
-    XLOG_INFO("found un-encrypted settings, using those");
-    *wifi_settings = cJSON_Duplicate(settings, 1); 
-    return 1;
+    std::string path = m_options.PrivateKeyPath;
+    lock.unlock();
+
+    EVP_PKEY* key = nullptr;
+    bool created = false;
+    if (access(path.c_str(), F_OK) == 0)
+      key = ECC_ReadPrivateKeyFromFile(path.c_str());
+    if (!key)
+    {
+      XLOG_INFO("no bootstrap key in %s, creating one", path.c_str());
+      key = generateKey();
+      created = true;
+    }
+
+    lock.lock();
+    if (key && m_private_key)
+    {
+      // load() got there first
+      EVP_PKEY_free(key);
+    }
+    else if (key && setKeyLocked(key) == 0)
+    {
+      m_save_due = created;
+    }
+    else if (key)
+    {
+      EVP_PKEY_free(key);
+    }
   }
 
-  settings = cJSON_GetObjectItem(server_reply, "secure-wifi-settings");
-  if (!settings)
+  bool const rotates = m_options.RotateInterval > 0 || m_options.RotatePerSession;
+  std::chrono::seconds const interval(m_options.RotateInterval);
+  m_rotate_at = std::chrono::steady_clock::now() + interval;
+
+  bool failed = false;
+  for (;;)
   {
-    XLOG_ERROR("failed to find 'secure-wifi-settings' in wifi settings object");
-    *wifi_settings = NULL;
-    return 0;
+    // a key that's due is saved even when stopping, so it isn't lost
+    if (m_save_due && m_private_key)
+    {
+      EVP_PKEY* key = m_private_key;
+      EVP_PKEY_up_ref(key);
+      EcdhKeyOptions options = m_options;
+      m_save_due = false;
+
+      lock.unlock();
+      int ret = saveKey(key, options);
+      if (ret)
+        XLOG_ERROR("failed to save bootstrap key to %s. %s", options.PrivateKeyPath.c_str(),
+          strerror(ret));
+      EVP_PKEY_free(key);
+      lock.lock();
+      continue;
+    }
+
+    if (!m_running)
+      break;
+
+    if (((rotates && !m_next_key) || !m_private_key) && !failed)
+    {
+      lock.unlock();
+      EVP_PKEY* key = generateKey();
+      lock.lock();
+
+      if (!key)
+        failed = true;
+      else if (!m_private_key && setKeyLocked(key) == 0)
+        m_save_due = true;
+      else if (!m_next_key)
+        m_next_key = key;
+      else
+        EVP_PKEY_free(key);
+
+      if (m_next_key && m_rotate_due && !m_key_handed_out)
+        rotateLocked();
+      continue;
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (m_options.RotateInterval > 0 && now >= m_rotate_at)
+    {
+      // a client may be about to use the key it was given
+      m_rotate_at = now + interval;
+      if (m_key_handed_out)
+        m_rotate_due = true;
+      else
+        rotateLocked();
+      continue;
+    }
+
+    if (failed)
+      m_cond.wait_for(lock, std::chrono::seconds(kKeyRetryInterval));
+    else if (m_options.RotateInterval > 0)
+      m_cond.wait_until(lock, m_rotate_at);
+    else
+      m_cond.wait(lock);
+    failed = false;
   }
+}
 
-  iv = cJSON_GetObjectItem(server_reply, "iv");
-  if (!iv)
+int
+EcdhKeyManager::getPublicKey(std::string& key)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (!m_private_key)
+    return m_running ? EAGAIN : ENOENT;
+
+  key = m_public_key;
+  m_key_handed_out = true;
+  return 0;
+}
+
+int
+EcdhKeyManager::setSessionPeer(std::string const& peerKey)
+{
+  std::shared_ptr<SharedKey> key;
+  int ret = getSharedKey(peerKey, key);
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_session_peer = (ret == 0) ? peerKey : std::string();
+  return ret;
+}
+
+void
+EcdhKeyManager::endSession()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  bool used = m_key_handed_out || !m_session_peer.empty();
+  m_key_handed_out = false;
+  m_session_peer.clear();
+  m_shared_keys.clear();
+
+  if (m_running && (m_rotate_due || (m_options.RotatePerSession && used)))
+    rotateLocked();
+}
+
+// the shared secret is derived straight into the secure heap and used
+// as the AES-256 key, as the client does
+int
+EcdhKeyManager::getSharedKey(std::string const& peerKey, std::shared_ptr<SharedKey>& key)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+
+  std::string peer = peerKey.empty() ? m_session_peer : peerKey;
+  if (peer.empty())
+    return EINVAL;
+  if (!m_private_key)
+    return ENOENT;
+
+  auto itr = m_shared_keys.find(peer);
+  if (itr != m_shared_keys.end())
   {
-    XLOG_ERROR("failed to find 'iv' in wifi settings object");
-    *wifi_settings = NULL;
+    key = itr->second;
     return 0;
   }
 
-  peer_key = cJSON_GetObjectItem(server_reply, "pubKey");
+  EVP_PKEY* peer_key = ECC_ReadPublicKeyFromPEM(peer.c_str());
   if (!peer_key)
+    return EINVAL;
+
+  std::shared_ptr<SharedKey> shared = std::make_shared<SharedKey>();
+
+  EVP_PKEY_CTX* key_ctx = EVP_PKEY_CTX_new(m_private_key, nullptr);
+  bool derived = key_ctx &&
+    EVP_PKEY_derive_init(key_ctx) == 1 &&
+    EVP_PKEY_derive_set_peer(key_ctx, peer_key) == 1 &&
+    EVP_PKEY_derive(key_ctx, nullptr, &shared->Length) == 1 &&
+    shared->Length >= static_cast<size_t>(EVP_CIPHER_key_length(EVP_aes_256_cbc())) &&
+    (shared->Key = static_cast<byte_t *>(OPENSSL_secure_malloc(shared->Length))) != nullptr &&
+    EVP_PKEY_derive(key_ctx, shared->Key, &shared->Length) == 1;
+
+  if (key_ctx)
+    EVP_PKEY_CTX_free(key_ctx);
+  EVP_PKEY_free(peer_key);
+
+  if (!derived)
   {
-    XLOG_ERROR("failed to find 'pubKey' in wifi settings object");
-    return 0;
+    XLOG_ERROR("failed to derive shared key. %s", CRYPTO_Error());
+    return EINVAL;
   }
 
-  ret = ECDH_Decrypt(kPrivateKeyPath, peer_key->valuestring, iv->valuestring,
-    settings->valuestring, &clear_text, &clear_text_length);
-  if (!ret)
+  shared->Ctx = EVP_CIPHER_CTX_new();
+  if (!shared->Ctx || !EVP_DecryptInit_ex(shared->Ctx, EVP_aes_256_cbc(), nullptr, shared->Key, nullptr))
   {
-    XLOG_ERROR("failed to decrypt secure wifi settings from '%s'",
-      settings->valuestring);
-    return 0;
+    XLOG_ERROR("failed to create cipher context. %s", CRYPTO_Error());
+    return ENOMEM;
   }
 
-  if (!clear_text)
+  if (m_shared_keys.size() >= kMaxSharedKeys)
+    m_shared_keys.erase(m_shared_keys.begin());
+  m_shared_keys[peer] = shared;
+
+  key = shared;
+  return 0;
+}
+
+// the raw ECDH output isn't uniformly random, so session keys go through
+// HKDF rather than being sliced out of it
+int
+EcdhKeyManager::deriveSessionKey(std::string const& info, byte_t* out, size_t n)
+{
+  std::shared_ptr<SharedKey> key;
+  int ret = getSharedKey(std::string(), key);
+  if (ret)
+    return ret;
+
+  EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  bool derived = ctx &&
+    EVP_PKEY_derive_init(ctx) == 1 &&
+    EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1 &&
+    EVP_PKEY_CTX_set1_hkdf_key(ctx, key->Key, key->Length) == 1 &&
+    EVP_PKEY_CTX_add1_hkdf_info(ctx, reinterpret_cast<byte_t const *>(info.data()),
+      info.size()) == 1 &&
+    EVP_PKEY_derive(ctx, out, &n) == 1;
+
+  if (ctx)
+    EVP_PKEY_CTX_free(ctx);
+
+  if (!derived)
   {
-    XLOG_ERROR("encryption returned NULL clear text string");
-    return 0;
+    XLOG_ERROR("failed to derive session key. %s", CRYPTO_Error());
+    return EINVAL;
   }
+  return 0;
+}
 
-  *wifi_settings = cJSON_Parse(clear_text);
-  if (!*wifi_settings)
+// each chunk of base64 is decoded into a buffer on the stack and decrypted
+// from there straight into clear, so the cipher text is never held whole
+int
+EcdhKeyManager::decryptBase64(std::string const& peerKey, char const* iv, char const* data,
+  byte_t* clear, int clearSize, int* clearLength)
+{
+  size_t ivChars = strlen(iv);
+  size_t dataChars = strlen(data);
+  if (ivChars % 4 != 0 || ivChars > 4 * ((EVP_MAX_IV_LENGTH + 2) / 3) || dataChars % 4 != 0)
+    return EINVAL;
+  if (dataChars / 4 * 3 > static_cast<size_t>(clearSize))
+    return ENOBUFS;
+
+  byte_t ivBytes[3 * ((EVP_MAX_IV_LENGTH + 2) / 3)];
+  int ivLength = decodeBase64(iv, ivChars, ivBytes);
+  if (ivLength < 0)
+    return EINVAL;
+
+  std::shared_ptr<SharedKey> key;
+  int ret = getSharedKey(peerKey, key);
+  if (ret)
+    return ret;
+
+  std::lock_guard<std::mutex> guard(key->Mutex);
+  if (ivLength != EVP_CIPHER_CTX_iv_length(key->Ctx))
+    return EINVAL;
+
+  if (!EVP_DecryptInit_ex(key->Ctx, nullptr, nullptr, nullptr, ivBytes))
   {
-    XLOG_ERROR("failed to parse secure wifi settings json string '%s'",
-      clear_text);
-    return 0;
+    XLOG_ERROR("EVP_DecryptInit_ex failed. %s", CRYPTO_Error());
+    return EINVAL;
   }
 
-  free(clear_text);
-  return 1;
-}
+  // CBC holds back the last block until the final call, so the clear
+  // text written never gets ahead of the cipher text read
+  byte_t chunk[kBase64Chunk / 4 * 3];
+  int total = 0;
+  for (size_t offset = 0; offset < dataChars; offset += kBase64Chunk)
+  {
+    int length = decodeBase64(data + offset, std::min(kBase64Chunk, dataChars - offset), chunk);
+    if (length < 0)
+      return EINVAL;
 
-char const*
-CRYPTO_Error()
-{
-  static char buff[512];
+    int n = 0;
+    if (!EVP_DecryptUpdate(key->Ctx, clear + total, &n, chunk, length))
+    {
+      XLOG_ERROR("EVP_DecryptUpdate failed. %s", CRYPTO_Error());
+      return EBADMSG;
+    }
+    total += n;
+  }
 
-  unsigned long err = ERR_get_error();
-  ERR_error_string_n(err, buff, sizeof(buff));
+  int n = 0;
+  if (!EVP_DecryptFinal_ex(key->Ctx, clear + total, &n))
+  {
+    XLOG_ERROR("EVP_DecryptFinal_ex failed. %s", CRYPTO_Error());
+    return EBADMSG;
+  }
 
-  return buff;
+  *clearLength = total + n;
+  return 0;
 }
-
@@ -27,7 +27,119 @@ extern "C"
 
 int ECDH_DecryptWiFiSettings(cJSON const* server_reply, cJSON** wifi_settings);
 
+// the buffer ECDH_DecryptJson needs for base64 cipher_text
+int ECDH_DecryptBufferSize(char const* cipher_text);
+
+// base64 decodes, decrypts and parses cipher_text in a single pass
+// through buff, with no other copies, and wipes buff before returning. a
+// NULL peer_public_key means the session's. returns 1 on success
+int ECDH_DecryptJson(char const* peer_public_key, char const* iv, char const* cipher_text,
+  unsigned char* buff, int buff_size, cJSON** json);
+
 #ifdef __cplusplus
 }
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <openssl/evp.h>
+
+struct EcdhKeyOptions
+{
+  EcdhKeyOptions()
+    : PrivateKeyPath(kPrivateKeyPath)
+    , PublicKeyPath(kPublicKeyPath)
+    , RotateInterval(0)
+    , RotatePerSession(false) { }
+
+  std::string PrivateKeyPath;
+  std::string PublicKeyPath;
+  int         RotateInterval;   // seconds, 0 to keep the key
+  bool        RotatePerSession; // a new key after each client that used one
+};
+
+// Holds the bootstrap private key and the AES keys derived from it. The
+// private key is read from disk once into OpenSSL's secure heap, which is
+// locked in memory. Each peer's public key is parsed and its shared key
+// derived once, and the cipher context built for it is reused for every
+// decrypt, until the session ends.
+//
+// Once started, a background thread creates the key if there's none on
+// disk, and always has the next key generated ahead of time. Rotating is
+// swapping that one in, and the new key is saved afterwards on the same
+// thread, so neither happens while a client waits. A key that was handed
+// out is never replaced before the client's session ends.
+class EcdhKeyManager
+{
+public:
+  static EcdhKeyManager& keyManager();
+
+  // loads or creates the key and keeps the next one ready, on a thread of
+  // its own. returns 0 or an errno, without waiting for any of it
+  int start(EcdhKeyOptions const& options);
+
+  // stops the background thread, after it finishes saving any key that's
+  // due. the keys in memory stay usable
+  void stop();
+
+  // returns 0 or an errno. only the first successful call reads the file
+  int load(char const* privateKeyPath);
+
+  // the public half as base64 DER, which is a PEM body without the
+  // armor lines. EAGAIN if the first key isn't ready yet
+  int getPublicKey(std::string& key);
+
+  // the peer from rpc-set-client-pubkey, used for data that doesn't name
+  // its own. the shared key is derived right away
+  int setSessionPeer(std::string const& peerKey);
+
+  // decrypts base64 AES-256-CBC data with the key shared with peerKey, or
+  // with the session peer when peerKey is empty. iv and data are decoded
+  // as they're decrypted. clear needs room for the decoded length. returns
+  // 0 or an errno
+  int decryptBase64(std::string const& peerKey, char const* iv, char const* data,
+    unsigned char* clear, int clearSize, int* clearLength);
+
+  // fills out with n bytes of HKDF-SHA256 output keyed by the secret
+  // shared with the session peer, for the given info label. returns 0
+  // or an errno
+  int deriveSessionKey(std::string const& info, unsigned char* out, size_t n);
+
+  // forgets the session peer and every derived key, and rotates the key
+  // if that's due
+  void endSession();
+
+private:
+  EcdhKeyManager();
+  ~EcdhKeyManager();
+
+  struct SharedKey;
+  int getSharedKey(std::string const& peerKey, std::shared_ptr<SharedKey>& key);
+  int setKeyLocked(EVP_PKEY* key);
+  void rotateLocked();
+  void run();
+
+private:
+  std::mutex                                          m_mutex;
+  std::condition_variable                             m_cond;
+  std::thread                                         m_thread;
+  EcdhKeyOptions                                      m_options;
+  EVP_PKEY*                                           m_private_key;
+  EVP_PKEY*                                           m_next_key;
+  std::string                                         m_public_key;
+  std::string                                         m_session_peer;
+  std::map< std::string, std::shared_ptr<SharedKey> > m_shared_keys;
+  std::chrono::steady_clock::time_point               m_rotate_at;
+  bool                                                m_running;
+  bool                                                m_key_handed_out;
+  bool                                                m_rotate_due;
+  bool                                                m_save_due;
+};
+
 #endif
 #endif
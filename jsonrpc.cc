@@ -151,58 +151,6 @@ JsonRpc::getString(cJSON const* req, char const* name, bool required, char const
   return s;
 }
 
-std::string
-JsonRpc::getStringWithExpansion(
-    cJSON const*  json,
-    char const*   name,
-    bool          required,
-    char const*   defaultValue,
-    cJSON const*  replacements)
-{
-  std::string t;
-
-  char const* s = JsonRpc::getString(json, name, required, defaultValue);
-  if (s)
-  {
-    // TODO: do substitution
-    // name == "Every ${type} boy does ${how}"
-    // replacenames = "{"type":"good", "how":"fine"}
-    // result == "Every good boy does fine"
-
-    std::stringstream buff;
-    for (int i = 0, n = static_cast<int>(strlen(s)); i < n; ++i)
-    {
-      if (s[i] != '$')
-      {
-        buff << s[i];
-      }
-      else
-      {
-        i += 2; // skip past ${ 
-        // not really the most resilient code
-
-        int j = i;
-        char token[64];
-        memset(token, 0, sizeof(token));
-
-        while (j < n && s[j] != '}')
-          j++;
-
-        strncpy(token, s + i, (j - i));
-
-        char const* t = JsonRpc::getString(replacements, token, true);
-        buff << t;
-
-        i = j;
-      }
-    }
-
-    t = buff.str();
-  }
-
-  return t;
-}
-
 #if 0
 char const*
 jsonRpc_getString(cJSON* argv, int idx)
@@ -417,6 +365,13 @@ JsonRpc::wrapResponse(int code, cJSON* res, int reqId)
   return envelope;
 }
 
+cJSON*
+JsonRpc::deferred()
+{
+  static cJSON marker;
+  return &marker;
+}
+
 cJSON*
 JsonRpc::notImplemented(char const* methodName)
 {
@@ -26,6 +26,10 @@ public:
   static cJSON* makeError(int code, char const* fmt, ...) __attribute__((format (printf, 2, 3)));
   static cJSON* notImplemented(char const* methodName);
 
+  // returned by a method that answers later. the response goes out
+  // through RpcNotifier::Notify once there is one. this is never deleted
+  static cJSON* deferred();
+
   static int
   getInt(
     cJSON const*  json,
@@ -40,14 +44,6 @@ public:
     bool          required,
     char const*   defaultValue = nullptr);
 
-  static std::string
-  getStringWithExpansion(
-    cJSON const*  json,
-    char const*   name,
-    bool          required,
-    char const*   defaultValue = nullptr,
-    cJSON const*  replacements = nullptr);
-
   static cJSON const*
   search(
     cJSON const*  json,
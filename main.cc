@@ -23,25 +23,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/utsname.h>
 
 #include <chrono>
 #include <condition_variable>
 #include <iostream>
+#include <memory>
 #include <fstream>
 #include <mutex>
 #include <string>
 #include <cJSON.h>
 
-std::string DIS_getSystemId();
-std::string DIS_getModelNumber();
-std::string DIS_getSerialNumber();
-std::string DIS_getFirmwareRevision();
-std::string DIS_getHardwareRevision();
-std::string DIS_getSoftwareRevision();
-std::string DIS_getManufacturerName();
+// What the GATT device information service reports. None of it changes
+// while bleconfd runs, so it's read once at startup and every connection
+// gets the same copy without touching the filesystem.
+struct DeviceInfo
+{
+  std::string SystemId;
+  std::string ModelNumber;
+  std::string SerialNumber;
+  std::string FirmwareRevision;
+  std::string HardwareRevision;
+  std::string SoftwareRevision;
+  std::string ManufacturerName;
+};
+
+DeviceInfo DIS_readDeviceInfo();
 std::string DIS_getContentFromFile(char const* fname);
-std::string DIS_getVariable(char const* fname, char const* field);
-std::vector<std::string> DIS_getDeviceInfoFromDB(std::string const& rCode);
+std::string DIS_getFirmwareRevision();
+void DIS_readCpuInfo(DeviceInfo& info);
+std::string DIS_getManufacturerName(std::string const& rCode);
 
 static std::string getFullPath(std::string const& f)
 {
@@ -66,6 +77,11 @@ public:
     }
     m_cond.notify_one();
   }
+  virtual void enqueueRecord(char const* buff, int n) override
+  {
+    enqueueForSend(buff, n);
+  }
+  virtual void setFraming(RpcFraming UNUSED_PARAM(framing)) override { }
   virtual void run() override
   {
     std::unique_lock<std::mutex> lock(m_mutex);
@@ -160,14 +176,16 @@ int main(int argc, char* argv[])
   }
   else
   {
+    std::shared_ptr<DeviceInfo const> info(new DeviceInfo(DIS_readDeviceInfo()));
+
     DeviceInfoProvider deviceInfoProvider;
-    deviceInfoProvider.GetSystemId = &DIS_getSystemId;
-    deviceInfoProvider.GetModelNumber = &DIS_getModelNumber;
-    deviceInfoProvider.GetSerialNumber = &DIS_getSerialNumber;
-    deviceInfoProvider.GetFirmwareRevision = &DIS_getFirmwareRevision;
-    deviceInfoProvider.GetHardwareRevision = &DIS_getHardwareRevision;
-    deviceInfoProvider.GetSoftwareRevision = &DIS_getSoftwareRevision;
-    deviceInfoProvider.GetManufacturerName = &DIS_getManufacturerName;
+    deviceInfoProvider.GetSystemId = [info] { return info->SystemId; };
+    deviceInfoProvider.GetModelNumber = [info] { return info->ModelNumber; };
+    deviceInfoProvider.GetSerialNumber = [info] { return info->SerialNumber; };
+    deviceInfoProvider.GetFirmwareRevision = [info] { return info->FirmwareRevision; };
+    deviceInfoProvider.GetHardwareRevision = [info] { return info->HardwareRevision; };
+    deviceInfoProvider.GetSoftwareRevision = [info] { return info->SoftwareRevision; };
+    deviceInfoProvider.GetManufacturerName = [info] { return info->ManufacturerName; };
 
     cJSON const* listenerConfig = cJSON_GetObjectItem(config, "listener");
 
@@ -196,113 +214,80 @@ int main(int argc, char* argv[])
   return 0;
 }
 
-std::string
-DIS_getSystemId()
+DeviceInfo
+DIS_readDeviceInfo()
 {
-  return DIS_getContentFromFile("/etc/machine-id");
+  DeviceInfo info;
+  info.SystemId = DIS_getContentFromFile("/etc/machine-id");
+  info.ModelNumber = DIS_getContentFromFile("/proc/device-tree/model");
+  info.FirmwareRevision = DIS_getFirmwareRevision();
+  info.SoftwareRevision = std::string(BLECONFD_VERSION);
+  DIS_readCpuInfo(info);
+  info.ManufacturerName = DIS_getManufacturerName(info.HardwareRevision);
+
+  XLOG_INFO("device serial:%s revision:%s manufacturer:%s", info.SerialNumber.c_str(),
+    info.HardwareRevision.c_str(), info.ManufacturerName.c_str());
+  return info;
 }
 
+// the first line, without the NUL device tree strings end with
 std::string
-DIS_getModelNumber()
+DIS_getContentFromFile(char const* fname)
 {
-  std::string s = DIS_getContentFromFile("/proc/device-tree/model");
-  size_t n = s.size();
-  if (s[n - 1] == '\0')
-    s = s.substr(0, (n-1));
-  return s;
-}
+  std::string s;
+
+  std::ifstream infile(fname);
+  if (!std::getline(infile, s))
+    return std::string("unknown");
+
+  while (!s.empty() && s[s.size() - 1] == '\0')
+    s.erase(s.size() - 1);
 
-std::string
-DIS_getSerialNumber()
-{
-  std::string s = DIS_getVariable("/proc/cpuinfo", "Serial");
-  XLOG_INFO("s:%s", s.c_str());
   return s;
 }
 
+// what "uname -a" printed, up to " SMP"
 std::string
 DIS_getFirmwareRevision()
 {
-  // get version from command "uname -a"
-  std::string full = runCommand("uname -a");
+  struct utsname u;
+  if (uname(&u) == -1)
+    return std::string("unknown");
+
+  std::string full = std::string(u.sysname) + " " + u.nodename + " " + u.release + " " + u.version;
   size_t index = full.find(" SMP");
   if (index != std::string::npos)
-  {
     return full.substr(0, index);
-  }
-  return full;
-}
-
-std::string
-DIS_getHardwareRevision()
-{
-  return DIS_getVariable("/proc/cpuinfo", "Revision");
-}
 
-std::string
-DIS_getSoftwareRevision()
-{
-  return std::string(BLECONFD_VERSION);
+  return full + " " + u.machine;
 }
 
-std::string
-DIS_getManufacturerName()
+// Serial and Revision, in one pass. both are missing on most boards that
+// aren't a Raspberry Pi
+void
+DIS_readCpuInfo(DeviceInfo& info)
 {
-  std::string rCode = DIS_getHardwareRevision();
-  std::vector<std::string> deviceInfo = DIS_getDeviceInfoFromDB(rCode);
+  std::ifstream infile("/proc/cpuinfo");
+  std::string line;
 
-  if (deviceInfo.size())
+  while (std::getline(infile, line))
   {
-    return deviceInfo[4];
-  }
-  return std::string("unkown");
-}
-
-std::string
-DIS_getContentFromFile(char const* fname)
-{
-  std::string id;
-
-  std::ifstream infile(fname);
-  if (!std::getline(infile, id))
-    id = "unknown";
+    size_t colon = line.find(':');
+    if (colon == std::string::npos)
+      continue;
 
-  if (id[id.size()] == '\0')
-    id = id.substr(0, id.size() - 1);
+    std::string value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
 
-  return id;
-}
-
-std::string
-DIS_getVariable(char const* file, char const* field)
-{
-  char buff[256];
-  FILE* f = fopen(file, "r");
-  while (fgets(buff, sizeof(buff) - 1, f) != nullptr)
-  {
-    if (strncmp(buff, field, strlen(field)) == 0)
-    {
-      char* p = strchr(buff, ':');
-      if (p)
-      {
-        p++;
-        while (p && isspace(*p))
-          p++;
-      }
-      if (p)
-      {
-        size_t len = strlen(p);
-        if (len > 0)
-          p[len -1] = '\0';
-        return std::string(p);
-      }
-    }
+    if (line.compare(0, 6, "Serial") == 0)
+      info.SerialNumber = value;
+    else if (line.compare(0, 8, "Revision") == 0)
+      info.HardwareRevision = value;
   }
-  return std::string();
 }
 
-std::vector<std::string>
-DIS_getDeviceInfoFromDB(std::string const& rCode)
+std::string
+DIS_getManufacturerName(std::string const& rCode)
 {
   std::ifstream mf("devices_db");
   std::string line;
@@ -310,9 +295,9 @@ DIS_getDeviceInfoFromDB(std::string const& rCode)
   while (std::getline(mf, line))
   {
     std::vector<std::string> t = split(line, ",");
-    if (!t[0].compare(rCode))
-      return t;
+    if (t.size() > 4 && !t[0].compare(rCode))
+      return t[4];
   }
 
-  return std::vector<std::string>();
+  return std::string("unkown");
 }
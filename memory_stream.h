@@ -57,6 +57,17 @@ public:
     m_stream.push(m_delimiter);
   }
 
+  // for records that carry their own framing
+  void put(char const* s, int n)
+  {
+    if (!s)
+      return;
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (int i = 0; i < n; ++i)
+      m_stream.push(s[i]);
+  }
+
   int size() const
   {
     std::lock_guard<std::mutex> guard(m_mutex);
@@ -17,6 +17,8 @@
 #include "rpcserver.h"
 #include "rpclogger.h"
 #include "jsonrpc.h"
+#include "ecdh.h"
+#include "rpcsession.h"
 
 #include <sstream>
 
@@ -25,6 +27,10 @@
 #include "bluez/gattServer.h"
 #endif
 
+#include <algorithm>
+
+#include <fnmatch.h>
+#include <openssl/crypto.h>
 #include <string.h>
 #include <stdarg.h>
 #include <sys/stat.h>
@@ -118,6 +124,11 @@ RpcService::~RpcService()
 {
 }
 
+void
+RpcService::onClientChanged()
+{
+}
+
 BasicRpcService::BasicRpcService(std::string const& name)
   : RpcService()
   , m_config(nullptr)
@@ -153,9 +164,9 @@ BasicRpcService::registerMethod(std::string const& name, RpcMethod const& method
 }
 
 void
-BasicRpcService::init(cJSON const* config, RpcNotificationFunction const& callback)
+BasicRpcService::init(cJSON const* config, RpcNotifier const& notifier)
 {
-  m_notify = callback;
+  m_notifier = notifier;
   m_config = cJSON_Duplicate(config, true);
 }
 
@@ -165,12 +176,28 @@ BasicRpcService::notifyAndDelete(cJSON* json)
   if (!json)
     return;
 
-  if (m_notify)
-    m_notify(json);
+  if (m_notifier.Notify)
+    m_notifier.Notify(json);
 
   cJSON_Delete(json);
 }
 
+void
+BasicRpcService::publishAndDelete(std::string const& topic, cJSON* params)
+{
+  if (m_notifier.Publish)
+    m_notifier.Publish(topic, params);
+
+  if (params)
+    cJSON_Delete(params);
+}
+
+bool
+BasicRpcService::isSubscribed(std::string const& topic) const
+{
+  return m_notifier.IsSubscribed && m_notifier.IsSubscribed(topic);
+}
+
 cJSON*
 BasicRpcService::invokeMethod(std::string const& name, cJSON const* req)
 {
@@ -214,6 +241,19 @@ RpcServer::RpcServer(std::string const& configFile, cJSON const* config)
   std::shared_ptr<RpcService> s(new RpcSystemService(this));
   registerService(s);
 
+  if (m_config)
+  {
+    // topics every new connection is subscribed to before it asks for
+    // anything. this keeps older clients receiving wifi events
+    cJSON const* topics = cJSON_GetObjectItem(m_config, "subscriptions");
+    for (int i = 0, n = cJSON_GetArraySize(topics); i < n; ++i)
+    {
+      cJSON const* topic = cJSON_GetArrayItem(topics, i);
+      if (topic && topic->valuestring)
+        m_default_subscriptions.push_back(topic->valuestring);
+    }
+  }
+
   if (m_config)
   {
     cJSON const* services = cJSON_GetObjectItem(config, "services");
@@ -251,15 +291,40 @@ RpcServer::~RpcServer()
 void
 RpcServer::setClient(std::shared_ptr<RpcConnectedClient> const& client)
 {
-  std::lock_guard<std::mutex> guard(m_mutex);
-  m_client = client;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_client = client;
+    m_subscriptions = m_default_subscriptions;
+    m_session.reset();
+    m_pending_session.reset();
+
+    // keys derived for the last client are no use to the next one
+    EcdhKeyManager::keyManager().endSession();
+  }
+  notifyClientChanged();
 }
 
 void
 RpcServer::stop()
 {
-  std::lock_guard<std::mutex> guard(m_mutex);
-  m_client.reset();
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_client.reset();
+    m_subscriptions.clear();
+    m_session.reset();
+    m_pending_session.reset();
+    EcdhKeyManager::keyManager().endSession();
+  }
+  notifyClientChanged();
+}
+
+// outside m_mutex, services take their own locks and may send while
+// holding them
+void
+RpcServer::notifyClientChanged()
+{
+  for (auto const& service : m_services)
+    service.second->onClientChanged();
 }
 
 void
@@ -282,21 +347,109 @@ RpcServer::enqueueAsyncMessage(cJSON const* json)
 
   {
     std::lock_guard<std::mutex> guard(m_mutex);
-    if (m_client)
-      m_client->enqueueForSend(s, n);
+    sendLocked(s, n);
     free(s);
   }
 }
 
+// once a session is up every record is sealed, otherwise they go out as
+// delimited text
+void
+RpcServer::sendLocked(char const* s, int n)
+{
+  if (!m_client)
+    return;
+
+  if (!m_session)
+  {
+    m_client->enqueueForSend(s, n);
+    return;
+  }
+
+  std::vector<char> record;
+  int ret = m_session->seal(s, n, record);
+  if (ret)
+  {
+    XLOG_ERROR("failed to seal outgoing record. %s", strerror(ret));
+    return;
+  }
+  m_client->enqueueRecord(record.data(), static_cast<int>(record.size()));
+}
+
+bool
+RpcServer::isSubscribed(std::string const& topic)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (!m_client)
+    return false;
+
+  for (std::string const& pattern : m_subscriptions)
+  {
+    if (fnmatch(pattern.c_str(), topic.c_str(), 0) == 0)
+      return true;
+  }
+  return false;
+}
+
+void
+RpcServer::publish(std::string const& topic, cJSON const* params)
+{
+  // check before serializing so unwanted events never get printed
+  if (!isSubscribed(topic))
+  {
+    XLOG_DEBUG("no subscribers for topic:%s", topic.c_str());
+    return;
+  }
+
+  cJSON* e = cJSON_CreateObject();
+  cJSON_AddItemToObject(e, "jsonrpc", cJSON_CreateString(kJsonRpcVersion));
+  cJSON_AddItemToObject(e, "method", cJSON_CreateString(topic.c_str()));
+  if (params)
+    cJSON_AddItemToObject(e, "params", cJSON_Duplicate(params, true));
+  enqueueAsyncMessage(e);
+  cJSON_Delete(e);
+}
+
+cJSON*
+RpcServer::subscriptionsToJson()
+{
+  cJSON* topics = cJSON_CreateArray();
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  for (std::string const& pattern : m_subscriptions)
+    cJSON_AddItemToArray(topics, cJSON_CreateString(pattern.c_str()));
+
+  return topics;
+}
+
 void
-RpcServer::onIncomingMessage(char const* s, int UNUSED_PARAM(n))
+RpcServer::onIncomingMessage(char const* s, int n)
 {
-  if (!s || strlen(s) == 0)
+  if (!s || n <= 0)
     return;
 
   XLOG_INFO("enqueue new incoming request");
   std::lock_guard<std::mutex> guard(m_mutex);
 
+  std::vector<char> clear;
+  if (m_session)
+  {
+    // a record that doesn't open is dropped without using up its
+    // sequence number, so a forged one can't knock the session out of step
+    int ret = m_session->open(s, n, clear);
+    if (ret)
+    {
+      XLOG_ERROR("dropping incoming record that failed to open. %s", strerror(ret));
+      return;
+    }
+    clear.push_back('\0');
+    s = clear.data();
+  }
+  else if (strlen(s) == 0)
+  {
+    return;
+  }
+
   cJSON* req = cJSON_Parse(s);
   if (req)
   {
@@ -388,14 +541,33 @@ RpcServer::processRequest(cJSON const* req)
   else
     res = processJsonRpcRequest(req);
 
+  if (!res)
+  {
+    XLOG_INFO("response deferred");
+    return;
+  }
+
   char* s = cJSON_Print(res);
   if (s)
   {
     XLOG_INFO("res:%s", s);
     {
       std::lock_guard<std::mutex> guard(m_mutex);
-      if (m_client)
+
+      // the reply that starts a session goes out in the clear, and the
+      // client waits for it before sending records. switching the framing
+      // first means no record can arrive before the client expects it
+      std::unique_ptr<RpcSession> session(std::move(m_pending_session));
+      if (session && m_client && !cJSON_GetObjectItem(res, "error"))
+      {
+        m_client->setFraming(RpcFraming::LengthPrefixed);
         m_client->enqueueForSend(s, strlen(s));
+        m_session = std::move(session);
+      }
+      else
+      {
+        sendLocked(s, strlen(s));
+      }
     }
     free(s);
   }
@@ -472,6 +644,9 @@ RpcServer::processJsonRpcRequest(cJSON const* req)
     }
   }
 
+  if (res == JsonRpc::deferred())
+    return nullptr;
+
   // if function returned { "code": 1234, ... } where code != 0, then
   // it's an error, else it was ok. This is handled by the wrapResponse
   int code = JsonRpc::getInt(res, "code", false, 0);
@@ -482,8 +657,12 @@ void
 RpcServer::registerService(std::shared_ptr<RpcService> const& service)
 {
   XLOG_INFO("registering service:%s", service->name().c_str());
-  RpcNotificationFunction callback = std::bind(&RpcServer::enqueueAsyncMessage, this,
-    std::placeholders::_1);
+
+  RpcNotifier notifier;
+  notifier.IsSubscribed = std::bind(&RpcServer::isSubscribed, this, std::placeholders::_1);
+  notifier.Publish = std::bind(&RpcServer::publish, this, std::placeholders::_1,
+    std::placeholders::_2);
+  notifier.Notify = std::bind(&RpcServer::enqueueAsyncMessage, this, std::placeholders::_1);
   m_services.insert(std::make_pair(service->name(), service));
 
   // TODO: someone update JsonRpc::search to handle lists so we can do
@@ -510,7 +689,7 @@ RpcServer::registerService(std::shared_ptr<RpcService> const& service)
   if (conf == nullptr)
     XLOG_WARN("service %s is missing configuration", service->name().c_str());
 
-  service->init(conf, callback);
+  service->init(conf, notifier);
 }
 
 RpcServer::RpcSystemService::RpcSystemService(RpcServer* parent)
@@ -525,27 +704,152 @@ RpcServer::RpcSystemService::~RpcSystemService()
 
 void
 RpcServer::RpcSystemService::init(cJSON const* UNUSED_PARAM(config),
-  RpcNotificationFunction const& UNUSED_PARAM(callback))
+  RpcNotifier const& UNUSED_PARAM(notifier))
 {
-  // openssl genpkey -algorithm Ec -pkeyopt ec_paramgen_curve:P-256 -pkeyopt ec_param_enc:named_curve > /tmp/bootstrap_private.pem
-  // openssl pkey -pubout -in /tmp/bootstrap_private.pem > /tmp/bootstrap_public.pem
+  // "bootstrap-key": { "private-key": "...", "public-key": "...",
+  //   "rotate-interval": 86400, "rotate-per-session": true }
+  // the key is created if there's none, off this thread
+  EcdhKeyOptions keyOptions;
+  cJSON const* config = m_server->m_config;
+  if (config)
+  {
+    cJSON const* perSession = JsonRpc::search(config, "/bootstrap-key/rotate-per-session", false);
+    keyOptions.PrivateKeyPath = JsonRpc::getString(config, "/bootstrap-key/private-key", false,
+      kPrivateKeyPath);
+    keyOptions.PublicKeyPath = JsonRpc::getString(config, "/bootstrap-key/public-key", false,
+      kPublicKeyPath);
+    keyOptions.RotateInterval = JsonRpc::getInt(config, "/bootstrap-key/rotate-interval", false, 0);
+    keyOptions.RotatePerSession = perSession && perSession->type == cJSON_True;
+  }
+
+  int ret = EcdhKeyManager::keyManager().start(keyOptions);
+  if (ret)
+    XLOG_WARN("failed to start bootstrap key manager. %s", strerror(ret));
 
   registerMethod("list-services", [this](cJSON const* req) -> cJSON* { return this->listServices(req); });
   registerMethod("list-methods", [this](cJSON const* req) -> cJSON* { return this->listMethods(req); });
   registerMethod("get-server-pubkey", [this](cJSON const* req) -> cJSON* { return this->getServerPublicKey(req); });
   registerMethod("set-client-pubkey", [this](cJSON const* req) -> cJSON* { return this->setClientPublicKey(req); });
+  registerMethod("subscribe", [this](cJSON const* req) -> cJSON* { return this->subscribe(req); });
+  registerMethod("unsubscribe", [this](cJSON const* req) -> cJSON* { return this->unsubscribe(req); });
 }
 
 cJSON*
-RpcServer::RpcSystemService::getServerPublicKey(cJSON const* req)
+RpcServer::RpcSystemService::subscribe(cJSON const* req)
 {
-  return JsonRpc::notImplemented(__FUNCTION__);
+  // { "topics": ["wifi.*", "config.changed"] }
+  cJSON const* topics = JsonRpc::search(req, "/params/topics", true);
+
+  {
+    std::lock_guard<std::mutex> guard(m_server->m_mutex);
+    std::vector<std::string>& subscriptions = m_server->m_subscriptions;
+    for (int i = 0, n = cJSON_GetArraySize(topics); i < n; ++i)
+    {
+      cJSON const* topic = cJSON_GetArrayItem(topics, i);
+      if (!topic || !topic->valuestring)
+        continue;
+      if (std::find(subscriptions.begin(), subscriptions.end(), topic->valuestring) == subscriptions.end())
+        subscriptions.push_back(topic->valuestring);
+    }
+  }
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddItemToObject(res, "topics", m_server->subscriptionsToJson());
+  return res;
 }
 
+cJSON*
+RpcServer::RpcSystemService::unsubscribe(cJSON const* req)
+{
+  cJSON const* topics = JsonRpc::search(req, "/params/topics", true);
+
+  {
+    std::lock_guard<std::mutex> guard(m_server->m_mutex);
+    std::vector<std::string>& subscriptions = m_server->m_subscriptions;
+    for (int i = 0, n = cJSON_GetArraySize(topics); i < n; ++i)
+    {
+      cJSON const* topic = cJSON_GetArrayItem(topics, i);
+      if (!topic || !topic->valuestring)
+        continue;
+      subscriptions.erase(std::remove(subscriptions.begin(), subscriptions.end(),
+        std::string(topic->valuestring)), subscriptions.end());
+    }
+  }
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddItemToObject(res, "topics", m_server->subscriptionsToJson());
+  return res;
+}
+
+// answered from memory. EAGAIN only right after startup, while the first
+// key is being created
+cJSON*
+RpcServer::RpcSystemService::getServerPublicKey(cJSON const* UNUSED_PARAM(req))
+{
+  std::string key;
+  int ret = EcdhKeyManager::keyManager().getPublicKey(key);
+  if (ret)
+    return JsonRpc::makeError(ret, "no server key. %s", strerror(ret));
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddStringToObject(res, "pubKey", key.c_str());
+  return res;
+}
+
+// { "pubKey": "MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAE...", "session": "aes-256-gcm" }
+// the shared key is derived now, so the first encrypted message doesn't
+// wait for it. with a session cipher, every record after this reply is
+// sealed with keys derived from it
 cJSON*
 RpcServer::RpcSystemService::setClientPublicKey(cJSON const* req)
 {
-  return JsonRpc::notImplemented(__FUNCTION__);
+  char const* key = JsonRpc::getString(req, "/params/pubKey", true);
+  char const* name = JsonRpc::getString(req, "/params/session", false);
+
+  RpcCipher cipher = RpcCipher::Aes256Gcm;
+  if (name && RpcSession::parseCipher(name, &cipher) != 0)
+    return JsonRpc::makeError(EINVAL, "unsupported session cipher %s", name);
+
+  // the session's keys stay until the client disconnects. swapping the
+  // peer key under it would leave the two ends with different keys
+  {
+    std::lock_guard<std::mutex> guard(m_server->m_mutex);
+    if (m_server->m_session)
+      return JsonRpc::makeError(EALREADY, "session already started");
+  }
+
+  EcdhKeyManager& keys = EcdhKeyManager::keyManager();
+  int ret = keys.setSessionPeer(key);
+  if (ret)
+    return JsonRpc::makeError(ret, "failed to use client key. %s", strerror(ret));
+
+  cJSON* res = cJSON_CreateObject();
+  if (!name)
+    return res;
+
+  // the cipher's name is part of the label, so both ends have to agree on
+  // it to get the same keys
+  std::string info = std::string("bleconfd session ") + RpcSession::cipherName(cipher);
+
+  unsigned char material[RpcSession::kKeyMaterialSize];
+  std::unique_ptr<RpcSession> session(new RpcSession());
+  ret = keys.deriveSessionKey(info, material, sizeof(material));
+  if (ret == 0)
+    ret = session->init(cipher, material, sizeof(material), true);
+  OPENSSL_cleanse(material, sizeof(material));
+
+  if (ret)
+  {
+    cJSON_Delete(res);
+    return JsonRpc::makeError(ret, "failed to start session. %s", strerror(ret));
+  }
+
+  cJSON_AddStringToObject(res, "session", RpcSession::cipherName(cipher));
+  {
+    std::lock_guard<std::mutex> guard(m_server->m_mutex);
+    m_server->m_pending_session = std::move(session);
+  }
+  return res;
 }
 
 cJSON*
@@ -23,13 +23,17 @@
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 
 struct cJSON;
 class RpcService;
+class RpcSession;
 
 using RpcDataHandler = std::function<void (char const* buff, int n)>;
 using RpcNotificationFunction = std::function<void (cJSON const* json)>;
+using RpcTopicFilter = std::function<bool (std::string const& topic)>;
+using RpcPublishFunction = std::function<void (std::string const& topic, cJSON const* params)>;
 using RpcMethod = std::function<cJSON* (cJSON const* req)>;
 using RpcMethodMap = std::map< std::string, RpcMethod >;
 using RpcServiceConstructor = std::function<RpcService* ()>;
@@ -45,6 +49,26 @@ struct DeviceInfoProvider
   std::function< std::string () > GetManufacturerName;
 };
 
+// Services push data to the client through this. Publish only goes out
+// if the connected client subscribed to a matching topic, and IsSubscribed
+// lets a service skip building events nobody wants. Notify is unfiltered
+// and meant for partial results of a request the client is waiting on.
+struct RpcNotifier
+{
+  RpcTopicFilter          IsSubscribed;
+  RpcPublishFunction      Publish;
+  RpcNotificationFunction Notify;
+};
+
+// How the client splits its incoming bytes into records. Delimited text
+// records end with a record separator. LengthPrefixed records carry their
+// own length, as the binary records of an encrypted session do.
+enum class RpcFraming
+{
+  Delimited,
+  LengthPrefixed
+};
+
 class RpcConnectedClient
 {
 public:
@@ -52,6 +76,10 @@ public:
   virtual ~RpcConnectedClient() { }
   virtual void init(DeviceInfoProvider const& deviceInfoProvider) = 0;
   virtual void enqueueForSend(char const* buff, int n) = 0;
+  // queues a record that is already framed, as is
+  virtual void enqueueRecord(char const* buff, int n) = 0;
+  // applies to incoming bytes from the next one on
+  virtual void setFraming(RpcFraming framing) = 0;
   virtual void run() = 0;
   virtual void setDataHandler(RpcDataHandler const& handler) = 0;
 };
@@ -61,11 +89,16 @@ class RpcService
 public:
   RpcService();
   virtual ~RpcService();
-  virtual void init(cJSON const* conf, RpcNotificationFunction const& callback)  = 0;
+  virtual void init(cJSON const* conf, RpcNotifier const& notifier)  = 0;
   virtual std::string name() const = 0;
   virtual std::vector<std::string> methodNames() const = 0;
   virtual cJSON* invokeMethod(std::string const& name, cJSON const* req) = 0;
 
+  // called after a new client connects or the last one goes away.
+  // anything kept for the last client, like a request that hasn't been
+  // answered yet, should be dropped
+  virtual void onClientChanged();
+
 public:
   static void registerServiceConstructor(std::string const& name, RpcServiceConstructor const& ctor);
   static RpcService* createServiceByName(std::string const& name);
@@ -87,11 +120,15 @@ public:
   virtual std::string name() const override;
   virtual std::vector<std::string> methodNames() const override;
   virtual cJSON* invokeMethod(std::string const& name, cJSON const* req) override;
-  virtual void init(cJSON const* conf, RpcNotificationFunction const& callback) override;
+  virtual void init(cJSON const* conf, RpcNotifier const& notifier) override;
 
 protected:
   void registerMethod(std::string const& name, RpcMethod const& method);
   void notifyAndDelete(cJSON* json);
+  void publishAndDelete(std::string const& topic, cJSON* params);
+  bool isSubscribed(std::string const& topic) const;
+  RpcNotifier const& notifier() const
+    { return m_notifier; }
 
 protected:
   cJSON*                  m_config;
@@ -99,7 +136,7 @@ protected:
 private:
   RpcMethodMap            m_methods;
   std::string             m_name;
-  RpcNotificationFunction m_notify;
+  RpcNotifier             m_notifier;
 };
 
 class RpcListener
@@ -127,12 +164,14 @@ private:
   public:
     RpcSystemService(RpcServer* parent);
     virtual ~RpcSystemService();
-    virtual void init(cJSON const* conf, RpcNotificationFunction const& callback) override;
+    virtual void init(cJSON const* conf, RpcNotifier const& notifier) override;
   private:
     cJSON* listServices(cJSON const* req);
     cJSON* listMethods(cJSON const* req);
     cJSON* getServerPublicKey(cJSON const* req);
     cJSON* setClientPublicKey(cJSON const* req);
+    cJSON* subscribe(cJSON const* req);
+    cJSON* unsubscribe(cJSON const* req);
   private:
     RpcServer* m_server;
   };
@@ -157,6 +196,8 @@ public:
   void stop();
   void run();
   void enqueueAsyncMessage(cJSON const* json);
+  void publish(std::string const& topic, cJSON const* params);
+  bool isSubscribed(std::string const& topic);
   void onIncomingMessage(const char* buff, int n);
   void setLastChanceHandler(RpcMethod const& lastChanceHandler);
 
@@ -166,6 +207,9 @@ private:
   cJSON* processJsonRpcRequest(cJSON const* req);
   cJSON* processNonJsonRpcRequest(cJSON const* req);
   cJSON* invokeMethod(RpcMethodInfo const& methodInfo, cJSON const* req);
+  cJSON* subscriptionsToJson();
+  void sendLocked(char const* s, int n);
+  void notifyClientChanged();
 
 private:
   std::shared_ptr<RpcConnectedClient> m_client;
@@ -178,6 +222,10 @@ private:
   std::string                         m_config_file;
   RpcMethod                           m_last_chance;
   bool                                m_running;
+  std::vector<std::string>            m_subscriptions;
+  std::vector<std::string>            m_default_subscriptions;
+  std::unique_ptr<RpcSession>         m_session;
+  std::unique_ptr<RpcSession>         m_pending_session;
 };
 
 // not sure where to put these
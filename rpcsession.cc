@@ -0,0 +1,211 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "rpcsession.h"
+#include "rpclogger.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+
+namespace
+{
+  EVP_CIPHER const*
+  evpCipher(RpcCipher cipher)
+  {
+    return cipher == RpcCipher::ChaCha20Poly1305 ? EVP_chacha20_poly1305() : EVP_aes_256_gcm();
+  }
+
+  char const*
+  cryptoError()
+  {
+    static char buff[256];
+    ERR_error_string_n(ERR_get_error(), buff, sizeof(buff));
+    return buff;
+  }
+
+  // sets up a context with its key once. each record only sets the nonce
+  EVP_CIPHER_CTX*
+  newContext(RpcCipher cipher, uint8_t const* key, bool encrypt)
+  {
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+      return nullptr;
+
+    bool ok = EVP_CipherInit_ex(ctx, evpCipher(cipher), nullptr, nullptr, nullptr, encrypt) == 1 &&
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, RpcSession::kIvSize, nullptr) == 1 &&
+      EVP_CipherInit_ex(ctx, nullptr, nullptr, key, nullptr, encrypt) == 1;
+    if (!ok)
+    {
+      XLOG_ERROR("failed to create session cipher context. %s", cryptoError());
+      EVP_CIPHER_CTX_free(ctx);
+      return nullptr;
+    }
+    return ctx;
+  }
+}
+
+RpcSession::RpcSession()
+{
+  memset(&m_seal, 0, sizeof(m_seal));
+  memset(&m_open, 0, sizeof(m_open));
+}
+
+RpcSession::~RpcSession()
+{
+  if (m_seal.Ctx)
+    EVP_CIPHER_CTX_free(m_seal.Ctx);
+  if (m_open.Ctx)
+    EVP_CIPHER_CTX_free(m_open.Ctx);
+}
+
+int
+RpcSession::parseCipher(char const* name, RpcCipher* cipher)
+{
+  if (!name)
+    return EINVAL;
+
+  if (strcmp(name, "aes-256-gcm") == 0)
+    *cipher = RpcCipher::Aes256Gcm;
+  else if (strcmp(name, "chacha20-poly1305") == 0)
+    *cipher = RpcCipher::ChaCha20Poly1305;
+  else
+    return EINVAL;
+
+  return 0;
+}
+
+char const*
+RpcSession::cipherName(RpcCipher cipher)
+{
+  return cipher == RpcCipher::ChaCha20Poly1305 ? "chacha20-poly1305" : "aes-256-gcm";
+}
+
+int
+RpcSession::init(RpcCipher cipher, uint8_t const* keys, size_t n, bool server)
+{
+  if (!keys || n != kKeyMaterialSize || m_seal.Ctx || m_open.Ctx)
+    return EINVAL;
+
+  uint8_t const* clientKey = keys;
+  uint8_t const* clientIv = clientKey + kKeySize;
+  uint8_t const* serverKey = clientIv + kIvSize;
+  uint8_t const* serverIv = serverKey + kKeySize;
+
+  m_seal.Ctx = newContext(cipher, server ? serverKey : clientKey, true);
+  m_open.Ctx = newContext(cipher, server ? clientKey : serverKey, false);
+  if (!m_seal.Ctx || !m_open.Ctx)
+    return ENOMEM;
+
+  memcpy(m_seal.Iv, server ? serverIv : clientIv, kIvSize);
+  memcpy(m_open.Iv, server ? clientIv : serverIv, kIvSize);
+  return 0;
+}
+
+void
+RpcSession::makeNonce(Direction const& dir, uint8_t* nonce)
+{
+  memcpy(nonce, dir.Iv, kIvSize);
+  for (size_t i = 0; i < 8; ++i)
+    nonce[kIvSize - 1 - i] ^= static_cast<uint8_t>(dir.Sequence >> (8 * i));
+}
+
+size_t
+RpcSession::recordSize(uint8_t const* header)
+{
+  size_t n = (static_cast<size_t>(header[0]) << 24) | (static_cast<size_t>(header[1]) << 16) |
+    (static_cast<size_t>(header[2]) << 8) | static_cast<size_t>(header[3]);
+  if (n < kTagSize || n > kMaxRecordSize - kHeaderSize)
+    return 0;
+  return n + kHeaderSize;
+}
+
+int
+RpcSession::seal(char const* clear, size_t n, std::vector<char>& record)
+{
+  if (!m_seal.Ctx)
+    return ENOTCONN;
+  if (n + kTagSize > kMaxRecordSize - kHeaderSize)
+    return EMSGSIZE;
+
+  size_t start = record.size();
+  record.resize(start + kHeaderSize + n + kTagSize);
+
+  uint8_t* header = reinterpret_cast<uint8_t *>(&record[start]);
+  uint8_t* body = header + kHeaderSize;
+  uint32_t length = static_cast<uint32_t>(n + kTagSize);
+  header[0] = static_cast<uint8_t>(length >> 24);
+  header[1] = static_cast<uint8_t>(length >> 16);
+  header[2] = static_cast<uint8_t>(length >> 8);
+  header[3] = static_cast<uint8_t>(length);
+
+  uint8_t nonce[kIvSize];
+  makeNonce(m_seal, nonce);
+
+  int len = 0;
+  bool ok = EVP_EncryptInit_ex(m_seal.Ctx, nullptr, nullptr, nullptr, nonce) == 1 &&
+    EVP_EncryptUpdate(m_seal.Ctx, nullptr, &len, header, kHeaderSize) == 1 &&
+    EVP_EncryptUpdate(m_seal.Ctx, body, &len, reinterpret_cast<uint8_t const *>(clear), n) == 1 &&
+    EVP_EncryptFinal_ex(m_seal.Ctx, body + len, &len) == 1 &&
+    EVP_CIPHER_CTX_ctrl(m_seal.Ctx, EVP_CTRL_AEAD_GET_TAG, kTagSize, body + n) == 1;
+  if (!ok)
+  {
+    XLOG_ERROR("failed to seal record. %s", cryptoError());
+    record.resize(start);
+    return EINVAL;
+  }
+
+  m_seal.Sequence++;
+  return 0;
+}
+
+int
+RpcSession::open(char const* record, size_t n, std::vector<char>& clear)
+{
+  if (!m_open.Ctx)
+    return ENOTCONN;
+
+  uint8_t const* header = reinterpret_cast<uint8_t const *>(record);
+  if (n < kHeaderSize || recordSize(header) != n)
+    return EBADMSG;
+
+  uint8_t const* body = header + kHeaderSize;
+  size_t length = n - kHeaderSize - kTagSize;
+  clear.resize(length);
+
+  uint8_t nonce[kIvSize];
+  makeNonce(m_open, nonce);
+
+  int len = 0;
+  uint8_t* out = reinterpret_cast<uint8_t *>(clear.data());
+  bool ok = EVP_DecryptInit_ex(m_open.Ctx, nullptr, nullptr, nullptr, nonce) == 1 &&
+    EVP_DecryptUpdate(m_open.Ctx, nullptr, &len, header, kHeaderSize) == 1 &&
+    EVP_DecryptUpdate(m_open.Ctx, out, &len, body, length) == 1 &&
+    EVP_CIPHER_CTX_ctrl(m_open.Ctx, EVP_CTRL_AEAD_SET_TAG, kTagSize,
+      const_cast<uint8_t *>(body + length)) == 1 &&
+    EVP_DecryptFinal_ex(m_open.Ctx, out + len, &len) == 1;
+  if (!ok)
+  {
+    ERR_clear_error();
+    OPENSSL_cleanse(clear.data(), clear.size());
+    clear.clear();
+    return EBADMSG;
+  }
+
+  m_open.Sequence++;
+  return 0;
+}
@@ -0,0 +1,96 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __RPC_SESSION_H__
+#define __RPC_SESSION_H__
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+enum class RpcCipher
+{
+  Aes256Gcm,
+  ChaCha20Poly1305
+};
+
+// Seals and opens the records of an encrypted session. A record is
+//
+//   [ length:4 ][ ciphertext ][ tag:16 ]
+//
+// where length is big-endian and counts the ciphertext and tag. The length
+// bytes are authenticated as additional data. Each direction has its own
+// key and IV, and the nonce of a record is the IV xor'd with the number of
+// records sent before it, as in TLS 1.3, so nonces never go on the wire and
+// a replayed, dropped or reordered record fails to open.
+class RpcSession
+{
+public:
+  static size_t const kHeaderSize = 4;
+  static size_t const kTagSize = 16;
+  static size_t const kKeySize = 32;
+  static size_t const kIvSize = 12;
+
+  // client-to-server key and IV, then server-to-client key and IV
+  static size_t const kKeyMaterialSize = 2 * (kKeySize + kIvSize);
+
+  // bounds what a peer can make the other side buffer
+  static size_t const kMaxRecordSize = 256 * 1024;
+
+  RpcSession();
+  ~RpcSession();
+
+  // "aes-256-gcm" or "chacha20-poly1305". returns 0 or EINVAL
+  static int parseCipher(char const* name, RpcCipher* cipher);
+  static char const* cipherName(RpcCipher cipher);
+
+  // key material laid out as described by kKeyMaterialSize. server is
+  // true on bleconfd's side. the material isn't kept, only the cipher
+  // contexts built from it. returns 0 or an errno
+  int init(RpcCipher cipher, uint8_t const* keys, size_t n, bool server);
+
+  // appends the record for n bytes of clear text to record
+  int seal(char const* clear, size_t n, std::vector<char>& record);
+
+  // opens one whole record, header included. a record that fails to open
+  // doesn't use up a sequence number
+  int open(char const* record, size_t n, std::vector<char>& clear);
+
+  // the length of the record that starts with header, or 0 if it's
+  // too big
+  static size_t recordSize(uint8_t const* header);
+
+private:
+  RpcSession(RpcSession const&) = delete;
+  RpcSession& operator = (RpcSession const&) = delete;
+
+  struct Direction
+  {
+    EVP_CIPHER_CTX* Ctx;
+    uint8_t         Iv[kIvSize];
+    uint64_t        Sequence;
+  };
+
+  static void makeNonce(Direction const& dir, uint8_t* nonce);
+
+private:
+  Direction m_seal;
+  Direction m_open;
+};
+
+#endif
@@ -14,24 +14,78 @@
 // limitations under the License.
 //
 #include "appsettings.h"
+#include "coprocess.h"
 #include "../rpclogger.h"
 #include "../jsonrpc.h"
 
 #include <glib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <libgen.h>
+#include <poll.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
+
+// An entry of /settings/dynamic_properties, compiled once at init
+struct DynamicProperty
+{
+  enum class CachePolicy
+  {
+    Never,
+    Static,
+    Ttl
+  };
+
+  std::string               Name;
+  std::string               Exec;
+  std::vector<std::string>  Argv;
+  CachePolicy               Cache;
+  int                       Ttl;
+
+  // set when the command runs as a long lived helper instead of once
+  // per call
+  std::shared_ptr<CoProcessPool> Workers;
+};
 
 namespace
 {
   char const* kDefaultGroupName = "user";
 
+  // how long a set waits for more sets before the file is written. a
+  // steady stream of sets is still written at least every
+  // kMaxFlushDelay intervals
+  int const kDefaultFlushInterval = 1000;
+  int const kMaxFlushDelay = 4;
+
+  // per call limit for dynamic properties served by a helper
+  int const kDefaultCoProcessTimeout = 5000;
+
+  // threads a get-many runs dynamic properties on, whatever the number of
+  // keys asked for
+  int const kMaxParallelGets = 4;
+
+  // shared with the flusher and the file watcher, only touched while
+  // holding AppSettingsService::m_mutex
   GKeyFile* keyFile = g_key_file_new();
 
   gchar*
-  configGetString(char const* section, char const* name, char const* defaultValue)
+  configGetString(GKeyFile* file, char const* section, char const* name, char const* defaultValue)
   {
     g_autoptr(GError) error = nullptr;
-    gchar* value = g_key_file_get_string(keyFile, section, name, &error);
+    gchar* value = g_key_file_get_string(file, section, name, &error);
     if (!value)
     {
       if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) &&
@@ -55,34 +109,59 @@ namespace
     Set
   };
 
+  // sends "get <key>" or "set <key> <value>" to the property's helper
   cJSON*
-  exec(cJSON const* req, cJSON const* conf, DynamicPropertyOperation op)
+  callCoProcess(DynamicProperty const& prop, std::string const& value, DynamicPropertyOperation op)
   {
-    cJSON* res = nullptr;
+    std::string request(op == DynamicPropertyOperation::Get ? "get " : "set ");
+    request += prop.Name;
+    if (op == DynamicPropertyOperation::Set)
+    {
+      request += ' ';
+      request += value;
+    }
+
+    std::string reply;
+    int err = prop.Workers->call(request, reply);
+    if (err)
+      return JsonRpc::makeError(err, "failed to call %s. %s", prop.Exec.c_str(), strerror(err));
 
-    char const* key = JsonRpc::getString(req, "/params/key", true);
-    XLOG_INFO("executing command for setting %s", key);
+    std::string text;
+    if (!coProcessParseReply(reply, text))
+      return JsonRpc::makeError(-1, "%s failed. %s", prop.Exec.c_str(), text.c_str());
 
-    std::string cmdline = JsonRpc::getString(conf, "exec", true);
     if (op == DynamicPropertyOperation::Get)
-    {
-      cmdline += " get ";
-      cmdline += key;
-    }
-    else
-    {
-      char const* value = JsonRpc::getString(req, "/params/value", true);
-      cmdline += " set ";
-      cmdline += key;
-      cmdline + " ";
-      cmdline + value;
-    }
+      return cJSON_CreateString(text.c_str());
+    return cJSON_CreateNumber(0);
+  }
+
+  // runs "<exec> get <key>" or "<exec> set <key> <value>". the value is
+  // passed as a single argument and is never parsed by a shell
+  cJSON*
+  exec(DynamicProperty const& prop, std::string const& value, DynamicPropertyOperation op)
+  {
+    if (prop.Workers)
+      return callCoProcess(prop, value, op);
+
+    cJSON* res = nullptr;
+
+    XLOG_INFO("executing command for setting %s", prop.Name.c_str());
+
+    std::vector<char*> argv;
+    for (std::string const& arg : prop.Argv)
+      argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(const_cast<char*>(op == DynamicPropertyOperation::Get ? "get" : "set"));
+    argv.push_back(const_cast<char*>(prop.Name.c_str()));
+    if (op == DynamicPropertyOperation::Set)
+      argv.push_back(const_cast<char*>(value.c_str()));
+    argv.push_back(nullptr);
 
     g_autofree gchar* out = nullptr;
     g_autofree gchar* err = nullptr;
     gint exit_status = 0;
     g_autoptr(GError) error = nullptr;
-    gboolean b = g_spawn_command_line_sync(cmdline.c_str(), &out, &err, &exit_status, &error);
+    gboolean b = g_spawn_sync(nullptr, &argv[0], nullptr, G_SPAWN_SEARCH_PATH, nullptr, nullptr,
+      &out, &err, &exit_status, &error);
 
     XLOG_INFO("ret:%d", b);
     XLOG_INFO("out:%s", out);
@@ -110,37 +189,380 @@ namespace
       if (code == 0)
         code = -1;
 
-      char const* message = nullptr;
+      char const* message = "";
       if (error)
         message = error->message;
 
-      res = JsonRpc::makeError(code, "failed to execute %s. %s", cmdline.c_str(), message);
+      res = JsonRpc::makeError(code, "failed to execute %s. %s", prop.Exec.c_str(), message);
     }
 
     return res;
   }
+
+  using KeyFileKey = std::pair<std::string, std::string>;
+
+  void
+  collectKeys(GKeyFile* file, std::set<KeyFileKey>& keys)
+  {
+    g_auto(GStrv) groups = g_key_file_get_groups(file, nullptr);
+    for (gchar** group = groups; group && *group; ++group)
+    {
+      g_auto(GStrv) names = g_key_file_get_keys(file, *group, nullptr, nullptr);
+      for (gchar** name = names; name && *name; ++name)
+        keys.insert(KeyFileKey(*group, *name));
+    }
+  }
+
+  bool
+  sameValue(char const* a, char const* b)
+  {
+    if (!a || !b)
+      return a == b;
+    return strcmp(a, b) == 0;
+  }
+
+  // applies whatever changed between two versions of the settings file to
+  // target. keys that differ between target and the file but not between
+  // the two versions are pending sets and are left alone. returns the keys
+  // of the default group whose value in target changed
+  std::vector<std::string>
+  applyFileChanges(GKeyFile* before, GKeyFile* after, GKeyFile* target)
+  {
+    std::set<KeyFileKey> keys;
+    collectKeys(before, keys);
+    collectKeys(after, keys);
+
+    std::vector<std::string> changed;
+    for (KeyFileKey const& key : keys)
+    {
+      char const* group = key.first.c_str();
+      char const* name = key.second.c_str();
+
+      g_autofree gchar* oldValue = g_key_file_get_value(before, group, name, nullptr);
+      g_autofree gchar* newValue = g_key_file_get_value(after, group, name, nullptr);
+      if (sameValue(oldValue, newValue))
+        continue;
+
+      g_autofree gchar* value = g_key_file_get_value(target, group, name, nullptr);
+      if (sameValue(value, newValue))
+        continue;
+
+      if (newValue)
+        g_key_file_set_value(target, group, name, newValue);
+      else
+        g_key_file_remove_key(target, group, name, nullptr);
+
+      if (key.first == kDefaultGroupName)
+        changed.push_back(key.second);
+    }
+
+    return changed;
+  }
+
+  void
+  updateWatches(cJSON const* names, std::set<std::string>& watches, bool add)
+  {
+    if (!names)
+      return;
+
+    for (int i = 0, n = cJSON_GetArraySize(names); i < n; ++i)
+    {
+      cJSON const* name = cJSON_GetArrayItem(names, i);
+      if (!name->valuestring)
+        continue;
+      if (add)
+        watches.insert(name->valuestring);
+      else
+        watches.erase(name->valuestring);
+    }
+  }
+
+  // characters that would change the meaning of a key file line
+  bool
+  isValidKey(char const* key)
+  {
+    return key && *key && !strpbrk(key, "=[]\n\r") && !isspace(key[0]);
+  }
 }
 
 JSONRPC_SERVICE_DEFINE(config, []{return new AppSettingsService();});
 
+// Compiled form of /settings/dynamic_properties. Built once at init and
+// read-only after that, so lookups need no lock.
+class DynamicPropertyIndex
+{
+public:
+  void load(cJSON const* props);
+  DynamicProperty const* find(char const* name) const;
+
+  std::vector<std::string> const& names() const
+    { return m_names; }
+
+private:
+  std::unordered_map< std::string, DynamicProperty >  m_properties;
+  std::vector<std::string>                            m_names;
+};
+
+void
+DynamicPropertyIndex::load(cJSON const* props)
+{
+  m_properties.clear();
+  m_names.clear();
+
+  if (!props)
+  {
+    XLOG_DEBUG("no dynamic properties configured");
+    return;
+  }
+
+  for (int i = 0, n = cJSON_GetArraySize(props); i < n; ++i)
+  {
+    cJSON const* conf = cJSON_GetArrayItem(props, i);
+    char const* name = JsonRpc::getString(conf, "name", false);
+    char const* exec = JsonRpc::getString(conf, "exec", false);
+    if (!name || !exec)
+    {
+      XLOG_WARN("dynamic property %d needs a name and exec, skipping", i);
+      continue;
+    }
+
+    if (m_properties.find(name) != m_properties.end())
+    {
+      XLOG_WARN("dynamic property %s is defined more than once, using the first", name);
+      continue;
+    }
+
+    gint argc = 0;
+    g_auto(GStrv) argv = nullptr;
+    g_autoptr(GError) error = nullptr;
+    if (!g_shell_parse_argv(exec, &argc, &argv, &error))
+    {
+      XLOG_ERROR("failed to parse exec for dynamic property %s. %s", name, error->message);
+      continue;
+    }
+
+    DynamicProperty prop;
+    prop.Name = name;
+    prop.Exec = exec;
+    prop.Argv.assign(argv, argv + argc);
+
+    char const* policy = JsonRpc::getString(conf, "cache", false, "never");
+    prop.Ttl = JsonRpc::getInt(conf, "ttl", false, 0);
+    if (strcmp(policy, "static") == 0)
+      prop.Cache = DynamicProperty::CachePolicy::Static;
+    else if (strcmp(policy, "ttl") == 0 && prop.Ttl > 0)
+      prop.Cache = DynamicProperty::CachePolicy::Ttl;
+    else
+    {
+      if (strcmp(policy, "never") != 0)
+        XLOG_WARN("unknown or incomplete cache policy '%s' for %s, not caching", policy, name);
+      prop.Cache = DynamicProperty::CachePolicy::Never;
+    }
+
+    // "mode": "coprocess" keeps "workers" copies of exec running and
+    // talks to them a line at a time
+    char const* mode = JsonRpc::getString(conf, "mode", false, "exec");
+    if (strcmp(mode, "coprocess") == 0)
+    {
+      prop.Workers = std::make_shared<CoProcessPool>(prop.Argv,
+        JsonRpc::getInt(conf, "workers", false, 1),
+        JsonRpc::getInt(conf, "timeout", false, kDefaultCoProcessTimeout));
+    }
+
+    m_names.push_back(prop.Name);
+    m_properties.emplace(prop.Name, std::move(prop));
+  }
+
+  XLOG_INFO("loaded %d dynamic properties", static_cast<int>(m_names.size()));
+}
+
+DynamicProperty const*
+DynamicPropertyIndex::find(char const* name) const
+{
+  auto itr = m_properties.find(name);
+  return itr != m_properties.end() ? &itr->second : nullptr;
+}
+
+// Values from dynamic property commands. Each property picks a policy
+// in bleconfd.json:
+//   "cache": "never"              run the command every time (default)
+//   "cache": "static"             run it once, the value never changes
+//   "cache": "ttl", "ttl": 30     reuse the value for 30 seconds
+// Concurrent gets for the same key share one run of the command no
+// matter the policy. A set of the key drops whatever is cached.
+class DynamicPropertyCache
+{
+public:
+  DynamicPropertyCache()
+    : m_hits(0)
+    , m_misses(0)
+    , m_shared(0) { }
+
+  cJSON* get(DynamicProperty const& prop, std::function<cJSON* ()> const& fetch);
+  void invalidate(std::string const& key);
+  cJSON* stats() const;
+
+private:
+  using Result = std::shared_ptr<cJSON>;
+  using Clock = std::chrono::steady_clock;
+
+  struct Entry
+  {
+    std::string       Value;
+    bool              Expires;
+    Clock::time_point Expiry;
+  };
+
+private:
+  mutable std::mutex                                    m_mutex;
+  std::map< std::string, Entry >                        m_entries;
+  std::map< std::string, std::shared_future<Result> >  m_flights;
+  std::map< std::string, uint64_t >                     m_generations;
+  uint64_t                                              m_hits;
+  uint64_t                                              m_misses;
+  uint64_t                                              m_shared;
+};
+
+cJSON*
+DynamicPropertyCache::get(DynamicProperty const& prop, std::function<cJSON* ()> const& fetch)
+{
+  std::string const& key = prop.Name;
+  std::promise<Result> promise;
+  std::shared_future<Result> flight;
+  uint64_t generation = 0;
+  bool leader = false;
+
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+
+    auto entry = m_entries.find(key);
+    if (entry != m_entries.end())
+    {
+      if (!entry->second.Expires || Clock::now() < entry->second.Expiry)
+      {
+        m_hits++;
+        return cJSON_CreateString(entry->second.Value.c_str());
+      }
+      m_entries.erase(entry);
+    }
+
+    auto itr = m_flights.find(key);
+    if (itr != m_flights.end())
+    {
+      m_shared++;
+      flight = itr->second;
+    }
+    else
+    {
+      m_misses++;
+      leader = true;
+      flight = promise.get_future().share();
+      m_flights[key] = flight;
+      generation = m_generations[key];
+    }
+  }
+
+  if (leader)
+  {
+    Result res(fetch(), cJSON_Delete);
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_flights.erase(key);
+
+      // a set that happened while the command ran may have changed the
+      // value, so only keep it if there wasn't one
+      if (prop.Cache != DynamicProperty::CachePolicy::Never && res && res->type == cJSON_String
+        && m_generations[key] == generation)
+      {
+        Entry entry;
+        entry.Value = res->valuestring;
+        entry.Expires = (prop.Cache == DynamicProperty::CachePolicy::Ttl);
+        entry.Expiry = Clock::now() + std::chrono::seconds(prop.Ttl);
+        m_entries[key] = entry;
+      }
+    }
+    promise.set_value(res);
+  }
+
+  Result res = flight.get();
+  return res ? cJSON_Duplicate(res.get(), true) : nullptr;
+}
+
+void
+DynamicPropertyCache::invalidate(std::string const& key)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_entries.erase(key);
+  m_generations[key]++;
+}
+
+cJSON*
+DynamicPropertyCache::stats() const
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddNumberToObject(res, "hits", m_hits);
+  cJSON_AddNumberToObject(res, "misses", m_misses);
+  cJSON_AddNumberToObject(res, "shared", m_shared);
+  cJSON_AddNumberToObject(res, "entries", m_entries.size());
+  return res;
+}
+
 AppSettingsService::AppSettingsService()
   : BasicRpcService("config")
+  , m_running(false)
+  , m_dirty(false)
+  , m_flush_interval(kDefaultFlushInterval)
+  , m_inotify_fd(-1)
+  , m_wakeup_fd(-1)
+  , m_properties(new DynamicPropertyIndex())
+  , m_cache(new DynamicPropertyCache())
 {
 }
 
 AppSettingsService::~AppSettingsService()
 {
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_running = false;
+  }
+  m_cond.notify_all();
+
+  if (m_flusher.joinable())
+    m_flusher.join();
+
+  if (m_watcher.joinable())
+  {
+    uint64_t one = 1;
+    if (write(m_wakeup_fd, &one, sizeof(one)) != sizeof(one))
+      XLOG_WARN("failed to wake file watcher. %s", strerror(errno));
+    m_watcher.join();
+  }
+  if (m_inotify_fd != -1)
+    ::close(m_inotify_fd);
+  if (m_wakeup_fd != -1)
+    ::close(m_wakeup_fd);
+
+  std::string err;
+  if (!persist(&err))
+    XLOG_ERROR("failed to save settings on shutdown. %s", err.c_str());
 }
 
 void
-AppSettingsService::init(cJSON const* conf, RpcNotificationFunction const& callback)
+AppSettingsService::init(cJSON const* conf, RpcNotifier const& notifier)
 {
-  BasicRpcService::init(conf, callback);
+  BasicRpcService::init(conf, notifier);
 
   GKeyFileFlags flags = G_KEY_FILE_KEEP_COMMENTS;
 
   m_config_file = JsonRpc::getString(conf, "/settings/db-file", true);
 
+  // "flush-interval": 0 writes the file on every set
+  m_flush_interval = JsonRpc::getInt(conf, "/settings/flush-interval", false,
+    kDefaultFlushInterval);
+
+  m_properties->load(JsonRpc::search(conf, "/settings/dynamic_properties", false));
+
   g_autoptr(GError) error = nullptr;
   if (!g_key_file_load_from_file(keyFile, m_config_file.c_str(), flags, &error))
   {
@@ -154,59 +576,277 @@ AppSettingsService::init(cJSON const* conf, RpcNotificationFunction const& callb
     }
   }
 
+  {
+    gsize n = 0;
+    g_autofree gchar* data = nullptr;
+    if (g_file_get_contents(m_config_file.c_str(), &data, &n, nullptr))
+      m_last_written.assign(data, n);
+  }
+  startWatcher();
+
   registerMethod("get", [this](cJSON const* req) -> cJSON* { return this->get(req); });
   registerMethod("set", [this](cJSON const* req) -> cJSON* { return this->set(req); });
   registerMethod("get-status", [this](cJSON const* req) -> cJSON* { return this->getStatus(req); });
   registerMethod("get-keys", [this](cJSON const* req) -> cJSON* { return this->getKeys(req); });
+  registerMethod("flush", [this](cJSON const* req) -> cJSON* { return this->flush(req); });
+  registerMethod("get-many", [this](cJSON const* req) -> cJSON* { return this->getMany(req); });
+  registerMethod("set-many", [this](cJSON const* req) -> cJSON* { return this->setMany(req); });
+  registerMethod("watch", [this](cJSON const* req) -> cJSON* { return this->watch(req); });
+  registerMethod("unwatch", [this](cJSON const* req) -> cJSON* { return this->unwatch(req); });
+  registerMethod("get-cache-stats", [this](cJSON const* req) -> cJSON* { return this->getCacheStats(req); });
+
+  if (m_flush_interval > 0)
+  {
+    m_running = true;
+    m_flusher = std::thread(&AppSettingsService::runFlusher, this);
+  }
+}
+
+void
+AppSettingsService::markDirty()
+{
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+
+    auto now = std::chrono::steady_clock::now();
+    auto interval = std::chrono::milliseconds(m_flush_interval);
+    if (!m_dirty)
+      m_first_dirty = now;
+
+    m_dirty = true;
+    m_flush_deadline = std::min(now + interval, m_first_dirty + (interval * kMaxFlushDelay));
+  }
+  m_cond.notify_all();
 }
 
-cJSON const*
-AppSettingsService::getDynamicConfig(char const* s) const
+// Writes the key file if it has unsaved changes. g_file_set_contents
+// writes a temporary file next to the real one, syncs it and renames it
+// into place, so a crash leaves either the old or the new file, never a
+// partial one
+bool
+AppSettingsService::persist(std::string* err)
 {
-  XLOG_INFO("checking for dynamic property %s", s);
+  std::lock_guard<std::mutex> writer(m_write_mutex);
+
+  gsize n = 0;
+  g_autofree gchar* data = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_dirty)
+      return true;
+    data = g_key_file_to_data(keyFile, &n, nullptr);
+    m_dirty = false;
+  }
 
-  cJSON const* dynamicProperties = JsonRpc::search(m_config, "/settings/dynamic_properties", false);
-  if (dynamicProperties)
+  g_autoptr(GError) error = nullptr;
+  if (!g_file_set_contents(m_config_file.c_str(), data, n, &error))
   {
-    XLOG_DEBUG("checking dynamic properties");
-    for (int i = 0, n = cJSON_GetArraySize(dynamicProperties); i < n; ++i)
+    XLOG_WARN("failed to save config file %s. %s", m_config_file.c_str(), error->message);
+    if (err)
+      *err = error->message;
+
     {
-      cJSON const* prop = cJSON_GetArrayItem(dynamicProperties, i);
-      cJSON const* name = cJSON_GetObjectItem(prop, "name");
-      if (name && strcmp(name->valuestring, s) == 0)
-        return prop;
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_save_error = error->message;
     }
+
+    // try again on the next pass
+    markDirty();
+    return false;
   }
-  else
+
   {
-    char* s = cJSON_Print(m_config);
-    XLOG_DEBUG("no dynamic properties configured");
-    XLOG_DEBUG("%s", s);
-    free(s);
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_save_error.clear();
   }
-  return nullptr;
+
+  // lets the watcher tell this write from someone else's
+  m_last_written.assign(data, n);
+
+  XLOG_DEBUG("saved %s", m_config_file.c_str());
+  return true;
 }
 
-cJSON*
-AppSettingsService::getKeys(cJSON const* UNUSED_PARAM(req))
+// g_file_set_contents and most editors replace the file with a rename,
+// which would drop a watch on the file itself, so the directory is
+// watched instead
+void
+AppSettingsService::startWatcher()
 {
-  cJSON* res = cJSON_CreateArray();
+  std::string path(m_config_file);
+  std::string dir(dirname(&path[0]));
+
+  m_inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (m_inotify_fd == -1)
+  {
+    XLOG_WARN("failed to create inotify instance, not watching %s. %s",
+      m_config_file.c_str(), strerror(errno));
+    return;
+  }
+
+  if (inotify_add_watch(m_inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+  {
+    XLOG_WARN("failed to watch %s. %s", dir.c_str(), strerror(errno));
+    return;
+  }
+
+  m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_wakeup_fd == -1)
+  {
+    XLOG_WARN("failed to create eventfd. %s", strerror(errno));
+    return;
+  }
+
+  m_watcher = std::thread(&AppSettingsService::runWatcher, this);
+}
+
+void
+AppSettingsService::runWatcher()
+{
+  std::string path(m_config_file);
+  std::string name(basename(&path[0]));
+
+  pollfd fds[2];
+  fds[0].fd = m_inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = m_wakeup_fd;
+  fds[1].events = POLLIN;
+
+  while (true)
+  {
+    int ret = poll(fds, 2, -1);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      XLOG_ERROR("poll failed, no longer watching %s. %s", m_config_file.c_str(), strerror(errno));
+      return;
+    }
+
+    if (fds[1].revents & POLLIN)
+      return;
+
+    char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool modified = false;
+
+    ssize_t n = 0;
+    while ((n = read(m_inotify_fd, buff, sizeof(buff))) > 0)
+    {
+      for (char* p = buff; p < buff + n; )
+      {
+        inotify_event const* e = reinterpret_cast<inotify_event const *>(p);
+        if (e->len > 0 && name == e->name)
+          modified = true;
+        p += sizeof(inotify_event) + e->len;
+      }
+    }
+
+    if (modified)
+      reload();
+  }
+}
+
+// picks up edits made to the settings file by other processes. only the
+// keys that differ from the last version of the file are applied
+void
+AppSettingsService::reload()
+{
+  std::vector<std::string> changed;
+  {
+    std::lock_guard<std::mutex> writer(m_write_mutex);
 
-  cJSON const* dynamicProperties = JsonRpc::search(m_config, "/settings/dynamic_properties", false);
-  if (dynamicProperties)
+    gsize n = 0;
+    g_autofree gchar* data = nullptr;
+    g_autoptr(GError) error = nullptr;
+    if (!g_file_get_contents(m_config_file.c_str(), &data, &n, &error))
+    {
+      XLOG_WARN("failed to read %s. %s", m_config_file.c_str(), error->message);
+      return;
+    }
+
+    if (m_last_written.size() == n && memcmp(m_last_written.data(), data, n) == 0)
+      return;
+
+    g_autoptr(GKeyFile) before = g_key_file_new();
+    g_autoptr(GKeyFile) after = g_key_file_new();
+    g_key_file_load_from_data(before, m_last_written.data(), m_last_written.size(),
+      G_KEY_FILE_NONE, nullptr);
+    if (!g_key_file_load_from_data(after, data, n, G_KEY_FILE_NONE, &error))
+    {
+      XLOG_WARN("ignoring unparsable edit of %s. %s", m_config_file.c_str(), error->message);
+      return;
+    }
+
+    m_last_written.assign(data, n);
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    changed = applyFileChanges(before, after, keyFile);
+  }
+
+  XLOG_INFO("%s changed on disk, %d keys updated", m_config_file.c_str(),
+    static_cast<int>(changed.size()));
+  notifyChanged(changed, "file");
+}
+
+void
+AppSettingsService::runFlusher()
+{
+  bool failing = false;
+  std::unique_lock<std::mutex> guard(m_mutex);
+  while (m_running)
   {
-    for (int i = 0, n = cJSON_GetArraySize(dynamicProperties); i < n; ++i)
+    if (!m_dirty)
+    {
+      m_cond.wait(guard);
+      continue;
+    }
+
+    // another set moves the deadline, so look again when woken
+    if (m_cond.wait_until(guard, m_flush_deadline) == std::cv_status::no_timeout)
+      continue;
+
+    if (std::chrono::steady_clock::now() < m_flush_deadline)
+      continue;
+
+    guard.unlock();
+    std::string err;
+    bool saved = persist(&err);
+
+    // subscribers hear about the first failed write, not every retry
+    if (!saved && !failing && isSubscribed("config.save-failed"))
     {
-      cJSON const* prop = cJSON_GetArrayItem(dynamicProperties, i);
-      cJSON const* name = cJSON_GetObjectItem(prop, "name");
-      if (name)
-        cJSON_AddItemToArray(res, cJSON_CreateString(name->valuestring));
+      cJSON* params = cJSON_CreateObject();
+      cJSON_AddStringToObject(params, "file", m_config_file.c_str());
+      cJSON_AddStringToObject(params, "error", err.c_str());
+      publishAndDelete("config.save-failed", params);
     }
+    failing = !saved;
+    guard.lock();
   }
+}
+
+cJSON*
+AppSettingsService::flush(cJSON const* UNUSED_PARAM(req))
+{
+  std::string err;
+  if (!persist(&err))
+    return JsonRpc::makeError(EIO, "failed to save %s. %s", m_config_file.c_str(), err.c_str());
+  return cJSON_CreateNumber(0);
+}
+
+cJSON*
+AppSettingsService::getKeys(cJSON const* UNUSED_PARAM(req))
+{
+  cJSON* res = cJSON_CreateArray();
+
+  for (std::string const& name : m_properties->names())
+    cJSON_AddItemToArray(res, cJSON_CreateString(name.c_str()));
+
+  std::lock_guard<std::mutex> guard(m_mutex);
 
   gsize n = 0;
   g_autoptr(GError) error = nullptr;
-  g_autofree gchar** keys = g_key_file_get_keys(keyFile, kDefaultGroupName, &n, &error);
+  g_auto(GStrv) keys = g_key_file_get_keys(keyFile, kDefaultGroupName, &n, &error);
   if (keys)
   {
     for (int i = 0; i < static_cast<int>(n); ++i)
@@ -216,6 +856,49 @@ AppSettingsService::getKeys(cJSON const* UNUSED_PARAM(req))
   return res;
 }
 
+cJSON*
+AppSettingsService::getStaticValue(char const* key)
+{
+  cJSON* res = nullptr;
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+
+  g_autoptr(GError) error = nullptr;
+  g_autofree gchar* value = g_key_file_get_value(keyFile, kDefaultGroupName, key, &error);
+  if (!value)
+  {
+    if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) &&
+        !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
+    {
+      res = JsonRpc::makeError(error->code, "Error invoking g_key_file_get_value:%s",
+          error->message);
+    }
+    else
+    {
+      res = JsonRpc::makeError(-1, "%s not found", key);
+    }
+  }
+  else
+  {
+    res = cJSON_CreateString(value);
+  }
+
+  return res;
+}
+
+cJSON*
+AppSettingsService::getDynamicValue(DynamicProperty const& prop)
+{
+  return m_cache->get(prop, [&prop]
+    { return exec(prop, std::string(), DynamicPropertyOperation::Get); });
+}
+
+cJSON*
+AppSettingsService::getCacheStats(cJSON const* UNUSED_PARAM(req))
+{
+  return m_cache->stats();
+}
+
 cJSON*
 AppSettingsService::get(cJSON const* req)
 {
@@ -223,76 +906,402 @@ AppSettingsService::get(cJSON const* req)
 
   char const* key = JsonRpc::getString(req, "/params/key", true);
 
-  cJSON const* conf = getDynamicConfig(key);
-  if (conf)
+  DynamicProperty const* prop = m_properties->find(key);
+  if (prop)
   {
-    res = exec(req, conf, DynamicPropertyOperation::Get);
+    res = getDynamicValue(*prop);
   }
   else
   {
-    g_autoptr(GError) error = nullptr;
-    g_autofree gchar* value = g_key_file_get_value(keyFile, kDefaultGroupName, key, &error);
-    if (!value)
+    cJSON* value = getStaticValue(key);
+    if (value->type != cJSON_String)
+      return value;
+
+    res = cJSON_CreateObject();
+    cJSON_AddItemToObject(res, "name",  cJSON_CreateString(key));
+    cJSON_AddItemToObject(res, "value", value);
+  }
+
+  return res;
+}
+
+cJSON*
+AppSettingsService::set(cJSON const* req)
+{
+  cJSON* res = nullptr;
+
+  char const* key = JsonRpc::getString(req, "/params/key", true);
+  char const* value = JsonRpc::getString(req, "/params/value", true);
+
+  DynamicProperty const* prop = m_properties->find(key);
+  if (prop)
+  {
+    res = exec(*prop, value, DynamicPropertyOperation::Set);
+    m_cache->invalidate(key);
+  }
+  else
+  {
+    if (!isValidKey(key))
+      return JsonRpc::makeError(EINVAL, "invalid key '%s'", key);
+
+    std::vector< std::pair<char const*, char const*> > values;
+    values.push_back(std::make_pair(key, value));
+    res = setStaticValues(values);
+  }
+
+  if (res && res->type == cJSON_Number)
+  {
+    std::vector<std::string> keys;
+    keys.push_back(key);
+    notifyChanged(keys, "set");
+  }
+
+  return res;
+}
+
+// marks the key file dirty and, without write-behind, saves it now
+cJSON*
+AppSettingsService::commit()
+{
+  markDirty();
+
+  std::string err;
+  if (m_flush_interval <= 0)
+  {
+    if (!persist(&err))
+      return JsonRpc::makeError(EIO, "failed to save %s. %s", m_config_file.c_str(), err.c_str());
+    return cJSON_CreateNumber(0);
+  }
+
+  // with write-behind the flusher thread picks it up. while its last
+  // write failed there's no telling this one will get to disk
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    err = m_save_error;
+  }
+  if (!err.empty())
+    return JsonRpc::makeError(EIO, "failed to save %s. %s", m_config_file.c_str(), err.c_str());
+
+  return cJSON_CreateNumber(0);
+}
+
+// applies static keys together and commits them. if that fails every
+// key that still holds the value set here gets its old value back
+cJSON*
+AppSettingsService::setStaticValues(std::vector< std::pair<char const*, char const*> > const& values)
+{
+  // null for a key that wasn't there
+  std::vector<gchar*> before;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto const& v : values)
     {
-      if (!g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) &&
-          !g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
-      {
-        res = JsonRpc::makeError(error->code, "Error invoking g_key_file_get_value:%s",
-            error->message);
-      }
+      before.push_back(g_key_file_get_value(keyFile, kDefaultGroupName, v.first, nullptr));
+      g_key_file_set_value(keyFile, kDefaultGroupName, v.first, v.second);
+    }
+  }
+
+  cJSON* res = commit();
+  if (res->type != cJSON_Number)
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+
+    // backwards, so a key given twice ends up with the value it started with
+    for (size_t i = values.size(); i-- > 0; )
+    {
+      g_autofree gchar* value = g_key_file_get_value(keyFile, kDefaultGroupName,
+        values[i].first, nullptr);
+      if (!sameValue(value, values[i].second))
+        continue;
+
+      if (before[i])
+        g_key_file_set_value(keyFile, kDefaultGroupName, values[i].first, before[i]);
       else
-      {
-        res = JsonRpc::makeError(-1, "%s not found", key);
-      }
+        g_key_file_remove_key(keyFile, kDefaultGroupName, values[i].first, nullptr);
     }
-    else
+  }
+
+  for (gchar* value : before)
+    g_free(value);
+
+  return res;
+}
+
+bool
+AppSettingsService::isWatched(std::string const& key) const
+{
+  if (m_watch_keys.empty() && m_watch_prefixes.empty())
+    return true;
+
+  if (m_watch_keys.count(key))
+    return true;
+
+  for (std::string const& prefix : m_watch_prefixes)
+  {
+    if (key.compare(0, prefix.size(), prefix) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+// { "keys": ["A", "B"], "values": { "A": "10" }, "source": "set" }
+// a key missing from values was removed or is a dynamic property
+void
+AppSettingsService::notifyChanged(std::vector<std::string> const& keys, char const* source)
+{
+  if (keys.empty() || !isSubscribed("config.changed"))
+    return;
+
+  cJSON* names = cJSON_CreateArray();
+  cJSON* values = cJSON_CreateObject();
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (std::string const& key : keys)
     {
-      cJSON_AddItemToObject(res, "name",  cJSON_CreateString(JsonRpc::getString(req, "/params/key", true)));
-      cJSON_AddItemToObject(res, "value", cJSON_CreateString(value));
+      if (!isWatched(key))
+        continue;
+
+      cJSON_AddItemToArray(names, cJSON_CreateString(key.c_str()));
+      if (m_properties->find(key.c_str()))
+        continue;
+
+      g_autofree gchar* value = g_key_file_get_value(keyFile, kDefaultGroupName, key.c_str(), nullptr);
+      if (value)
+        cJSON_AddStringToObject(values, key.c_str(), value);
     }
   }
 
+  if (cJSON_GetArraySize(names) == 0)
+  {
+    cJSON_Delete(names);
+    cJSON_Delete(values);
+    return;
+  }
+
+  cJSON* params = cJSON_CreateObject();
+  cJSON_AddItemToObject(params, "keys", names);
+  cJSON_AddItemToObject(params, "values", values);
+  cJSON_AddStringToObject(params, "source", source);
+  publishAndDelete("config.changed", params);
+}
+
+cJSON*
+AppSettingsService::watchesToJson() const
+{
+  cJSON* res = cJSON_CreateObject();
+  cJSON* keys = cJSON_CreateArray();
+  for (std::string const& key : m_watch_keys)
+    cJSON_AddItemToArray(keys, cJSON_CreateString(key.c_str()));
+  cJSON_AddItemToObject(res, "keys", keys);
+  cJSON* prefixes = cJSON_CreateArray();
+  for (std::string const& prefix : m_watch_prefixes)
+    cJSON_AddItemToArray(prefixes, cJSON_CreateString(prefix.c_str()));
+  cJSON_AddItemToObject(res, "prefixes", prefixes);
   return res;
 }
 
+// { "keys": ["A"], "prefixes": ["wifi."] }
+// narrows config.changed to the watched keys. with no watches every
+// change is sent
 cJSON*
-AppSettingsService::set(cJSON const* req)
+AppSettingsService::watch(cJSON const* req)
 {
-  cJSON* res = nullptr;
+  cJSON const* keys = JsonRpc::search(req, "/params/keys", false);
+  cJSON const* prefixes = JsonRpc::search(req, "/params/prefixes", false);
+  if ((keys && keys->type != cJSON_Array) || (prefixes && prefixes->type != cJSON_Array))
+    return JsonRpc::makeError(EINVAL, "keys and prefixes must be arrays");
 
-  char const* key = JsonRpc::getString(req, "/params/key", true);
+  std::lock_guard<std::mutex> guard(m_mutex);
+  updateWatches(keys, m_watch_keys, true);
+  updateWatches(prefixes, m_watch_prefixes, true);
 
-  cJSON const* conf = getDynamicConfig(key);
-  if (conf)
+  return watchesToJson();
+}
+
+// same params as watch. with neither, every watch is dropped
+cJSON*
+AppSettingsService::unwatch(cJSON const* req)
+{
+  cJSON const* keys = JsonRpc::search(req, "/params/keys", false);
+  cJSON const* prefixes = JsonRpc::search(req, "/params/prefixes", false);
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (!keys && !prefixes)
   {
-    res = exec(req, m_config, DynamicPropertyOperation::Set);
+    m_watch_keys.clear();
+    m_watch_prefixes.clear();
   }
-  else
+  updateWatches(keys, m_watch_keys, false);
+  updateWatches(prefixes, m_watch_prefixes, false);
+
+  return watchesToJson();
+}
+
+// watches belong to the client that made them, like its subscriptions
+void
+AppSettingsService::onClientChanged()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_watch_keys.clear();
+  m_watch_prefixes.clear();
+}
+
+// { "keys": ["A", "mac", ...] }
+//   -> { "values": { "A": "10", ... }, "errors": { "mac": { code, message } } }
+// a key that's asked for twice is only read once. dynamic properties run
+// their commands on up to kMaxParallelGets threads, so a few slow ones
+// overlap without a long list starting a thread per key
+cJSON*
+AppSettingsService::getMany(cJSON const* req)
+{
+  cJSON const* keys = JsonRpc::search(req, "/params/keys", true);
+  if (keys->type != cJSON_Array)
+    return JsonRpc::makeError(EINVAL, "keys must be an array");
+
+  std::vector<char const*> names;
+  std::vector<cJSON*> values;
+  std::vector< std::pair<size_t, DynamicProperty const*> > dynamicProps;
+  std::set<std::string> seen;
+
+  for (int i = 0, n = cJSON_GetArraySize(keys); i < n; ++i)
   {
-    char const* key = JsonRpc::getString(req, "/params/key", true);
-    char const* value = JsonRpc::getString(req, "/params/value", true);
+    char const* key = cJSON_GetArrayItem(keys, i)->valuestring;
+    if (!seen.insert(key ? key : "").second)
+      continue;
 
-    g_autoptr(GError) error = nullptr;
-    g_key_file_set_value(keyFile, kDefaultGroupName, key, value);
-    if (!g_key_file_save_to_file(keyFile, m_config_file.c_str(), &error))
+    names.push_back(key ? key : "");
+    if (!key)
     {
-      XLOG_WARN("failed to save config file %s. %s", m_config_file.c_str(),
-          error->message);
-      res = JsonRpc::makeError(error->code, "g_key_file_save_file:%s", error->message);
+      values.push_back(JsonRpc::makeError(EINVAL, "key must be a string"));
+      continue;
+    }
+
+    DynamicProperty const* prop = m_properties->find(key);
+    if (prop)
+    {
+      dynamicProps.push_back(std::make_pair(values.size(), prop));
+      values.push_back(nullptr);
     }
     else
     {
-      res = cJSON_CreateNumber(0);
+      values.push_back(getStaticValue(key));
     }
   }
 
+  // each thread takes the next property nobody has started on
+  std::atomic<size_t> next(0);
+  auto worker = [this, &next, &dynamicProps, &values]
+  {
+    for (size_t i = next++; i < dynamicProps.size(); i = next++)
+      values[dynamicProps[i].first] = this->getDynamicValue(*dynamicProps[i].second);
+  };
+
+  size_t threads = std::min(dynamicProps.size(), static_cast<size_t>(kMaxParallelGets));
+  std::vector< std::future<void> > workers;
+  for (size_t i = 1; i < threads; ++i)
+    workers.push_back(std::async(std::launch::async, worker));
+  worker();
+  for (std::future<void>& f : workers)
+    f.get();
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON* found = cJSON_CreateObject();
+  cJSON* errors = cJSON_CreateObject();
+
+  for (size_t i = 0; i < names.size(); ++i)
+  {
+    if (values[i]->type == cJSON_String)
+      cJSON_AddItemToObject(found, names[i], values[i]);
+    else
+      cJSON_AddItemToObject(errors, names[i], values[i]);
+  }
+
+  cJSON_AddItemToObject(res, "values", found);
+  if (cJSON_GetArraySize(errors) > 0)
+    cJSON_AddItemToObject(res, "errors", errors);
+  else
+    cJSON_Delete(errors);
+
   return res;
 }
 
+// { "values": { "A": "10", "B": "12" } }
+// every key is checked before any is changed. only the static keys are
+// atomic: they're applied under one lock, saved once, and put back if the
+// save fails. dynamic properties run first, one at a time, and stop at
+// the first that fails. a command that already ran can't be undone, so
+// those keys stay set and are reported in config.changed, and the static
+// keys are left untouched
+cJSON*
+AppSettingsService::setMany(cJSON const* req)
+{
+  cJSON const* values = JsonRpc::search(req, "/params/values", true);
+  if (values->type != cJSON_Object)
+    return JsonRpc::makeError(EINVAL, "values must be an object");
+
+  std::vector< std::pair<cJSON const*, DynamicProperty const*> > dynamicValues;
+  std::vector< std::pair<char const*, char const*> > staticValues;
+
+  for (cJSON const* item = values->child; item; item = item->next)
+  {
+    if (!item->valuestring)
+      return JsonRpc::makeError(EINVAL, "value for '%s' must be a string", item->string);
+
+    DynamicProperty const* prop = m_properties->find(item->string);
+    if (prop)
+    {
+      dynamicValues.push_back(std::make_pair(item, prop));
+    }
+    else
+    {
+      if (!isValidKey(item->string))
+        return JsonRpc::makeError(EINVAL, "invalid key '%s'", item->string);
+      staticValues.push_back(std::make_pair(item->string, item->valuestring));
+    }
+  }
+
+  std::vector<std::string> changed;
+  for (auto const& t : dynamicValues)
+  {
+    cJSON* res = exec(*t.second, t.first->valuestring, DynamicPropertyOperation::Set);
+    m_cache->invalidate(t.first->string);
+    if (res->type != cJSON_Number)
+    {
+      notifyChanged(changed, "set");
+      return res;
+    }
+    cJSON_Delete(res);
+    changed.push_back(t.first->string);
+  }
+
+  if (!staticValues.empty())
+  {
+    cJSON* res = setStaticValues(staticValues);
+    if (res->type != cJSON_Number)
+    {
+      notifyChanged(changed, "set");
+      return res;
+    }
+    cJSON_Delete(res);
+
+    for (auto const& v : staticValues)
+      changed.push_back(v.first);
+  }
+
+  notifyChanged(changed, "set");
+  return cJSON_CreateNumber(0);
+}
+
 cJSON*
 AppSettingsService::getStatus(cJSON const* UNUSED_PARAM(req))
 {
-  g_autofree gchar* value = configGetString("system", "provision_status", "unprovisioned");
+  g_autofree gchar* value = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    value = configGetString(keyFile, "system", "provision_status", "unprovisioned");
+  }
+
   cJSON* res = cJSON_CreateObject();
   cJSON_AddItemToObject(res, "provision-status", cJSON_CreateString(value));
   return res;
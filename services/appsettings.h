@@ -19,24 +19,74 @@
 #include "../defs.h"
 #include "../rpcserver.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct DynamicProperty;
+class DynamicPropertyCache;
+class DynamicPropertyIndex;
+
 class AppSettingsService : public BasicRpcService
 {
 public:
   AppSettingsService();
   virtual ~AppSettingsService();
-  virtual void init(cJSON const* conf, RpcNotificationFunction const& callback) override;
+  virtual void init(cJSON const* conf, RpcNotifier const& notifier) override;
+  virtual void onClientChanged() override;
 
 private:
   cJSON* get(cJSON const* req);
   cJSON* set(cJSON const* req);
   cJSON* getStatus(cJSON const* req);
   cJSON* getKeys(cJSON const* req);
+  cJSON* flush(cJSON const* req);
+  cJSON* getMany(cJSON const* req);
+  cJSON* setMany(cJSON const* req);
+  cJSON* getCacheStats(cJSON const* req);
+  cJSON* watch(cJSON const* req);
+  cJSON* unwatch(cJSON const* req);
 
 private:
-  cJSON const* getDynamicConfig(char const* s) const;
+  cJSON* getStaticValue(char const* key);
+  cJSON* getDynamicValue(DynamicProperty const& prop);
+  cJSON* commit();
+  cJSON* setStaticValues(std::vector< std::pair<char const*, char const*> > const& values);
+  void notifyChanged(std::vector<std::string> const& keys, char const* source);
+  bool isWatched(std::string const& key) const;
+  cJSON* watchesToJson() const;
+  void markDirty();
+  bool persist(std::string* err);
+  void runFlusher();
+  void startWatcher();
+  void runWatcher();
+  void reload();
 
 private:
-  std::string m_config_file;
+  std::string                           m_config_file;
+  std::mutex                            m_mutex;
+  std::mutex                            m_write_mutex;
+  std::condition_variable               m_cond;
+  std::thread                           m_flusher;
+  bool                                  m_running;
+  bool                                  m_dirty;
+  int                                   m_flush_interval;
+  std::chrono::steady_clock::time_point m_first_dirty;
+  std::chrono::steady_clock::time_point m_flush_deadline;
+  std::thread                           m_watcher;
+  int                                   m_inotify_fd;
+  int                                   m_wakeup_fd;
+  std::string                           m_last_written;
+  std::string                           m_save_error;
+  std::set<std::string>                 m_watch_keys;
+  std::set<std::string>                 m_watch_prefixes;
+  std::unique_ptr<DynamicPropertyIndex> m_properties;
+  std::unique_ptr<DynamicPropertyCache> m_cache;
 };
 
 #endif
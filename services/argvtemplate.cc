@@ -0,0 +1,268 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "argvtemplate.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+  bool
+  parseType(std::string const& s, ArgvTemplate::Type* type)
+  {
+    if (s.empty() || s == "string")
+      *type = ArgvTemplate::Type::String;
+    else if (s == "int")
+      *type = ArgvTemplate::Type::Int;
+    else if (s == "path")
+      *type = ArgvTemplate::Type::Path;
+    else
+      return false;
+    return true;
+  }
+
+  bool
+  isSafePath(char const* s)
+  {
+    if (s[0] != '/')
+      return false;
+
+    for (char const* p = strstr(s, ".."); p; p = strstr(p + 1, ".."))
+    {
+      bool start = (p[-1] == '/');
+      bool end = (p[2] == '\0' || p[2] == '/');
+      if (start && end)
+        return false;
+    }
+    return true;
+  }
+}
+
+int
+ArgvTemplate::parse(char const* s, std::string* err)
+{
+  m_words.clear();
+
+  Word word;
+  std::string text;
+  bool inWord = false;
+  char quote = '\0';
+
+  auto flushText = [&word, &text]
+  {
+    if (text.empty())
+      return;
+    Part part;
+    part.Placeholder = false;
+    part.Text = text;
+    part.ArgType = Type::String;
+    word.push_back(part);
+    text.clear();
+  };
+
+  for (char const* p = s; *p; ++p)
+  {
+    if (quote == '\'')
+    {
+      if (*p == '\'')
+        quote = '\0';
+      else
+        text += *p;
+      continue;
+    }
+
+    if (!quote && isspace(*p))
+    {
+      if (inWord)
+      {
+        flushText();
+        m_words.push_back(word);
+        word.clear();
+        inWord = false;
+      }
+      continue;
+    }
+
+    inWord = true;
+
+    if (*p == '\'' && !quote)
+    {
+      quote = '\'';
+    }
+    else if (*p == '"')
+    {
+      quote = quote ? '\0' : '"';
+    }
+    else if (*p == '\\' && p[1] && (!quote || strchr("\"\\$", p[1])))
+    {
+      text += *++p;
+    }
+    else if (*p == '$' && p[1] == '{')
+    {
+      char const* end = strchr(p + 2, '}');
+      if (!end)
+      {
+        *err = "unterminated placeholder";
+        return EINVAL;
+      }
+
+      std::string spec(p + 2, end);
+      std::string::size_type colon = spec.find(':');
+
+      Part part;
+      part.Placeholder = true;
+      part.Text = spec.substr(0, colon);
+      if (part.Text.empty())
+      {
+        *err = "placeholder without a name";
+        return EINVAL;
+      }
+      if (!parseType(colon == std::string::npos ? std::string() : spec.substr(colon + 1),
+        &part.ArgType))
+      {
+        *err = "unknown type in ${" + spec + "}";
+        return EINVAL;
+      }
+
+      flushText();
+      word.push_back(part);
+      p = end;
+    }
+    else
+    {
+      text += *p;
+    }
+  }
+
+  if (quote)
+  {
+    *err = "unterminated quote";
+    return EINVAL;
+  }
+
+  if (inWord)
+  {
+    flushText();
+    m_words.push_back(word);
+  }
+
+  if (m_words.empty())
+  {
+    *err = "empty command";
+    return EINVAL;
+  }
+
+  // the client gets to pick arguments, not the program
+  for (Part const& part : m_words[0])
+  {
+    if (part.Placeholder)
+    {
+      *err = "the program can't be a placeholder";
+      return EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+int
+ArgvTemplate::expand(cJSON const* args, std::vector<std::string>& argv, std::string* err) const
+{
+  argv.clear();
+  argv.reserve(m_words.size());
+
+  for (Word const& word : m_words)
+  {
+    std::string arg;
+    for (Part const& part : word)
+    {
+      if (!part.Placeholder)
+      {
+        arg += part.Text;
+        continue;
+      }
+
+      cJSON const* value = args ? cJSON_GetObjectItem(args, part.Text.c_str()) : nullptr;
+      if (!value)
+      {
+        *err = "missing argument '" + part.Text + "'";
+        return EINVAL;
+      }
+
+      switch (part.ArgType)
+      {
+        case Type::String:
+        case Type::Path:
+          if (value->type != cJSON_String)
+          {
+            *err = "argument '" + part.Text + "' must be a string";
+            return EINVAL;
+          }
+          if (part.ArgType == Type::Path && !isSafePath(value->valuestring))
+          {
+            *err = "argument '" + part.Text + "' must be an absolute path without ..";
+            return EINVAL;
+          }
+          arg += value->valuestring;
+          break;
+
+        case Type::Int:
+        {
+          long n = 0;
+          bool valid = false;
+          if (value->type == cJSON_Number)
+          {
+            n = static_cast<long>(value->valuedouble);
+            valid = (value->valuedouble == static_cast<double>(n));
+          }
+          else if (value->type == cJSON_String && *value->valuestring)
+          {
+            char* end = nullptr;
+            n = strtol(value->valuestring, &end, 10);
+            valid = (*end == '\0');
+          }
+
+          if (!valid)
+          {
+            *err = "argument '" + part.Text + "' must be an integer";
+            return EINVAL;
+          }
+          arg += std::to_string(n);
+          break;
+        }
+      }
+    }
+    argv.push_back(arg);
+  }
+
+  return 0;
+}
+
+bool
+ArgvTemplate::hasPlaceholders() const
+{
+  for (Word const& word : m_words)
+  {
+    for (Part const& part : word)
+    {
+      if (part.Placeholder)
+        return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,60 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __ARGV_TEMPLATE_H__
+#define __ARGV_TEMPLATE_H__
+
+#include <string>
+#include <vector>
+
+#include <cJSON.h>
+
+// A command line from bleconfd.json split into words once, so each call
+// only fills in the arguments. Words are split on whitespace and can be
+// quoted with '' or "". A placeholder like ${dir} or ${count:int} is
+// replaced with that member of the request's args and always stays one
+// argument, whatever it contains. Types are string (the default), int,
+// and path, which has to be absolute and free of "..".
+class ArgvTemplate
+{
+public:
+  enum class Type
+  {
+    String,
+    Int,
+    Path
+  };
+
+  // returns 0 or EINVAL with the reason in err
+  int parse(char const* s, std::string* err);
+  int expand(cJSON const* args, std::vector<std::string>& argv, std::string* err) const;
+
+  bool hasPlaceholders() const;
+
+private:
+  struct Part
+  {
+    bool        Placeholder;
+    std::string Text;   // literal text, or the placeholder's name
+    Type        ArgType;
+  };
+
+  using Word = std::vector<Part>;
+
+private:
+  std::vector<Word> m_words;
+};
+
+#endif
@@ -0,0 +1,304 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "coprocess.h"
+#include "../rpclogger.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace
+{
+  // a helper that dies this soon after it starts is not started again
+  // until the same time has passed, so a broken one can't fork in a loop
+  std::chrono::milliseconds const kRestartHoldoff(1000);
+
+  // how long a helper gets to exit after its stdin is closed, when it's
+  // stopped rather than killed
+  int const kStopTimeout = 100;
+
+  int
+  remaining(CoProcessClock::time_point deadline)
+  {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - CoProcessClock::now()).count();
+    return ms > 0 ? static_cast<int>(ms) : 0;
+  }
+}
+
+CoProcess::CoProcess(std::vector<std::string> const& argv)
+  : m_argv(argv)
+  , m_pid(-1)
+  , m_fd(-1)
+{
+}
+
+CoProcess::~CoProcess()
+{
+  stop();
+}
+
+// the helper gets one end of a socketpair as both stdin and stdout. a
+// socket rather than pipes so a write to a dead helper fails with EPIPE
+// instead of raising SIGPIPE
+int
+CoProcess::start()
+{
+  if (CoProcessClock::now() < m_holdoff)
+    return EAGAIN;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+  {
+    int err = errno;
+    XLOG_ERROR("failed to create socketpair for %s. %s", m_argv[0].c_str(), strerror(err));
+    return err;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+  std::vector<char*> argv;
+  for (std::string const& arg : m_argv)
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  pid_t pid = -1;
+  int err = posix_spawnp(&pid, argv[0], &actions, nullptr, &argv[0], environ);
+  posix_spawn_file_actions_destroy(&actions);
+  ::close(fds[1]);
+
+  if (err != 0)
+  {
+    XLOG_ERROR("failed to start %s. %s", m_argv[0].c_str(), strerror(err));
+    ::close(fds[0]);
+    m_holdoff = CoProcessClock::now() + kRestartHoldoff;
+    return err;
+  }
+
+  m_pid = pid;
+  m_fd = fds[0];
+  m_buff.clear();
+  m_started = CoProcessClock::now();
+
+  XLOG_INFO("started %s pid:%d", m_argv[0].c_str(), m_pid);
+  return 0;
+}
+
+void
+CoProcess::stop()
+{
+  if (m_pid == -1)
+    return;
+
+  // closing the socket is the helper's cue to exit
+  ::close(m_fd);
+  m_fd = -1;
+
+  int status = 0;
+  pid_t pid = 0;
+  for (int i = 0; i < kStopTimeout / 10 && pid == 0; ++i)
+  {
+    pid = waitpid(m_pid, &status, WNOHANG);
+    if (pid == 0)
+      usleep(10000);
+  }
+
+  if (pid == 0)
+  {
+    XLOG_WARN("%s pid:%d didn't exit, killing it", m_argv[0].c_str(), m_pid);
+    kill();
+    return;
+  }
+
+  m_pid = -1;
+}
+
+void
+CoProcess::kill()
+{
+  if (m_pid == -1)
+    return;
+
+  if (m_fd != -1)
+  {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+
+  int status = 0;
+  ::kill(m_pid, SIGKILL);
+  waitpid(m_pid, &status, 0);
+  m_pid = -1;
+}
+
+int
+CoProcess::call(std::string const& request, std::string& response,
+  CoProcessClock::time_point deadline)
+{
+  if (request.find('\n') != std::string::npos)
+    return EINVAL;
+
+  if (m_pid == -1)
+  {
+    int err = start();
+    if (err)
+      return err;
+  }
+
+  std::string line(request);
+  line += '\n';
+
+  size_t written = 0;
+  while (written < line.size())
+  {
+    ssize_t n = send(m_fd, line.data() + written, line.size() - written, MSG_NOSIGNAL);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      int err = errno;
+      XLOG_WARN("failed to write to %s. %s", m_argv[0].c_str(), strerror(err));
+      kill();
+      return err;
+    }
+    written += n;
+  }
+
+  while (true)
+  {
+    size_t end = m_buff.find('\n');
+    if (end != std::string::npos)
+    {
+      response.assign(m_buff, 0, end);
+      m_buff.erase(0, end + 1);
+
+      // anything left over wasn't asked for and would be taken as the
+      // answer to the next request
+      if (!m_buff.empty())
+      {
+        XLOG_WARN("%s wrote more than one line, restarting it", m_argv[0].c_str());
+        kill();
+      }
+      return 0;
+    }
+
+    pollfd pfd;
+    pfd.fd = m_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int ret = poll(&pfd, 1, remaining(deadline));
+    if (ret == -1 && errno == EINTR)
+      continue;
+
+    if (ret == 0)
+    {
+      // the late answer could show up as the reply to the next request
+      XLOG_WARN("%s pid:%d timed out, restarting it", m_argv[0].c_str(), m_pid);
+      kill();
+      return ETIMEDOUT;
+    }
+
+    char buff[512];
+    ssize_t n = ret > 0 ? recv(m_fd, buff, sizeof(buff), 0) : -1;
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+    {
+      int err = (n == 0) ? EPIPE : errno;
+      XLOG_WARN("%s pid:%d exited or failed. %s", m_argv[0].c_str(), m_pid, strerror(err));
+      if (CoProcessClock::now() - m_started < kRestartHoldoff)
+        m_holdoff = CoProcessClock::now() + kRestartHoldoff;
+      kill();
+      return err;
+    }
+
+    m_buff.append(buff, n);
+  }
+}
+
+bool
+coProcessParseReply(std::string const& line, std::string& text)
+{
+  bool ok = (line.compare(0, 2, "OK") == 0) && (line.size() == 2 || line[2] == ' ');
+  size_t skip = ok ? 3 : 4;
+  if (!ok && line.compare(0, 3, "ERR") != 0)
+    skip = 0;
+
+  text = line.size() > skip ? line.substr(skip) : std::string();
+  return ok;
+}
+
+CoProcessPool::CoProcessPool(std::vector<std::string> const& argv, int size, int timeout)
+  : m_argv(argv)
+  , m_size(size > 0 ? size : 1)
+  , m_timeout(timeout)
+{
+}
+
+CoProcessPool::~CoProcessPool()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_workers.clear();
+}
+
+int
+CoProcessPool::call(std::string const& request, std::string& response)
+{
+  auto deadline = CoProcessClock::now() + std::chrono::milliseconds(m_timeout);
+
+  CoProcess* worker = nullptr;
+  {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    while (m_idle.empty() && static_cast<int>(m_workers.size()) >= m_size)
+    {
+      if (m_cond.wait_until(guard, deadline) == std::cv_status::timeout && m_idle.empty())
+        return ETIMEDOUT;
+    }
+
+    if (!m_idle.empty())
+    {
+      worker = m_idle.back();
+      m_idle.pop_back();
+    }
+    else
+    {
+      m_workers.emplace_back(new CoProcess(m_argv));
+      worker = m_workers.back().get();
+    }
+  }
+
+  int err = worker->call(request, response, deadline);
+
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_idle.push_back(worker);
+  }
+  m_cond.notify_one();
+
+  return err;
+}
@@ -0,0 +1,91 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __CO_PROCESS_H__
+#define __CO_PROCESS_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+using CoProcessClock = std::chrono::steady_clock;
+
+// A long lived helper that reads one request per line on stdin and
+// writes one response per line on stdout. It is started on first use
+// and again after it exits or misses a deadline.
+class CoProcess
+{
+public:
+  explicit CoProcess(std::vector<std::string> const& argv);
+  ~CoProcess();
+
+  // sends request and waits for the response line, without the newline.
+  // returns 0 or an errno
+  int call(std::string const& request, std::string& response,
+    CoProcessClock::time_point deadline);
+
+  // closes the helper's stdin and gives it a moment to exit
+  void stop();
+
+private:
+  int start();
+
+  // for a helper that's stuck or misbehaving. no grace period, since the
+  // caller is waiting
+  void kill();
+
+private:
+  std::vector<std::string>    m_argv;
+  pid_t                       m_pid;
+  int                         m_fd;
+  std::string                 m_buff;
+  CoProcessClock::time_point  m_started;
+  CoProcessClock::time_point  m_holdoff;
+};
+
+// Helpers answer "OK", "OK <value>" or "ERR <message>". Returns true for
+// OK and puts whatever follows the status in text
+bool coProcessParseReply(std::string const& line, std::string& text);
+
+// Up to a fixed number of copies of one helper. A call takes an idle
+// helper, starting one if the pool isn't full, and otherwise waits for
+// one to free up within the call's timeout.
+class CoProcessPool
+{
+public:
+  CoProcessPool(std::vector<std::string> const& argv, int size, int timeout);
+  ~CoProcessPool();
+
+  int call(std::string const& request, std::string& response);
+
+  std::string const& name() const
+    { return m_argv[0]; }
+
+private:
+  std::vector<std::string>                  m_argv;
+  int                                       m_size;
+  int                                       m_timeout;
+  std::mutex                                m_mutex;
+  std::condition_variable                   m_cond;
+  std::vector< std::unique_ptr<CoProcess> > m_workers;
+  std::vector<CoProcess*>                   m_idle;
+};
+
+#endif
@@ -0,0 +1,654 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "netlink.h"
+#include "../rpclogger.h"
+
+#include <algorithm>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/if_addr.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+namespace
+{
+  using LinkMap = std::map<int, NetLink>;
+
+  size_t const kBufferSize = 32 * 1024;
+  int const kDumpTimeout = 2000;
+  int const kMaxDumpAttempts = 3;
+
+  // IF_OPER_* from linux/if.h, which doesn't mix with net/if.h
+  char const* const kOperStates[] =
+  {
+    "unknown",
+    "notpresent",
+    "down",
+    "lowerlayerdown",
+    "testing",
+    "dormant",
+    "up"
+  };
+
+  std::string
+  addrToString(int family, void const* p)
+  {
+    char buff[INET6_ADDRSTRLEN];
+    if (!inet_ntop(family, p, buff, sizeof(buff)))
+      return std::string();
+    return std::string(buff);
+  }
+
+  std::string
+  macToString(unsigned char const* p, size_t n)
+  {
+    std::string mac;
+    for (size_t i = 0; i < n; ++i)
+    {
+      char buff[4];
+      snprintf(buff, sizeof(buff), i ? ":%02x" : "%02x", p[i]);
+      mac += buff;
+    }
+    return mac;
+  }
+
+  // returns the number of bytes read, 0 when there was nothing to read or
+  // the message didn't come from the kernel, or -1 with errno set
+  int
+  netlinkReceive(int fd, char* buff, size_t n)
+  {
+    sockaddr_nl from;
+    socklen_t len = sizeof(from);
+
+    ssize_t ret = recvfrom(fd, buff, n, 0, reinterpret_cast<sockaddr *>(&from), &len);
+    if (ret == -1)
+      return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (from.nl_pid != 0)
+      return 0;
+    return static_cast<int>(ret);
+  }
+
+  // sends a dump request and hands every message that arrives to
+  // onMessage until the dump ends. returns 0 or an errno, EAGAIN when the
+  // table changed during the dump
+  int
+  netlinkDump(int fd, int type, int family, uint32_t seq,
+    std::function<void (nlmsghdr* h)> const& onMessage)
+  {
+    struct
+    {
+      nlmsghdr  Header;
+      rtgenmsg  Message;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.Header.nlmsg_len = NLMSG_LENGTH(sizeof(rtgenmsg));
+    req.Header.nlmsg_type = type;
+    req.Header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.Header.nlmsg_seq = seq;
+    req.Message.rtgen_family = family;
+
+    sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(fd, &req, req.Header.nlmsg_len, 0, reinterpret_cast<sockaddr *>(&kernel),
+      sizeof(kernel)) == -1)
+      return errno;
+
+    std::vector<char> buff(kBufferSize);
+    bool interrupted = false;
+
+    while (true)
+    {
+      pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      int ret = poll(&pfd, 1, kDumpTimeout);
+      if (ret == -1 && errno == EINTR)
+        continue;
+      if (ret == -1)
+        return errno;
+      if (ret == 0)
+        return ETIMEDOUT;
+
+      int len = netlinkReceive(fd, &buff[0], buff.size());
+      if (len == -1)
+        return errno;
+
+      for (nlmsghdr* h = reinterpret_cast<nlmsghdr *>(&buff[0]); NLMSG_OK(h, len); h = NLMSG_NEXT(h, len))
+      {
+        if (h->nlmsg_seq == seq)
+        {
+          if (h->nlmsg_flags & NLM_F_DUMP_INTR)
+            interrupted = true;
+          if (h->nlmsg_type == NLMSG_DONE)
+            return interrupted ? EAGAIN : 0;
+          if (h->nlmsg_type == NLMSG_ERROR)
+          {
+            nlmsgerr const* e = static_cast<nlmsgerr const *>(NLMSG_DATA(h));
+            return e->error ? -e->error : EIO;
+          }
+        }
+        onMessage(h);
+      }
+    }
+  }
+
+  // a dump on a socket of its own, for tables that aren't monitored
+  int
+  netlinkQuery(int type, int family, std::function<void (nlmsghdr* h)> const& onMessage)
+  {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (fd == -1)
+      return errno;
+
+    int ret = 0;
+    for (int attempt = 0; attempt < kMaxDumpAttempts; ++attempt)
+    {
+      ret = netlinkDump(fd, type, family, attempt + 1, onMessage);
+      if (ret != EAGAIN)
+        break;
+    }
+
+    ::close(fd);
+    return ret;
+  }
+
+  bool
+  sameLink(NetLink const& a, NetLink const& b)
+  {
+    return a.Name == b.Name && a.Flags == b.Flags && a.Mtu == b.Mtu &&
+      a.Mac == b.Mac && a.OperState == b.OperState;
+  }
+
+  bool
+  sameAddress(NetAddress const& a, NetAddress const& b)
+  {
+    return a.Family == b.Family && a.PrefixLen == b.PrefixLen && a.Address == b.Address;
+  }
+
+  bool
+  hasAddress(std::vector<NetAddress> const& addrs, NetAddress const& addr)
+  {
+    return std::any_of(addrs.begin(), addrs.end(),
+      [&addr](NetAddress const& other) { return sameAddress(addr, other); });
+  }
+
+  void
+  addEvent(std::vector<NetEvent>* events, NetChange change, NetLink const& link,
+    NetAddress const* addr)
+  {
+    if (!events)
+      return;
+
+    NetEvent e;
+    e.Change = change;
+    e.Link.Index = link.Index;
+    e.Link.Name = link.Name;
+    e.Link.Flags = link.Flags;
+    e.Link.Mtu = link.Mtu;
+    e.Link.Mac = link.Mac;
+    e.Link.OperState = link.OperState;
+    if (addr)
+      e.Address = *addr;
+    else
+      e.Address = NetAddress{ AF_UNSPEC, std::string(), 0, 0, std::string() };
+    events->push_back(e);
+  }
+
+  void
+  parseLink(nlmsghdr* h, NetLink& link)
+  {
+    ifinfomsg* ifi = static_cast<ifinfomsg *>(NLMSG_DATA(h));
+    link.Index = ifi->ifi_index;
+    link.Flags = ifi->ifi_flags;
+    link.Mtu = 0;
+    link.OperState = kOperStates[0];
+
+    int len = IFLA_PAYLOAD(h);
+    for (rtattr* a = IFLA_RTA(ifi); RTA_OK(a, len); a = RTA_NEXT(a, len))
+    {
+      switch (a->rta_type)
+      {
+        case IFLA_IFNAME:
+          link.Name = static_cast<char const *>(RTA_DATA(a));
+          break;
+        case IFLA_MTU:
+          link.Mtu = *static_cast<int const *>(RTA_DATA(a));
+          break;
+        case IFLA_ADDRESS:
+          link.Mac = macToString(static_cast<unsigned char const *>(RTA_DATA(a)), RTA_PAYLOAD(a));
+          break;
+        case IFLA_OPERSTATE:
+        {
+          uint8_t state = *static_cast<uint8_t const *>(RTA_DATA(a));
+          if (state < sizeof(kOperStates) / sizeof(kOperStates[0]))
+            link.OperState = kOperStates[state];
+          break;
+        }
+      }
+    }
+  }
+
+  void
+  applyLink(nlmsghdr* h, LinkMap& links, std::vector<NetEvent>* events)
+  {
+    NetLink link;
+    parseLink(h, link);
+
+    auto itr = links.find(link.Index);
+    if (h->nlmsg_type == RTM_DELLINK)
+    {
+      if (itr == links.end())
+        return;
+      for (NetAddress const& addr : itr->second.Addrs)
+        addEvent(events, NetChange::AddressRemoved, itr->second, &addr);
+      addEvent(events, NetChange::LinkRemoved, itr->second, nullptr);
+      links.erase(itr);
+      return;
+    }
+
+    if (itr == links.end())
+    {
+      links[link.Index] = link;
+      addEvent(events, NetChange::LinkAdded, link, nullptr);
+      return;
+    }
+
+    if (sameLink(itr->second, link))
+      return;
+
+    link.Addrs.swap(itr->second.Addrs);
+    itr->second = link;
+    addEvent(events, NetChange::LinkChanged, link, nullptr);
+  }
+
+  // the kernel sends a link before any of its addresses, so an address
+  // for a link we don't know can be dropped
+  void
+  applyAddress(nlmsghdr* h, LinkMap& links, std::vector<NetEvent>* events)
+  {
+    ifaddrmsg* ifa = static_cast<ifaddrmsg *>(NLMSG_DATA(h));
+    if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+      return;
+
+    auto itr = links.find(ifa->ifa_index);
+    if (itr == links.end())
+    {
+      XLOG_DEBUG("address for unknown link %d", ifa->ifa_index);
+      return;
+    }
+
+    // IFA_LOCAL is the address itself on point-to-point links, where
+    // IFA_ADDRESS is the peer
+    void const* local = nullptr;
+    void const* address = nullptr;
+
+    NetAddress addr;
+    addr.Family = ifa->ifa_family;
+    addr.PrefixLen = ifa->ifa_prefixlen;
+    addr.Scope = ifa->ifa_scope;
+
+    int len = IFA_PAYLOAD(h);
+    for (rtattr* a = IFA_RTA(ifa); RTA_OK(a, len); a = RTA_NEXT(a, len))
+    {
+      switch (a->rta_type)
+      {
+        case IFA_LOCAL: local = RTA_DATA(a); break;
+        case IFA_ADDRESS: address = RTA_DATA(a); break;
+        case IFA_BROADCAST: addr.Broadcast = addrToString(addr.Family, RTA_DATA(a)); break;
+      }
+    }
+
+    if (!local && !address)
+      return;
+    addr.Address = addrToString(addr.Family, local ? local : address);
+
+    std::vector<NetAddress>& addrs = itr->second.Addrs;
+    auto existing = std::find_if(addrs.begin(), addrs.end(),
+      [&addr](NetAddress const& other) { return sameAddress(addr, other); });
+
+    if (h->nlmsg_type == RTM_DELADDR)
+    {
+      if (existing == addrs.end())
+        return;
+      addEvent(events, NetChange::AddressRemoved, itr->second, &addr);
+      addrs.erase(existing);
+    }
+    else if (existing == addrs.end())
+    {
+      addrs.push_back(addr);
+      addEvent(events, NetChange::AddressAdded, itr->second, &addr);
+    }
+    else
+    {
+      // IPv6 addresses are sent again each time their lifetimes change
+      *existing = addr;
+    }
+  }
+
+  void
+  apply(nlmsghdr* h, LinkMap& links, std::vector<NetEvent>* events)
+  {
+    switch (h->nlmsg_type)
+    {
+      case RTM_NEWLINK:
+      case RTM_DELLINK:
+        applyLink(h, links, events);
+        break;
+      case RTM_NEWADDR:
+      case RTM_DELADDR:
+        applyAddress(h, links, events);
+        break;
+    }
+  }
+
+  void
+  diff(LinkMap const& before, LinkMap const& after, std::vector<NetEvent>& events)
+  {
+    for (auto const& b : before)
+    {
+      auto a = after.find(b.first);
+      for (NetAddress const& addr : b.second.Addrs)
+      {
+        if (a == after.end() || !hasAddress(a->second.Addrs, addr))
+          addEvent(&events, NetChange::AddressRemoved, b.second, &addr);
+      }
+      if (a == after.end())
+        addEvent(&events, NetChange::LinkRemoved, b.second, nullptr);
+    }
+
+    for (auto const& a : after)
+    {
+      auto b = before.find(a.first);
+      if (b == before.end())
+        addEvent(&events, NetChange::LinkAdded, a.second, nullptr);
+      else if (!sameLink(a.second, b->second))
+        addEvent(&events, NetChange::LinkChanged, a.second, nullptr);
+
+      for (NetAddress const& addr : a.second.Addrs)
+      {
+        if (b == before.end() || !hasAddress(b->second.Addrs, addr))
+          addEvent(&events, NetChange::AddressAdded, a.second, &addr);
+      }
+    }
+  }
+}
+
+NetlinkMonitor::NetlinkMonitor()
+  : m_fd(-1)
+  , m_wakeup_fd(-1)
+  , m_seq(0)
+{
+}
+
+NetlinkMonitor::~NetlinkMonitor()
+{
+  if (m_thread.joinable())
+  {
+    uint64_t one = 1;
+    if (write(m_wakeup_fd, &one, sizeof(one)) != sizeof(one))
+      XLOG_WARN("failed to wake netlink monitor. %s", strerror(errno));
+    m_thread.join();
+  }
+  if (m_fd != -1)
+    ::close(m_fd);
+  if (m_wakeup_fd != -1)
+    ::close(m_wakeup_fd);
+}
+
+int
+NetlinkMonitor::start(NetEventHandler const& onEvent)
+{
+  m_on_event = onEvent;
+
+  m_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+  if (m_fd == -1)
+    return errno;
+
+  // subscribe before the dump so nothing that changes in between is missed
+  sockaddr_nl local;
+  memset(&local, 0, sizeof(local));
+  local.nl_family = AF_NETLINK;
+  local.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+  if (bind(m_fd, reinterpret_cast<sockaddr *>(&local), sizeof(local)) == -1)
+    return errno;
+
+  // an interface with many addresses going away arrives as one burst
+  int size = 256 * 1024;
+  if (setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)
+    XLOG_WARN("failed to set netlink receive buffer. %s", strerror(errno));
+
+  int ret = resync(nullptr);
+  if (ret)
+    return ret;
+
+  m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_wakeup_fd == -1)
+    return errno;
+
+  m_thread = std::thread(&NetlinkMonitor::run, this);
+  return 0;
+}
+
+std::vector<NetLink>
+NetlinkMonitor::links() const
+{
+  std::vector<NetLink> links;
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  links.reserve(m_links.size());
+  for (auto const& link : m_links)
+    links.push_back(link.second);
+  return links;
+}
+
+// rebuilds the tables from a fresh dump. used at start and when the
+// socket overran and messages were lost
+int
+NetlinkMonitor::resync(std::vector<NetEvent>* events)
+{
+  int ret = 0;
+  for (int attempt = 0; attempt < kMaxDumpAttempts; ++attempt)
+  {
+    LinkMap links;
+    ret = dump(RTM_GETLINK, links);
+    if (ret == 0)
+      ret = dump(RTM_GETADDR, links);
+
+    // the tables changed while they were being dumped
+    if (ret == EAGAIN || ret == ENOBUFS)
+      continue;
+    if (ret)
+      return ret;
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (events)
+      diff(m_links, links, *events);
+    m_links.swap(links);
+    return 0;
+  }
+  return ret;
+}
+
+// change notifications that arrive during the dump are applied to the
+// same table, so the result is current when the dump ends
+int
+NetlinkMonitor::dump(int type, LinkMap& links)
+{
+  return netlinkDump(m_fd, type, AF_UNSPEC, ++m_seq, [&links](nlmsghdr* h)
+  {
+    apply(h, links, nullptr);
+  });
+}
+
+void
+NetlinkMonitor::run()
+{
+  pollfd fds[2];
+  fds[0].fd = m_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = m_wakeup_fd;
+  fds[1].events = POLLIN;
+
+  std::vector<char> buff(kBufferSize);
+
+  while (true)
+  {
+    int ret = poll(fds, 2, -1);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      XLOG_ERROR("poll failed, no longer monitoring interfaces. %s", strerror(errno));
+      return;
+    }
+
+    if (fds[1].revents & POLLIN)
+      return;
+
+    std::vector<NetEvent> events;
+    while (true)
+    {
+      int len = netlinkReceive(m_fd, &buff[0], buff.size());
+      if (len == -1 && errno == ENOBUFS)
+      {
+        XLOG_WARN("netlink socket overran, reloading interfaces");
+        ret = resync(&events);
+        if (ret)
+          XLOG_ERROR("failed to reload interfaces. %s", strerror(ret));
+        break;
+      }
+      if (len == -1)
+      {
+        XLOG_ERROR("failed to read from netlink socket. %s", strerror(errno));
+        break;
+      }
+      if (len == 0)
+        break;
+
+      std::lock_guard<std::mutex> guard(m_mutex);
+      for (nlmsghdr* h = reinterpret_cast<nlmsghdr *>(&buff[0]); NLMSG_OK(h, len); h = NLMSG_NEXT(h, len))
+        apply(h, m_links, &events);
+    }
+
+    if (m_on_event)
+    {
+      for (NetEvent const& e : events)
+        m_on_event(e);
+    }
+  }
+}
+
+int
+netlinkGetLinkStats(std::vector<NetLinkStats>& stats)
+{
+  stats.clear();
+  return netlinkQuery(RTM_GETLINK, AF_UNSPEC, [&stats](nlmsghdr* h)
+  {
+    if (h->nlmsg_type != RTM_NEWLINK)
+      return;
+
+    NetLinkStats link = NetLinkStats{ std::string(), 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    ifinfomsg* ifi = static_cast<ifinfomsg *>(NLMSG_DATA(h));
+    int len = IFLA_PAYLOAD(h);
+    for (rtattr* a = IFLA_RTA(ifi); RTA_OK(a, len); a = RTA_NEXT(a, len))
+    {
+      if (a->rta_type == IFLA_IFNAME)
+      {
+        link.Name = static_cast<char const *>(RTA_DATA(a));
+      }
+      else if (a->rta_type == IFLA_STATS64 && RTA_PAYLOAD(a) >= sizeof(rtnl_link_stats64))
+      {
+        // the attribute isn't always 8 byte aligned
+        rtnl_link_stats64 counters;
+        memcpy(&counters, RTA_DATA(a), sizeof(counters));
+        link.RxBytes = counters.rx_bytes;
+        link.TxBytes = counters.tx_bytes;
+        link.RxPackets = counters.rx_packets;
+        link.TxPackets = counters.tx_packets;
+        link.RxErrors = counters.rx_errors;
+        link.TxErrors = counters.tx_errors;
+        link.RxDropped = counters.rx_dropped;
+        link.TxDropped = counters.tx_dropped;
+      }
+    }
+    stats.push_back(link);
+  });
+}
+
+int
+netlinkGetDefaultRoutes(std::vector<NetRoute>& routes)
+{
+  routes.clear();
+
+  int ret = netlinkQuery(RTM_GETROUTE, AF_UNSPEC, [&routes](nlmsghdr* h)
+  {
+    if (h->nlmsg_type != RTM_NEWROUTE)
+      return;
+
+    rtmsg* rtm = static_cast<rtmsg *>(NLMSG_DATA(h));
+    if (rtm->rtm_dst_len != 0 || rtm->rtm_type != RTN_UNICAST)
+      return;
+    if (rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6)
+      return;
+
+    NetRoute route;
+    route.Family = rtm->rtm_family;
+    route.Index = 0;
+    route.Metric = 0;
+
+    uint32_t table = rtm->rtm_table;
+    int len = RTM_PAYLOAD(h);
+    for (rtattr* a = RTM_RTA(rtm); RTA_OK(a, len); a = RTA_NEXT(a, len))
+    {
+      switch (a->rta_type)
+      {
+        case RTA_TABLE: table = *static_cast<uint32_t const *>(RTA_DATA(a)); break;
+        case RTA_GATEWAY: route.Gateway = addrToString(route.Family, RTA_DATA(a)); break;
+        case RTA_OIF: route.Index = *static_cast<int const *>(RTA_DATA(a)); break;
+        case RTA_PRIORITY: route.Metric = *static_cast<uint32_t const *>(RTA_DATA(a)); break;
+      }
+    }
+
+    if (table != RT_TABLE_MAIN)
+      return;
+
+    char name[IF_NAMESIZE];
+    if (route.Index && if_indextoname(route.Index, name))
+      route.Dev = name;
+
+    routes.push_back(route);
+  });
+
+  std::stable_sort(routes.begin(), routes.end(), [](NetRoute const& a, NetRoute const& b)
+  {
+    return a.Metric < b.Metric;
+  });
+  return ret;
+}
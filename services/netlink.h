@@ -0,0 +1,131 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __NETLINK_H__
+#define __NETLINK_H__
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+struct NetAddress
+{
+  int         Family;     // AF_INET or AF_INET6
+  std::string Address;
+  int         PrefixLen;
+  int         Scope;      // RT_SCOPE_*
+  std::string Broadcast;  // empty if the address has none
+};
+
+struct NetLink
+{
+  int                     Index;
+  std::string             Name;
+  unsigned int            Flags;      // IFF_*
+  int                     Mtu;
+  std::string             Mac;
+  std::string             OperState;  // "up", "down", "dormant", ...
+  std::vector<NetAddress> Addrs;
+};
+
+enum class NetChange
+{
+  LinkAdded,
+  LinkChanged,
+  LinkRemoved,
+  AddressAdded,
+  AddressRemoved
+};
+
+// Address is only set for AddressAdded and AddressRemoved. Link never
+// carries addresses
+struct NetEvent
+{
+  NetChange   Change;
+  NetLink     Link;
+  NetAddress  Address;
+};
+
+struct NetLinkStats
+{
+  std::string Name;
+  uint64_t    RxBytes;
+  uint64_t    TxBytes;
+  uint64_t    RxPackets;
+  uint64_t    TxPackets;
+  uint64_t    RxErrors;
+  uint64_t    TxErrors;
+  uint64_t    RxDropped;
+  uint64_t    TxDropped;
+};
+
+struct NetRoute
+{
+  int         Family;
+  std::string Gateway;  // empty for a route straight onto the link
+  int         Index;
+  std::string Dev;
+  uint32_t    Metric;
+};
+
+// counters change too often to be worth monitoring, so these read the
+// kernel's tables on their own socket each time. return 0 or an errno
+int netlinkGetLinkStats(std::vector<NetLinkStats>& stats);
+
+// default routes from the main table, IPv4 and IPv6, lowest metric first
+int netlinkGetDefaultRoutes(std::vector<NetRoute>& routes);
+
+using NetEventHandler = std::function<void (NetEvent const& e)>;
+
+// Keeps the kernel's links and their addresses in memory. The tables are
+// dumped once at start, and after that only the rtnetlink messages for
+// what changed are applied. Only changes that show up in NetLink or
+// NetAddress are reported, so the stream of RTM_NEWLINK messages some
+// wireless drivers send doesn't turn into events.
+class NetlinkMonitor
+{
+public:
+  NetlinkMonitor();
+  ~NetlinkMonitor();
+
+  // onEvent is called on the monitor's thread. returns 0 or an errno
+  int start(NetEventHandler const& onEvent);
+
+  // a copy of every link, ordered by index
+  std::vector<NetLink> links() const;
+
+private:
+  using LinkMap = std::map<int, NetLink>;
+
+  int resync(std::vector<NetEvent>* events);
+  int dump(int type, LinkMap& links);
+  void run();
+
+private:
+  mutable std::mutex  m_mutex;
+  LinkMap             m_links;
+  NetEventHandler     m_on_event;
+  std::thread         m_thread;
+  int                 m_fd;
+  int                 m_wakeup_fd;
+  uint32_t            m_seq;
+};
+
+#endif
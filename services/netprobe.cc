@@ -0,0 +1,376 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "netprobe.h"
+#include "../rpclogger.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <netpacket/packet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  // like arping, a request goes out every second until one is answered
+  int const kArpInterval = 1000;
+
+  struct ArpPacket
+  {
+    arphdr  Header;
+    uint8_t SenderMac[ETH_ALEN];
+    uint8_t SenderIp[4];
+    uint8_t TargetMac[ETH_ALEN];
+    uint8_t TargetIp[4];
+  } __attribute__((packed));
+
+  bool
+  parseMac(std::string const& s, uint8_t* mac)
+  {
+    return sscanf(s.c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2],
+      &mac[3], &mac[4], &mac[5]) == ETH_ALEN;
+  }
+
+  std::string
+  macToString(uint8_t const* mac)
+  {
+    char buff[18];
+    snprintf(buff, sizeof(buff), "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2],
+      mac[3], mac[4], mac[5]);
+    return std::string(buff);
+  }
+
+  int
+  remaining(Clock::time_point deadline, Clock::time_point now)
+  {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+    return ms > 0 ? static_cast<int>(ms) : 0;
+  }
+}
+
+struct NetProbe::Check
+{
+  enum class Kind
+  {
+    Arp,
+    Connect
+  };
+
+  Kind              CheckKind;
+  NetProbeResult    Result;
+  bool              Done;
+  int               Fd;
+  Clock::time_point Started;
+
+  // Arp
+  int               Index;
+  std::string       Source;
+  std::string       SourceMac;
+  Clock::time_point NextSend;
+
+  // Connect
+  std::string       Host;
+  int               Port;
+};
+
+NetProbe::NetProbe()
+{
+}
+
+NetProbe::~NetProbe()
+{
+  for (std::unique_ptr<Check> const& check : m_checks)
+  {
+    if (check->Fd != -1)
+      ::close(check->Fd);
+  }
+}
+
+void
+NetProbe::addArp(std::string const& gateway, int index, std::string const& source,
+  std::string const& mac)
+{
+  std::unique_ptr<Check> check(new Check());
+  check->CheckKind = Check::Kind::Arp;
+  check->Result = NetProbeResult{ "gateway", gateway, 0, 0.0, std::string() };
+  check->Done = false;
+  check->Fd = -1;
+  check->Index = index;
+  check->Source = source;
+  check->SourceMac = mac;
+  check->Port = 0;
+  m_checks.push_back(std::move(check));
+}
+
+void
+NetProbe::addConnect(std::string const& host, int port)
+{
+  std::unique_ptr<Check> check(new Check());
+  check->CheckKind = Check::Kind::Connect;
+  check->Result = NetProbeResult{ "endpoint", std::string(), 0, 0.0, std::string() };
+  check->Result.Target = (host.find(':') == std::string::npos ? host : "[" + host + "]") + ":" +
+    std::to_string(port);
+  check->Done = false;
+  check->Fd = -1;
+  check->Index = 0;
+  check->Host = host;
+  check->Port = port;
+  m_checks.push_back(std::move(check));
+}
+
+// opens the check's socket and sends its first packet. a check that
+// can't start is done with the reason in Error
+void
+NetProbe::begin(Check& check)
+{
+  check.Started = Clock::now();
+
+  if (check.CheckKind == Check::Kind::Connect)
+  {
+    sockaddr_storage addr;
+    socklen_t len = 0;
+    memset(&addr, 0, sizeof(addr));
+
+    sockaddr_in* sin = reinterpret_cast<sockaddr_in *>(&addr);
+    sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+    if (inet_pton(AF_INET, check.Host.c_str(), &sin->sin_addr) == 1)
+    {
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(check.Port);
+      len = sizeof(sockaddr_in);
+    }
+    else if (inet_pton(AF_INET6, check.Host.c_str(), &sin6->sin6_addr) == 1)
+    {
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(check.Port);
+      len = sizeof(sockaddr_in6);
+    }
+    else
+    {
+      check.Result.Error = EINVAL;
+      check.Done = true;
+      return;
+    }
+
+    check.Fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (check.Fd == -1)
+    {
+      check.Result.Error = errno;
+      check.Done = true;
+      return;
+    }
+
+    if (connect(check.Fd, reinterpret_cast<sockaddr *>(&addr), len) == 0)
+      check.Done = true;
+    else if (errno != EINPROGRESS)
+    {
+      check.Result.Error = errno;
+      check.Done = true;
+    }
+    return;
+  }
+
+  uint8_t mac[ETH_ALEN];
+  in_addr ip;
+  if (!parseMac(check.SourceMac, mac) || inet_pton(AF_INET, check.Source.c_str(), &ip) != 1 ||
+    inet_pton(AF_INET, check.Result.Target.c_str(), &ip) != 1)
+  {
+    check.Result.Error = EINVAL;
+    check.Done = true;
+    return;
+  }
+
+  check.Fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, htons(ETH_P_ARP));
+  if (check.Fd == -1)
+  {
+    check.Result.Error = errno;
+    check.Done = true;
+    return;
+  }
+
+  sockaddr_ll local;
+  memset(&local, 0, sizeof(local));
+  local.sll_family = AF_PACKET;
+  local.sll_protocol = htons(ETH_P_ARP);
+  local.sll_ifindex = check.Index;
+  if (bind(check.Fd, reinterpret_cast<sockaddr *>(&local), sizeof(local)) == -1)
+  {
+    check.Result.Error = errno;
+    check.Done = true;
+    return;
+  }
+
+  sendArp(check);
+}
+
+void
+NetProbe::sendArp(Check& check)
+{
+  ArpPacket req;
+  memset(&req, 0, sizeof(req));
+  req.Header.ar_hrd = htons(ARPHRD_ETHER);
+  req.Header.ar_pro = htons(ETH_P_IP);
+  req.Header.ar_hln = ETH_ALEN;
+  req.Header.ar_pln = 4;
+  req.Header.ar_op = htons(ARPOP_REQUEST);
+  parseMac(check.SourceMac, req.SenderMac);
+  inet_pton(AF_INET, check.Source.c_str(), req.SenderIp);
+  inet_pton(AF_INET, check.Result.Target.c_str(), req.TargetIp);
+
+  sockaddr_ll to;
+  memset(&to, 0, sizeof(to));
+  to.sll_family = AF_PACKET;
+  to.sll_protocol = htons(ETH_P_ARP);
+  to.sll_ifindex = check.Index;
+  to.sll_halen = ETH_ALEN;
+  memset(to.sll_addr, 0xff, ETH_ALEN);
+
+  if (sendto(check.Fd, &req, sizeof(req), 0, reinterpret_cast<sockaddr *>(&to), sizeof(to)) == -1)
+  {
+    check.Result.Error = errno;
+    check.Done = true;
+    return;
+  }
+
+  check.NextSend = Clock::now() + std::chrono::milliseconds(kArpInterval);
+}
+
+void
+NetProbe::onReadable(Check& check)
+{
+  uint8_t gateway[4];
+  inet_pton(AF_INET, check.Result.Target.c_str(), gateway);
+
+  ArpPacket reply;
+  ssize_t n = 0;
+  while ((n = recv(check.Fd, &reply, sizeof(reply), 0)) > 0)
+  {
+    if (static_cast<size_t>(n) < sizeof(reply) || reply.Header.ar_op != htons(ARPOP_REPLY))
+      continue;
+    if (memcmp(reply.SenderIp, gateway, sizeof(gateway)) != 0)
+      continue;
+
+    check.Result.Mac = macToString(reply.SenderMac);
+    check.Done = true;
+    return;
+  }
+}
+
+void
+NetProbe::onWritable(Check& check)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(check.Fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    err = errno;
+  check.Result.Error = err;
+  check.Done = true;
+}
+
+void
+NetProbe::run(int timeout, NetProbeHandler const& onResult)
+{
+  Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout);
+
+  auto finish = [&onResult](Check& check, Clock::time_point now)
+  {
+    check.Result.Time = std::chrono::duration<double, std::milli>(now - check.Started).count();
+    if (check.Fd != -1)
+    {
+      ::close(check.Fd);
+      check.Fd = -1;
+    }
+    if (onResult)
+      onResult(check.Result);
+  };
+
+  std::vector<Check*> pending;
+  for (std::unique_ptr<Check> const& check : m_checks)
+  {
+    begin(*check);
+    if (check->Done)
+      finish(*check, Clock::now());
+    else
+      pending.push_back(check.get());
+  }
+
+  while (!pending.empty())
+  {
+    Clock::time_point now = Clock::now();
+    int wait = remaining(deadline, now);
+
+    std::vector<pollfd> fds(pending.size());
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+      Check const* check = pending[i];
+      fds[i].fd = check->Fd;
+      fds[i].events = (check->CheckKind == Check::Kind::Arp) ? POLLIN : POLLOUT;
+      fds[i].revents = 0;
+      if (check->CheckKind == Check::Kind::Arp)
+        wait = std::min(wait, remaining(check->NextSend, now));
+    }
+
+    int ret = poll(&fds[0], fds.size(), wait);
+    if (ret == -1 && errno != EINTR)
+    {
+      int err = errno;
+      XLOG_ERROR("poll failed during network probe. %s", strerror(err));
+      for (Check* check : pending)
+        check->Result.Error = err;
+      deadline = now;
+    }
+
+    now = Clock::now();
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+      Check& check = *pending[i];
+      if (ret > 0 && (fds[i].revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)))
+      {
+        if (check.CheckKind == Check::Kind::Arp)
+          onReadable(check);
+        else
+          onWritable(check);
+      }
+
+      if (!check.Done && now >= deadline)
+      {
+        if (!check.Result.Error)
+          check.Result.Error = ETIMEDOUT;
+        check.Done = true;
+      }
+      else if (!check.Done && check.CheckKind == Check::Kind::Arp && now >= check.NextSend)
+      {
+        sendArp(check);
+      }
+
+      if (check.Done)
+        finish(check, now);
+    }
+
+    pending.erase(std::remove_if(pending.begin(), pending.end(),
+      [](Check const* check) { return check->Done; }), pending.end());
+  }
+}
@@ -0,0 +1,68 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __NET_PROBE_H__
+#define __NET_PROBE_H__
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct NetProbeResult
+{
+  std::string Check;    // "gateway" or "endpoint"
+  std::string Target;
+  int         Error;    // 0 or an errno, ETIMEDOUT if there was no answer
+  double      Time;     // milliseconds from the start of the check
+  std::string Mac;      // the gateway's hardware address
+};
+
+using NetProbeHandler = std::function<void (NetProbeResult const& result)>;
+
+// Connectivity checks that run side by side on non-blocking sockets, so a
+// probe takes as long as its slowest check instead of the sum of them.
+// Nothing is spawned.
+class NetProbe
+{
+public:
+  NetProbe();
+  ~NetProbe();
+
+  // ARP requests for an IPv4 gateway, sent out of the link with the
+  // given index from its address and MAC. needs CAP_NET_RAW
+  void addArp(std::string const& gateway, int index, std::string const& source,
+    std::string const& mac);
+
+  // a TCP connect to a numeric IPv4 or IPv6 address
+  void addConnect(std::string const& host, int port);
+
+  // starts every check and waits up to timeout milliseconds for them.
+  // onResult is called as each one finishes
+  void run(int timeout, NetProbeHandler const& onResult);
+
+private:
+  struct Check;
+
+  void begin(Check& check);
+  void onReadable(Check& check);
+  void onWritable(Check& check);
+  void sendArp(Check& check);
+
+private:
+  std::vector< std::unique_ptr<Check> > m_checks;
+};
+
+#endif
@@ -14,13 +14,18 @@
 // limitations under the License.
 //
 #include "netservice.h"
+#include "../jsonrpc.h"
 #include "../rpclogger.h"
+#include "netprobe.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <ifaddrs.h>
-#include <netdb.h>
-#include <stdlib.h>
+#include <net/if.h>
+#include <linux/rtnetlink.h>
 #include <string.h>
 #include <errno.h>
 
@@ -31,135 +36,396 @@ JSONRPC_SERVICE_DEFINE(net, []{return new NetService();});
 
 namespace
 {
+  char const kDefaultResolvConf[] = "/etc/resolv.conf";
+  int const kDefaultProbeTimeout = 3000;
+
+  // the longest a client can make a probe wait, whatever it asks for
+  int const kMaxProbeTimeout = 10000;
+
   char const*
-  to_string(sockaddr* s, char* buff, int n)
+  familyToString(int family)
+  {
+    return family == AF_INET6 ? "inet6" : "inet";
+  }
+
+  cJSON*
+  probeResultToJson(NetProbeResult const& result)
   {
-    void* p = nullptr;
-    if (s->sa_family == AF_INET)
+    cJSON* res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "check", result.Check.c_str());
+    cJSON_AddStringToObject(res, "target", result.Target.c_str());
+    cJSON_AddBoolToObject(res, "ok", result.Error == 0);
+    cJSON_AddNumberToObject(res, "time", result.Time);
+    if (result.Error)
     {
-      sockaddr_in* sin = reinterpret_cast<sockaddr_in *>(s);
-      p = reinterpret_cast< void * >(&sin->sin_addr);
+      cJSON_AddNumberToObject(res, "error", result.Error);
+      cJSON_AddStringToObject(res, "message", strerror(result.Error));
     }
-    else if (s->sa_family == AF_INET6)
+    if (!result.Mac.empty())
+      cJSON_AddStringToObject(res, "mac", result.Mac.c_str());
+    return res;
+  }
+
+  char const*
+  scopeToString(int scope)
+  {
+    switch (scope)
     {
-      sockaddr_in6* sin = reinterpret_cast<sockaddr_in6 *>(s);
-      p = reinterpret_cast< void * >(&sin->sin6_addr);
+      case RT_SCOPE_UNIVERSE: return "global";
+      case RT_SCOPE_SITE: return "site";
+      case RT_SCOPE_LINK: return "link";
+      case RT_SCOPE_HOST: return "host";
     }
-
-    memset(buff, 0, n);
-
-    char const* str = inet_ntop(s->sa_family, p, buff, n);
-    return str;
+    return "unknown";
   }
 
-  cJSON*
-  get_device(cJSON* res, char const* devname)
+  char const*
+  changeToString(NetChange change)
   {
-    cJSON* obj = cJSON_GetObjectItem(res, "interfaces");
-    if (!obj)
+    switch (change)
     {
-      obj = cJSON_CreateArray();
-      cJSON_AddItemToObject(res, "interfaces", obj);
+      case NetChange::LinkAdded:
+      case NetChange::AddressAdded:
+        return "added";
+      case NetChange::LinkChanged:
+        return "changed";
+      case NetChange::LinkRemoved:
+      case NetChange::AddressRemoved:
+        return "removed";
     }
+    return "unknown";
+  }
 
-    cJSON* dev = nullptr;
-    for (int i = 0, n = cJSON_GetArraySize(obj); i < n; ++i)
+  cJSON*
+  addressToJson(NetAddress const& addr)
+  {
+    cJSON* entry = cJSON_CreateObject();
+    if (addr.Family == AF_INET)
     {
-      cJSON* item = cJSON_GetArrayItem(obj, i);
-      cJSON* name = cJSON_GetObjectItem(item, "dev");
-      if (name && (strcmp(name->valuestring, devname) == 0))
-      {
-        dev = item;
-        break;
-      }
+      char buff[INET_ADDRSTRLEN];
+      in_addr mask;
+      mask.s_addr = htonl(addr.PrefixLen ? ~0u << (32 - addr.PrefixLen) : 0);
+
+      cJSON_AddStringToObject(entry, "inet", addr.Address.c_str());
+      cJSON_AddStringToObject(entry, "mask", inet_ntop(AF_INET, &mask, buff, sizeof(buff)));
+      if (!addr.Broadcast.empty())
+        cJSON_AddStringToObject(entry, "broadcast", addr.Broadcast.c_str());
     }
-    if (!dev)
+    else
     {
-      dev = cJSON_CreateObject();
-      cJSON_AddItemToObject(dev, "dev", cJSON_CreateString(devname));
-      cJSON_AddItemToArray(obj, dev);
+      cJSON_AddStringToObject(entry, "inet6", addr.Address.c_str());
+      cJSON_AddStringToObject(entry, "scope", scopeToString(addr.Scope));
     }
-
-    return dev;
+    return entry;
   }
 }
 
 NetService::NetService()
   : BasicRpcService("net")
+  , m_monitor_error(0)
+  , m_probe_port(0)
+  , m_probe_timeout(kDefaultProbeTimeout)
+  , m_probing(false)
+  , m_probe_dropped(false)
 {
 }
 
 NetService::~NetService()
 {
+  m_probe_dropped = true;
+  if (m_prober.joinable())
+    m_prober.join();
 }
 
 void
-NetService::init(cJSON const* conf, RpcNotificationFunction const& callback)
+NetService::init(cJSON const* conf, RpcNotifier const& notifier)
 {
-  BasicRpcService::init(conf, callback);
+  BasicRpcService::init(conf, notifier);
   registerMethod("get-interfaces", [this](cJSON const* req) -> cJSON* { return this->getInterfaces(req); });
+  registerMethod("get-stats", [this](cJSON const* req) -> cJSON* { return this->getStats(req); });
+  registerMethod("get-default-route", [this](cJSON const* req) -> cJSON* { return this->getDefaultRoute(req); });
+  registerMethod("get-dns", [this](cJSON const* req) -> cJSON* { return this->getDns(req); });
+  registerMethod("probe", [this](cJSON const* req) -> cJSON* { return this->probe(req); });
+
+  // "probe" names the endpoint net-probe connects to, usually something
+  // on the local network that's known to be up
+  m_resolv_conf = JsonRpc::getString(conf, "/settings/resolv-conf", false, kDefaultResolvConf);
+  m_probe_host = JsonRpc::getString(conf, "/settings/probe/host", false, "");
+  m_probe_port = JsonRpc::getInt(conf, "/settings/probe/port", false, 0);
+  m_probe_timeout = JsonRpc::getInt(conf, "/settings/probe/timeout", false, kDefaultProbeTimeout);
+
+  m_monitor_error = m_monitor.start([this](NetEvent const& e) { this->onNetEvent(e); });
+  if (m_monitor_error)
+    XLOG_ERROR("failed to start interface monitor. %s", strerror(m_monitor_error));
 }
 
+// served from the monitor's copy of the kernel tables, so nothing is
+// read from the kernel here. only links with an address are listed
 cJSON*
 NetService::getInterfaces(cJSON const* UNUSED_PARAM(req))
 {
+  if (m_monitor_error)
+    return JsonRpc::makeError(m_monitor_error, "interface monitor isn't running. %s",
+      strerror(m_monitor_error));
 
-  cJSON* res = nullptr;
+  cJSON* interfaces = cJSON_CreateArray();
+  for (NetLink const& link : m_monitor.links())
+  {
+    if (link.Addrs.empty())
+      continue;
+
+    cJSON* addrs = cJSON_CreateArray();
+    for (NetAddress const& addr : link.Addrs)
+      cJSON_AddItemToArray(addrs, addressToJson(addr));
+
+    cJSON* dev = cJSON_CreateObject();
+    cJSON_AddItemToObject(dev, "dev", cJSON_CreateString(link.Name.c_str()));
+    cJSON_AddItemToObject(dev, "addrs", addrs);
+    cJSON_AddItemToArray(interfaces, dev);
+  }
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddItemToObject(res, "interfaces", interfaces);
+  return res;
+}
 
-  ifaddrs* ifaddr = nullptr;
-  int ret = getifaddrs(&ifaddr);
-  if (ret == -1)
+// links go out on net.link and addresses on net.addr, so a client
+// waiting for DHCP can subscribe to just the addresses
+void
+NetService::onNetEvent(NetEvent const& e)
+{
+  bool isLink = (e.Change == NetChange::LinkAdded || e.Change == NetChange::LinkChanged ||
+    e.Change == NetChange::LinkRemoved);
+
+  char const* topic = isLink ? "net.link" : "net.addr";
+  if (!isSubscribed(topic))
+    return;
+
+  cJSON* params = cJSON_CreateObject();
+  cJSON_AddStringToObject(params, "event", changeToString(e.Change));
+  cJSON_AddStringToObject(params, "dev", e.Link.Name.c_str());
+  if (isLink)
+  {
+    cJSON_AddNumberToObject(params, "index", e.Link.Index);
+    cJSON_AddStringToObject(params, "state", e.Link.OperState.c_str());
+    cJSON_AddBoolToObject(params, "up", (e.Link.Flags & IFF_UP) != 0);
+    cJSON_AddBoolToObject(params, "running", (e.Link.Flags & IFF_RUNNING) != 0);
+    cJSON_AddNumberToObject(params, "mtu", e.Link.Mtu);
+    cJSON_AddStringToObject(params, "mac", e.Link.Mac.c_str());
+  }
+  else
   {
-    XLOG_ERROR("getifaddrs:%d", errno);
-    return nullptr;
+    cJSON_AddItemToObject(params, "addr", addressToJson(e.Address));
   }
+  publishAndDelete(topic, params);
+}
+
+// { "dev": "wlan0" } for one interface, or every interface without it
+cJSON*
+NetService::getStats(cJSON const* req)
+{
+  char const* dev = JsonRpc::getString(req, "/params/dev", false, nullptr);
 
-  res = cJSON_CreateObject();
+  std::vector<NetLinkStats> stats;
+  int ret = netlinkGetLinkStats(stats);
+  if (ret)
+    return JsonRpc::makeError(ret, "failed to read interface statistics. %s", strerror(ret));
 
-  for (ifaddrs* i = ifaddr; i != nullptr; i = i->ifa_next)
+  cJSON* interfaces = cJSON_CreateArray();
+  for (NetLinkStats const& link : stats)
   {
-    int family = i->ifa_addr->sa_family;
-    if (family != AF_INET && family != AF_INET6)
+    if (dev && link.Name != dev)
       continue;
 
-    char host[INET6_ADDRSTRLEN];
+    cJSON* entry = cJSON_CreateObject();
+    cJSON_AddStringToObject(entry, "dev", link.Name.c_str());
+    cJSON_AddNumberToObject(entry, "rx_bytes", link.RxBytes);
+    cJSON_AddNumberToObject(entry, "tx_bytes", link.TxBytes);
+    cJSON_AddNumberToObject(entry, "rx_packets", link.RxPackets);
+    cJSON_AddNumberToObject(entry, "tx_packets", link.TxPackets);
+    cJSON_AddNumberToObject(entry, "rx_errors", link.RxErrors);
+    cJSON_AddNumberToObject(entry, "tx_errors", link.TxErrors);
+    cJSON_AddNumberToObject(entry, "rx_dropped", link.RxDropped);
+    cJSON_AddNumberToObject(entry, "tx_dropped", link.TxDropped);
+    cJSON_AddItemToArray(interfaces, entry);
+  }
+
+  if (dev && cJSON_GetArraySize(interfaces) == 0)
+  {
+    cJSON_Delete(interfaces);
+    return JsonRpc::makeError(ENODEV, "no interface %s", dev);
+  }
 
-    cJSON* dev = get_device(res, i->ifa_name);
-    cJSON* addrs = cJSON_GetObjectItem(dev, "addrs");
-    if (!addrs)
-    {
-      addrs = cJSON_CreateArray();
-      cJSON_AddItemToObject(dev, "addrs", addrs);
-    }
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddItemToObject(res, "interfaces", interfaces);
+  return res;
+}
+
+cJSON*
+NetService::getDefaultRoute(cJSON const* UNUSED_PARAM(req))
+{
+  std::vector<NetRoute> routes;
+  int ret = netlinkGetDefaultRoutes(routes);
+  if (ret)
+    return JsonRpc::makeError(ret, "failed to read routes. %s", strerror(ret));
 
+  cJSON* list = cJSON_CreateArray();
+  for (NetRoute const& route : routes)
+  {
     cJSON* entry = cJSON_CreateObject();
-    to_string(i->ifa_addr, host, sizeof(host));
-    cJSON_AddStringToObject(entry, (family == AF_INET ? "inet" : "inet6"), host);
+    cJSON_AddStringToObject(entry, "family", familyToString(route.Family));
+    if (!route.Gateway.empty())
+      cJSON_AddStringToObject(entry, "gateway", route.Gateway.c_str());
+    cJSON_AddStringToObject(entry, "dev", route.Dev.c_str());
+    cJSON_AddNumberToObject(entry, "metric", route.Metric);
+    cJSON_AddItemToArray(list, entry);
+  }
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddItemToObject(res, "routes", list);
+  return res;
+}
+
+// the resolvers the system's stub resolver uses, from resolv.conf
+cJSON*
+NetService::getDns(cJSON const* UNUSED_PARAM(req))
+{
+  std::ifstream in(m_resolv_conf.c_str());
+  if (!in)
+    return JsonRpc::makeError(errno, "failed to open %s. %s", m_resolv_conf.c_str(), strerror(errno));
+
+  cJSON* nameservers = cJSON_CreateArray();
+  cJSON* search = cJSON_CreateArray();
 
-    if (i->ifa_netmask && family == AF_INET)
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::istringstream words(line);
+    std::string keyword;
+    if (!(words >> keyword))
+      continue;
+
+    std::string value;
+    if (keyword == "nameserver" && (words >> value))
     {
-      cJSON_AddStringToObject(entry, "mask", to_string(i->ifa_netmask, host, sizeof(host)));
-      if (strcmp(i->ifa_name, "lo") != 0)
-        cJSON_AddStringToObject(entry, "broadcast", to_string(i->ifa_broadaddr, host, sizeof(host)));
+      cJSON_AddItemToArray(nameservers, cJSON_CreateString(value.c_str()));
     }
-    else if (family == AF_INET6)
+    else if (keyword == "search" || keyword == "domain")
     {
-      sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6 *>(i->ifa_addr);
-      if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr))
-        cJSON_AddStringToObject(entry, "scope", "link");
-      else if (IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr))
-        cJSON_AddStringToObject(entry, "scope", "host");
-      else if (IN6_IS_ADDR_SITELOCAL(&sin6->sin6_addr))
-        cJSON_AddStringToObject(entry, "scope", "site");
-      else
-        cJSON_AddStringToObject(entry, "scope", "global");
+      // the last search or domain line wins
+      cJSON_Delete(search);
+      search = cJSON_CreateArray();
+      while (words >> value)
+        cJSON_AddItemToArray(search, cJSON_CreateString(value.c_str()));
     }
+  }
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddItemToObject(res, "nameservers", nameservers);
+  cJSON_AddItemToObject(res, "search", search);
+  return res;
+}
+
+// ARPs the IPv4 default gateway and connects to the configured endpoint
+// at the same time, on a thread of its own so other requests are served
+// meanwhile. each check is sent as a partial result when it finishes, and
+// the response has all of them. "host", "port" and "timeout" (ms) in the
+// params override the settings. one probe runs at a time
+cJSON*
+NetService::probe(cJSON const* req)
+{
+  int reqId = JsonRpc::getInt(req, "id", false, -1);
+  std::string host = JsonRpc::getString(req, "/params/host", false, m_probe_host.c_str());
+  int port = JsonRpc::getInt(req, "/params/port", false, m_probe_port);
+  int timeout = JsonRpc::getInt(req, "/params/timeout", false, m_probe_timeout);
+  timeout = std::max(0, std::min(timeout, kMaxProbeTimeout));
+
+  std::lock_guard<std::mutex> guard(m_probe_mutex);
+  if (m_probing)
+    return JsonRpc::makeError(EBUSY, "a probe is already running");
+
+  // the last probe is done, though it may still be sending its response
+  if (m_prober.joinable())
+    m_prober.join();
+
+  cJSON* checks = cJSON_CreateArray();
+  std::unique_ptr<NetProbe> probe(new NetProbe());
 
-    cJSON_AddItemToArray(addrs, entry);
+  std::vector<NetRoute> routes;
+  int ret = netlinkGetDefaultRoutes(routes);
+
+  auto gateway = std::find_if(routes.begin(), routes.end(), [](NetRoute const& route)
+  {
+    return route.Family == AF_INET && !route.Gateway.empty();
+  });
+
+  if (ret || gateway == routes.end())
+  {
+    NetProbeResult result{ "gateway", std::string(), ret ? ret : ENETUNREACH, 0.0, std::string() };
+    cJSON_AddItemToArray(checks, probeResultToJson(result));
+  }
+  else
+  {
+    std::string source;
+    std::string mac;
+    for (NetLink const& link : m_monitor.links())
+    {
+      if (link.Index != gateway->Index)
+        continue;
+      mac = link.Mac;
+      for (NetAddress const& addr : link.Addrs)
+      {
+        if (addr.Family == AF_INET && source.empty())
+          source = addr.Address;
+      }
+    }
+    probe->addArp(gateway->Gateway, gateway->Index, source, mac);
   }
 
-  if (ifaddr)
-    freeifaddrs(ifaddr);
+  if (!host.empty() && port > 0)
+    probe->addConnect(host, port);
 
-  return res;
+  m_probing = true;
+  m_probe_dropped = false;
+  m_prober = std::thread(&NetService::runProbe, this, std::move(probe), checks, reqId, timeout);
+  return JsonRpc::deferred();
+}
+
+void
+NetService::runProbe(std::unique_ptr<NetProbe> probe, cJSON* checks, int reqId, int timeout)
+{
+  bool ok = cJSON_GetArraySize(checks) == 0;
+  probe->run(timeout, [this, checks, reqId, &ok](NetProbeResult const& result)
+  {
+    if (result.Error)
+      ok = false;
+    cJSON_AddItemToArray(checks, probeResultToJson(result));
+    if (!m_probe_dropped)
+      notifyAndDelete(JsonRpc::wrapResponse(0, probeResultToJson(result), reqId));
+  });
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddBoolToObject(res, "ok", ok);
+  cJSON_AddItemToObject(res, "checks", checks);
+
+  // the client may send its next probe as soon as it has the response,
+  // so this one has to be done by then. the next probe clears the flag
+  bool dropped = m_probe_dropped;
+  {
+    std::lock_guard<std::mutex> guard(m_probe_mutex);
+    m_probing = false;
+  }
+
+  if (!dropped)
+    notifyAndDelete(JsonRpc::wrapResponse(0, res, reqId));
+  else
+    cJSON_Delete(res);
+}
+
+// a probe still running was asked for by the last client, so what's left
+// of it isn't sent to the next one
+void
+NetService::onClientChanged()
+{
+  m_probe_dropped = true;
 }
@@ -13,20 +13,48 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
-#ifndef __WPA_CONTROL_H__
-#define __WPA_CONTROL_H__
+#ifndef __NET_SERVICE_H__
+#define __NET_SERVICE_H__
 
 #include "../defs.h"
 #include "../rpcserver.h"
+#include "netlink.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class NetProbe;
 
 class NetService : public BasicRpcService
 {
 public:
   NetService();
   virtual ~NetService();
-  virtual void init(cJSON const* conf, RpcNotificationFunction const& callback) override;
+  virtual void init(cJSON const* conf, RpcNotifier const& notifier) override;
+  virtual void onClientChanged() override;
 private:
   cJSON* getInterfaces(cJSON const* req);
+  cJSON* getStats(cJSON const* req);
+  cJSON* getDefaultRoute(cJSON const* req);
+  cJSON* getDns(cJSON const* req);
+  cJSON* probe(cJSON const* req);
+  void runProbe(std::unique_ptr<NetProbe> probe, cJSON* checks, int reqId, int timeout);
+  void onNetEvent(NetEvent const& e);
+
+private:
+  NetlinkMonitor    m_monitor;
+  int               m_monitor_error;
+  std::string       m_resolv_conf;
+  std::string       m_probe_host;
+  int               m_probe_port;
+  int               m_probe_timeout;
+  std::mutex        m_probe_mutex;
+  std::thread       m_prober;
+  bool              m_probing;
+  std::atomic<bool> m_probe_dropped;
 };
 
 #endif
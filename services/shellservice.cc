@@ -14,117 +14,597 @@
 // limitations under the License.
 //
 #include "shellservice.h"
+#include "argvtemplate.h"
+#include "coprocess.h"
+#include "subprocess.h"
 #include "../rpclogger.h"
 #include "../jsonrpc.h"
 
-#include <sstream>
+#include <algorithm>
+
+#include <errno.h>
+#include <signal.h>
 #include <string.h>
 
 JSONRPC_SERVICE_DEFINE(cmd, []{return new ShellService();});
 
+// An entry of /settings/commands, compiled once at init
+struct ShellCommand
+{
+  std::string                     Name;
+  std::string                     Exec;
+  ArgvTemplate                    Argv;
+  SubprocessOptions               Options;
+
+  // how many copies may run at once, 0 for as many as there are workers.
+  // Running is guarded by the service's mutex
+  int                             MaxConcurrent;
+  int                             Running;
+
+  // set for "mode": "coprocess"
+  std::shared_ptr<CoProcessPool>  Workers;
+};
+
+// One run of a command, from cmd-exec or cmd-start. Everything but the
+// constant fields is guarded by the service's mutex
+struct ShellJob
+{
+  enum class State
+  {
+    Queued,
+    Running,
+    Done
+  };
+
+  ShellJob()
+    : Id(0)
+    , Args(nullptr)
+    , ReqId(-1)
+    , Streamed(false)
+    , Detached(false)
+    , Dropped(false)
+    , JobState(State::Queued)
+    , Cancelled(false)
+    , Process(nullptr)
+    , Result(nullptr) { }
+
+  ~ShellJob()
+  {
+    if (Args)
+      cJSON_Delete(Args);
+    if (Result)
+      cJSON_Delete(Result);
+  }
+
+  int                           Id;
+  std::shared_ptr<ShellCommand> Command;
+  std::vector<std::string>      Argv;
+  cJSON*                        Args;
+  int                           ReqId;
+  bool                          Streamed;
+
+  // started with cmd-start and kept around after it finishes so the
+  // result can be collected
+  bool                          Detached;
+
+  // a cmd-exec whose client went away, so nothing more is sent for it
+  bool                          Dropped;
+
+  State                         JobState;
+  bool                          Cancelled;
+  Subprocess*                   Process;
+  std::string                   Stdout;
+  std::string                   Stderr;
+  cJSON*                        Result;
+};
+
 namespace
 {
-  cJSON const* 
-  findCommand(cJSON const* cmds, char const* method)
+  int const kDefaultCoProcessTimeout = 5000;
+  int const kDefaultTimeout = 30000;
+  int const kDefaultMaxOutput = 64 * 1024;
+  int const kDefaultMaxJobs = 4;
+  int const kDefaultMaxQueue = 32;
+
+  // finished cmd-start jobs kept for cmd-status. the oldest goes first
+  size_t const kMaxFinishedJobs = 16;
+
+  // the args object goes to the helper as one line of JSON and the reply
+  // text comes back as stdout
+  cJSON*
+  invokeCoProcess(CoProcessPool& workers, cJSON const* args)
   {
-    for (int i =0, n = cJSON_GetArraySize(cmds); i < n; ++i)
-    {
-      cJSON const* temp = cJSON_GetArrayItem(cmds, i);
-      cJSON const* name = cJSON_GetObjectItem(temp, "name");
-      if (name && strcmp(name->valuestring, method) == 0)
-        return temp;
-    }
-    return nullptr;
+    char* s = args ? cJSON_PrintUnformatted(args) : nullptr;
+    std::string request(s ? s : "{}");
+    free(s);
+
+    std::string reply;
+    int err = workers.call(request, reply);
+    if (err)
+      return JsonRpc::makeError(err, "failed to call %s. %s", workers.name().c_str(), strerror(err));
+
+    std::string text;
+    if (!coProcessParseReply(reply, text))
+      return JsonRpc::makeError(-1, "%s failed. %s", workers.name().c_str(), text.c_str());
+
+    cJSON* res = cJSON_CreateObject();
+    cJSON_AddItemToObject(res, "return_code", cJSON_CreateNumber(0));
+    cJSON_AddItemToObject(res, "stdout", cJSON_CreateString(text.c_str()));
+    return res;
   }
 
+  // out and err are left out when the output was streamed
   cJSON*
-  invokeShellCommand(cJSON const* config, cJSON const* args)
+  resultToJson(SubprocessResult const& result, std::string const* out, std::string const* err)
   {
-    cJSON* res = nullptr;
+    cJSON* res = cJSON_CreateObject();
+    cJSON_AddItemToObject(res, "return_code", cJSON_CreateNumber(result.ExitStatus));
+    if (result.Signal)
+      cJSON_AddItemToObject(res, "signal", cJSON_CreateNumber(result.Signal));
+    if (out)
+      cJSON_AddItemToObject(res, "stdout", cJSON_CreateString(out->c_str()));
+    if (err)
+      cJSON_AddItemToObject(res, "stderr", cJSON_CreateString(err->c_str()));
+    cJSON_AddBoolToObject(res, "timed_out", result.TimedOut);
+    cJSON_AddBoolToObject(res, "truncated", result.Truncated);
+    return res;
+  }
+
+  char const*
+  stateToString(ShellJob const& job)
+  {
+    if (job.Cancelled)
+      return "cancelled";
+    switch (job.JobState)
+    {
+      case ShellJob::State::Queued: return "queued";
+      case ShellJob::State::Running: return "running";
+      case ShellJob::State::Done: return "done";
+    }
+    return "unknown";
+  }
+}
 
-    // Should have several options
-    // 1. copy stdout true|false
-    // 2. copy stderr true|false
-    // ${arg:1} ${arg:2}
-    std::string path = JsonRpc::getStringWithExpansion(config, "/exec", true,
-      nullptr, args);
+bool
+ShellService::dropped(ShellJob const& job)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  return job.Dropped;
+}
+
+// the command runs directly from its argv template, no shell involved.
+// output is kept on the job so cmd-status can show it while the command
+// runs, and when the job is streamed it's also sent as partial results
+cJSON*
+ShellService::runJob(ShellJob& job)
+{
+  ShellCommand const& command = *job.Command;
+  if (command.Workers)
+    return invokeCoProcess(*command.Workers, job.Args);
+
+  XLOG_INFO("exec:%s", command.Exec.c_str());
 
-    XLOG_INFO("popen:%s", path.c_str());
+  Subprocess process;
+  int ret = process.start(job.Argv);
+  if (ret)
+    return JsonRpc::makeError(ret, "failed to execute %s. %s", command.Exec.c_str(), strerror(ret));
+
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    job.Process = &process;
+    if (job.Cancelled)
+      process.kill(SIGKILL);
+  }
+
+  SubprocessResult result;
+  ret = process.wait(command.Options, [this, &job](SubprocessStream s, char const* buff, size_t n)
+  {
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      (s == SubprocessStream::Stdout ? job.Stdout : job.Stderr).append(buff, n);
+    }
 
-    FILE* in = popen(path.c_str(), "r");
-    if (in)
+    if (job.Streamed && !dropped(job))
     {
-      std::stringstream output;
+      cJSON* chunk = cJSON_CreateObject();
+      cJSON_AddStringToObject(chunk, "stream", s == SubprocessStream::Stdout ? "stdout" : "stderr");
+      cJSON_AddItemToObject(chunk, "data", cJSON_CreateString(std::string(buff, n).c_str()));
+      notifyAndDelete(JsonRpc::wrapResponse(0, chunk, job.ReqId));
+    }
+    return false;
+  }, result);
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  job.Process = nullptr;
+
+  if (ret)
+    return JsonRpc::makeError(ret, "failed to read output of %s. %s", command.Exec.c_str(), strerror(ret));
+
+  cJSON* res = job.Streamed
+    ? resultToJson(result, nullptr, nullptr)
+    : resultToJson(result, &job.Stdout, &job.Stderr);
 
-      char buff[256];
-      memset(buff, 0, sizeof(buff));
-      while (fgets(buff, sizeof(buff), in))
+  job.Stdout.clear();
+  job.Stderr.clear();
+  return res;
+}
+
+// each worker takes the oldest queued job whose command isn't already
+// running as many copies as it's allowed
+void
+ShellService::runWorker()
+{
+  std::unique_lock<std::mutex> guard(m_mutex);
+  while (m_running)
+  {
+    auto itr = std::find_if(m_queue.begin(), m_queue.end(),
+      [](std::shared_ptr<ShellJob> const& job)
       {
-        output << buff;
-        memset(buff, 0, sizeof(buff));
-      }
+        ShellCommand const& command = *job->Command;
+        return command.MaxConcurrent <= 0 || command.Running < command.MaxConcurrent;
+      });
 
-      res = cJSON_CreateObject();
-      cJSON_AddItemToObject(res, "return_code", cJSON_CreateNumber(0));
-      cJSON_AddItemToObject(res, "stdout", cJSON_CreateString(output.str().c_str()));
-      pclose(in);
+    if (itr == m_queue.end())
+    {
+      m_cond.wait(guard);
+      continue;
     }
-    else
+
+    std::shared_ptr<ShellJob> job = *itr;
+    m_queue.erase(itr);
+    job->JobState = ShellJob::State::Running;
+    job->Command->Running++;
+
+    guard.unlock();
+    cJSON* res = runJob(*job);
+    guard.lock();
+
+    job->Command->Running--;
+    cJSON* response = finishJob(*job, res);
+    if (response)
+    {
+      guard.unlock();
+      notifyAndDelete(response);
+      guard.lock();
+    }
+  }
+}
+
+// the caller holds m_mutex. cmd-start jobs stay until newer ones push
+// them out. a cmd-exec job goes right away, and its response is returned
+// for the caller to send once it has let go of m_mutex
+cJSON*
+ShellService::finishJob(ShellJob& job, cJSON* res)
+{
+  job.JobState = ShellJob::State::Done;
+  m_cond.notify_all();
+
+  if (job.Detached)
+  {
+    job.Result = res;
+    m_finished.push_back(job.Id);
+    while (m_finished.size() > kMaxFinishedJobs)
+    {
+      m_jobs.erase(m_finished.front());
+      m_finished.pop_front();
+    }
+    return nullptr;
+  }
+
+  m_jobs.erase(job.Id);
+  if (job.Dropped)
+  {
+    cJSON_Delete(res);
+    return nullptr;
+  }
+  // an error result goes out as an error, as the server does it
+  return JsonRpc::wrapResponse(JsonRpc::getInt(res, "code", false, 0), res, job.ReqId);
+}
+
+// checks the command and its args and queues a job for it. on failure
+// returns null and sets res to the error
+std::shared_ptr<ShellJob>
+ShellService::submit(cJSON const* req, bool detached, cJSON** res)
+{
+  char const* commandName = JsonRpc::getString(req, "/params/command_name", true);
+
+  auto itr = m_commands.find(commandName);
+  if (itr == m_commands.end())
+  {
+    *res = JsonRpc::makeError(-1, "can't find configuration for shell command '%s'", commandName);
+    return nullptr;
+  }
+
+  cJSON const* args = JsonRpc::search(req, "/params/args", false);
+  cJSON const* stream = JsonRpc::search(req, "/params/stream", false);
+
+  std::shared_ptr<ShellJob> job = std::make_shared<ShellJob>();
+  job->Command = itr->second;
+  job->ReqId = JsonRpc::getInt(req, "id", false, -1);
+  job->Streamed = !detached && stream && stream->type == cJSON_True;
+  job->Detached = detached;
+
+  if (job->Command->Workers)
+  {
+    job->Args = args ? cJSON_Duplicate(args, true) : nullptr;
+  }
+  else
+  {
+    std::string err;
+    if (job->Command->Argv.expand(args, job->Argv, &err) != 0)
     {
-      int err = errno;
-      res = JsonRpc::makeError(err, "failed to execute %s. %s",
-        path.c_str(), strerror(errno));
+      *res = JsonRpc::makeError(EINVAL, "%s: %s", commandName, err.c_str());
+      return nullptr;
     }
+  }
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (static_cast<int>(m_queue.size()) >= m_max_queue)
+  {
+    *res = JsonRpc::makeError(EBUSY, "too many commands waiting to run");
+    return nullptr;
+  }
+
+  job->Id = m_next_job++;
+  m_jobs[job->Id] = job;
+  m_queue.push_back(job);
+  m_cond.notify_all();
+
+  return job;
+}
 
+// the caller holds m_mutex
+cJSON*
+ShellService::jobToJson(ShellJob const& job, bool details) const
+{
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddNumberToObject(res, "job", job.Id);
+  cJSON_AddStringToObject(res, "command_name", job.Command->Name.c_str());
+  cJSON_AddStringToObject(res, "state", stateToString(job));
+
+  if (job.JobState == ShellJob::State::Queued)
+  {
+    auto itr = std::find_if(m_queue.begin(), m_queue.end(),
+      [&job](std::shared_ptr<ShellJob> const& queued) { return queued.get() == &job; });
+    cJSON_AddNumberToObject(res, "position", (itr - m_queue.begin()) + 1);
+  }
+
+  if (!details)
     return res;
+
+  if (job.JobState == ShellJob::State::Running && !job.Command->Workers)
+  {
+    cJSON_AddStringToObject(res, "stdout", job.Stdout.c_str());
+    cJSON_AddStringToObject(res, "stderr", job.Stderr.c_str());
   }
+  else if (job.JobState == ShellJob::State::Done && job.Result)
+  {
+    cJSON_AddItemToObject(res, "result", cJSON_Duplicate(job.Result, true));
+  }
+
+  return res;
 }
 
 ShellService::ShellService()
   : BasicRpcService("cmd")
+  , m_next_job(1)
+  , m_running(false)
+  , m_max_queue(kDefaultMaxQueue)
 {
 }
 
 ShellService::~ShellService()
 {
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_running = false;
+    for (auto const& job : m_jobs)
+    {
+      job.second->Cancelled = true;
+      if (job.second->Process)
+        job.second->Process->kill(SIGKILL);
+    }
+  }
+  m_cond.notify_all();
+
+  for (std::thread& worker : m_workers)
+    worker.join();
 }
 
 void
-ShellService::init(cJSON const* conf, RpcNotificationFunction const& callback)
+ShellService::init(cJSON const* conf, RpcNotifier const& notifier)
 {
-  BasicRpcService::init(conf, callback);
+  BasicRpcService::init(conf, notifier);
   registerMethod("exec", [this](cJSON const* req) -> cJSON* { return this->executeCommand(req); });
+  registerMethod("start", [this](cJSON const* req) -> cJSON* { return this->startJob(req); });
+  registerMethod("status", [this](cJSON const* req) -> cJSON* { return this->getJobStatus(req); });
+  registerMethod("jobs", [this](cJSON const* req) -> cJSON* { return this->listJobs(req); });
+  registerMethod("cancel", [this](cJSON const* req) -> cJSON* { return this->cancelJob(req); });
 
-  cJSON const* settings = cJSON_GetObjectItem(conf, "settings");
-  if (settings)
+  cJSON const* commands = JsonRpc::search(conf, "/settings/commands", false);
+  for (cJSON const* item = commands ? commands->child : nullptr; item; item = item->next)
   {
-    cJSON const* commands = cJSON_GetObjectItem(settings, "commands");
-    if (commands)
-      m_commands = cJSON_Duplicate(commands, true);
+    char const* name = JsonRpc::getString(item, "name", false);
+    char const* exec = JsonRpc::getString(item, "exec", false);
+    if (!name || !exec)
+    {
+      XLOG_WARN("command needs a name and exec, skipping");
+      continue;
+    }
+
+    if (m_commands.count(name))
+    {
+      XLOG_WARN("command %s is defined more than once, using the first", name);
+      continue;
+    }
+
+    std::shared_ptr<ShellCommand> command = std::make_shared<ShellCommand>();
+    command->Name = name;
+    command->Exec = exec;
+
+    std::string err;
+    if (command->Argv.parse(exec, &err) != 0)
+    {
+      XLOG_ERROR("failed to parse exec for command %s. %s", name, err.c_str());
+      continue;
+    }
+
+    // "timeout" (ms) and "max-output" (bytes) bound how long a command
+    // runs and how much it can write
+    command->Options.Timeout = JsonRpc::getInt(item, "timeout", false, kDefaultTimeout);
+    command->Options.MaxOutput = JsonRpc::getInt(item, "max-output", false, kDefaultMaxOutput);
+    command->MaxConcurrent = JsonRpc::getInt(item, "max-concurrent", false, 0);
+    command->Running = 0;
+
+    // "mode": "coprocess" commands are started once and kept running
+    char const* mode = JsonRpc::getString(item, "mode", false, "exec");
+    if (strcmp(mode, "coprocess") == 0)
+    {
+      std::vector<std::string> argv;
+      if (command->Argv.hasPlaceholders() || command->Argv.expand(nullptr, argv, &err) != 0)
+      {
+        XLOG_ERROR("coprocess command %s can't have placeholders, args are sent to it", name);
+        continue;
+      }
+
+      command->Workers = std::make_shared<CoProcessPool>(argv,
+        JsonRpc::getInt(item, "workers", false, 1),
+        JsonRpc::getInt(item, "timeout", false, kDefaultCoProcessTimeout));
+    }
+
+    m_commands[name] = command;
   }
+
+  // "max-jobs" commands run at once across all of them, each on a worker
+  // thread. up to "max-queue" more wait their turn
+  int maxJobs = JsonRpc::getInt(conf, "/settings/max-jobs", false, kDefaultMaxJobs);
+  m_max_queue = JsonRpc::getInt(conf, "/settings/max-queue", false, kDefaultMaxQueue);
+
+  m_running = true;
+  for (int i = 0; i < std::max(maxJobs, 1); ++i)
+    m_workers.push_back(std::thread(&ShellService::runWorker, this));
 }
 
+// queues the job and returns. the request is answered with the
+// command's result when a worker finishes it
 cJSON*
 ShellService::executeCommand(cJSON const* req)
 {
-  char const* commandName = JsonRpc::getString(req, "/params/command_name", true);
+  cJSON* res = nullptr;
+  std::shared_ptr<ShellJob> job = submit(req, false, &res);
+  if (!job)
+    return res;
 
-  // TODO: req should be able to pass in command line arguments
-  // ${name} should be replaced with /params/args/name's value
+  return JsonRpc::deferred();
+}
 
+// { "command_name": "diag", "args": { ... } } -> { "job": 3, "state": "queued", "position": 1 }
+cJSON*
+ShellService::startJob(cJSON const* req)
+{
   cJSON* res = nullptr;
-  cJSON const* methodInfo = findCommand(m_commands, commandName);
+  std::shared_ptr<ShellJob> job = submit(req, true, &res);
+  if (!job)
+    return res;
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  return jobToJson(*job, false);
+}
 
-  if (!methodInfo)
+// { "job": 3 } -> the job's state, output so far while it runs, and its
+// result once it's done
+cJSON*
+ShellService::getJobStatus(cJSON const* req)
+{
+  int id = JsonRpc::getInt(req, "/params/job", true);
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  auto itr = m_jobs.find(id);
+  if (itr == m_jobs.end())
+    return JsonRpc::makeError(ENOENT, "no job %d", id);
+
+  return jobToJson(*itr->second, true);
+}
+
+cJSON*
+ShellService::listJobs(cJSON const* UNUSED_PARAM(req))
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+
+  cJSON* jobs = cJSON_CreateArray();
+  for (auto const& job : m_jobs)
+    cJSON_AddItemToArray(jobs, jobToJson(*job.second, false));
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddItemToObject(res, "jobs", jobs);
+  cJSON_AddNumberToObject(res, "queued", m_queue.size());
+  return res;
+}
+
+// a queued job is dropped, a running one is killed. a helper can't be
+// interrupted, so cancelling a running coprocess job fails
+cJSON*
+ShellService::cancelJob(cJSON const* req)
+{
+  int id = JsonRpc::getInt(req, "/params/job", true);
+
+  std::unique_lock<std::mutex> guard(m_mutex);
+  auto itr = m_jobs.find(id);
+  if (itr == m_jobs.end())
+    return JsonRpc::makeError(ENOENT, "no job %d", id);
+
+  std::shared_ptr<ShellJob> job = itr->second;
+  if (job->JobState == ShellJob::State::Done)
+    return JsonRpc::makeError(EALREADY, "job %d already finished", id);
+
+  if (job->JobState == ShellJob::State::Running && job->Command->Workers)
+    return JsonRpc::makeError(EBUSY, "job %d can't be interrupted", id);
+
+  job->Cancelled = true;
+  cJSON* response = nullptr;
+  if (job->JobState == ShellJob::State::Queued)
   {
-    res = JsonRpc::makeError(-1, "can't find configuration for shell command '%s'",
-      commandName);
+    m_queue.erase(std::find(m_queue.begin(), m_queue.end(), job));
+    response = finishJob(*job, JsonRpc::makeError(ECANCELED, "cancelled"));
   }
-  else
+  else if (job->Process)
   {
-    res = invokeShellCommand(methodInfo,
-      JsonRpc::search(req, "/params/args", false));
+    job->Process->kill(SIGKILL);
   }
 
+  cJSON* res = jobToJson(*job, false);
+  guard.unlock();
+
+  // the cmd-exec that was waiting on the job hears it was cancelled
+  if (response)
+    notifyAndDelete(response);
   return res;
 }
+
+// cmd-exec jobs belong to the client that asked for them. queued ones are
+// dropped and running ones finish without sending anything more
+void
+ShellService::onClientChanged()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  for (auto itr = m_queue.begin(); itr != m_queue.end(); )
+  {
+    std::shared_ptr<ShellJob> job = *itr;
+    if (job->Detached)
+    {
+      ++itr;
+      continue;
+    }
+
+    itr = m_queue.erase(itr);
+    job->Dropped = true;
+    job->Cancelled = true;
+    finishJob(*job, nullptr);
+  }
+
+  for (auto const& job : m_jobs)
+  {
+    if (!job.second->Detached)
+      job.second->Dropped = true;
+  }
+}
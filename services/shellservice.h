@@ -19,15 +19,51 @@
 #include "../defs.h"
 #include "../rpcserver.h"
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ShellCommand;
+struct ShellJob;
+
 class ShellService : public BasicRpcService
 {
 public:
   ShellService();
   virtual ~ShellService();
-  virtual void init(cJSON const* conf, RpcNotificationFunction const& callback) override;
+  virtual void init(cJSON const* conf, RpcNotifier const& notifier) override;
+  virtual void onClientChanged() override;
 private:
   cJSON* executeCommand(cJSON const* req);
-  cJSON*  m_commands;
+  cJSON* startJob(cJSON const* req);
+  cJSON* getJobStatus(cJSON const* req);
+  cJSON* listJobs(cJSON const* req);
+  cJSON* cancelJob(cJSON const* req);
+
+private:
+  std::shared_ptr<ShellJob> submit(cJSON const* req, bool detached, cJSON** res);
+  cJSON* runJob(ShellJob& job);
+  bool dropped(ShellJob const& job);
+  cJSON* finishJob(ShellJob& job, cJSON* res);
+  cJSON* jobToJson(ShellJob const& job, bool details) const;
+  void runWorker();
+
+private:
+  std::map< std::string, std::shared_ptr<ShellCommand> > m_commands;
+  std::mutex                                              m_mutex;
+  std::condition_variable                                 m_cond;
+  std::deque< std::shared_ptr<ShellJob> >                 m_queue;
+  std::map< int, std::shared_ptr<ShellJob> >              m_jobs;
+  std::deque<int>                                         m_finished;
+  std::vector<std::thread>                                m_workers;
+  int                                                     m_next_job;
+  bool                                                    m_running;
+  int                                                     m_max_queue;
 };
 
 #endif
@@ -0,0 +1,275 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "subprocess.h"
+#include "../rpclogger.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  // longest wait between checks on a child that closed its output
+  int const kReapInterval = 10;
+
+  int
+  remaining(Clock::time_point deadline)
+  {
+    if (deadline == Clock::time_point::max())
+      return -1;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - Clock::now()).count();
+    return ms > 0 ? static_cast<int>(ms) : 0;
+  }
+}
+
+Subprocess::Subprocess()
+  : m_pid(-1)
+  , m_stdout(-1)
+  , m_stderr(-1)
+{
+}
+
+Subprocess::~Subprocess()
+{
+  closePipes();
+
+  int status = 0;
+  kill(SIGKILL);
+  while (!reap(&status))
+    usleep(kReapInterval * 1000);
+}
+
+int
+Subprocess::start(std::vector<std::string> const& argv)
+{
+  if (argv.empty())
+    return EINVAL;
+
+  int out[2];
+  int err[2];
+  if (pipe2(out, O_CLOEXEC) == -1)
+    return errno;
+  if (pipe2(err, O_CLOEXEC) == -1)
+  {
+    int ret = errno;
+    ::close(out[0]);
+    ::close(out[1]);
+    return ret;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+
+  std::vector<char*> args;
+  for (std::string const& arg : argv)
+    args.push_back(const_cast<char*>(arg.c_str()));
+  args.push_back(nullptr);
+
+  pid_t pid = -1;
+  int ret = posix_spawnp(&pid, args[0], &actions, nullptr, &args[0], environ);
+  posix_spawn_file_actions_destroy(&actions);
+  ::close(out[1]);
+  ::close(err[1]);
+
+  if (ret != 0)
+  {
+    ::close(out[0]);
+    ::close(err[0]);
+    return ret;
+  }
+
+  fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+  fcntl(err[0], F_SETFL, fcntl(err[0], F_GETFL) | O_NONBLOCK);
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_pid = pid;
+  m_stdout = out[0];
+  m_stderr = err[0];
+
+  XLOG_DEBUG("started %s pid:%d", argv[0].c_str(), pid);
+  return 0;
+}
+
+void
+Subprocess::closePipes()
+{
+  if (m_stdout != -1)
+    ::close(m_stdout);
+  if (m_stderr != -1)
+    ::close(m_stderr);
+  m_stdout = -1;
+  m_stderr = -1;
+}
+
+void
+Subprocess::kill(int sig)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_pid != -1)
+    ::kill(m_pid, sig);
+}
+
+// the pid is only given up under the lock, so kill can never hit a
+// process that reused it
+bool
+Subprocess::reap(int* status)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_pid == -1)
+    return true;
+
+  pid_t pid = waitpid(m_pid, status, WNOHANG);
+  if (pid == 0)
+    return false;
+
+  m_pid = -1;
+  return true;
+}
+
+int
+Subprocess::wait(SubprocessOptions const& options, SubprocessOutputHandler const& onOutput,
+  SubprocessResult& result)
+{
+  result.ExitStatus = -1;
+  result.Signal = 0;
+  result.TimedOut = false;
+  result.Truncated = false;
+
+  Clock::time_point deadline = Clock::time_point::max();
+  if (options.Timeout > 0)
+    deadline = Clock::now() + std::chrono::milliseconds(options.Timeout);
+
+  size_t total = 0;
+  bool collecting[2] = { true, true };
+  int fds[2] = { m_stdout, m_stderr };
+
+  while (fds[0] != -1 || fds[1] != -1)
+  {
+    pollfd pfd[2];
+    nfds_t n = 0;
+    for (int fd : fds)
+    {
+      if (fd == -1)
+        continue;
+      pfd[n].fd = fd;
+      pfd[n].events = POLLIN;
+      pfd[n].revents = 0;
+      n++;
+    }
+
+    int ret = poll(pfd, n, remaining(deadline));
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      int err = errno;
+      kill(SIGKILL);
+      closePipes();
+      return err;
+    }
+
+    if (ret == 0)
+    {
+      XLOG_WARN("pid:%d timed out after %dms, killing it", m_pid, options.Timeout);
+      result.TimedOut = true;
+      kill(SIGKILL);
+      break;
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+      if (fds[i] == -1)
+        continue;
+
+      char buff[4096];
+      ssize_t bytesRead = read(fds[i], buff, sizeof(buff));
+      if (bytesRead == -1 && (errno == EAGAIN || errno == EINTR))
+        continue;
+
+      if (bytesRead <= 0)
+      {
+        fds[i] = -1;
+        continue;
+      }
+
+      size_t count = static_cast<size_t>(bytesRead);
+      if (options.MaxOutput > 0 && total + count > options.MaxOutput)
+      {
+        count = options.MaxOutput - total;
+        result.Truncated = true;
+      }
+      total += count;
+
+      SubprocessStream stream = (i == 0) ? SubprocessStream::Stdout : SubprocessStream::Stderr;
+      if (count > 0 && onOutput)
+        collecting[i] = onOutput(stream, buff, count) && collecting[i];
+      if (count > 0 && collecting[i])
+        (i == 0 ? result.Stdout : result.Stderr).append(buff, count);
+
+      if (result.Truncated)
+        break;
+    }
+
+    if (result.Truncated)
+    {
+      XLOG_WARN("pid:%d wrote more than %d bytes, killing it", m_pid,
+        static_cast<int>(options.MaxOutput));
+      kill(SIGKILL);
+      break;
+    }
+  }
+
+  closePipes();
+
+  // the child may have closed its output and still be running. most
+  // exit right after, so the checks start close together
+  int status = 0;
+  int interval = 100;
+  while (!reap(&status))
+  {
+    if (!result.TimedOut && remaining(deadline) == 0)
+    {
+      XLOG_WARN("pid:%d timed out after %dms, killing it", m_pid, options.Timeout);
+      result.TimedOut = true;
+      kill(SIGKILL);
+    }
+    usleep(interval);
+    interval = std::min(interval * 2, kReapInterval * 1000);
+  }
+
+  if (WIFEXITED(status))
+    result.ExitStatus = WEXITSTATUS(status);
+  else if (WIFSIGNALED(status))
+    result.Signal = WTERMSIG(status);
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __SUBPROCESS_H__
+#define __SUBPROCESS_H__
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum class SubprocessStream
+{
+  Stdout,
+  Stderr
+};
+
+struct SubprocessOptions
+{
+  int     Timeout;    // milliseconds, 0 for none
+  size_t  MaxOutput;  // bytes across stdout and stderr, 0 for no limit
+};
+
+struct SubprocessResult
+{
+  int         ExitStatus; // -1 unless the process exited normally
+  int         Signal;     // the signal that ended it, or 0
+  bool        TimedOut;
+  bool        Truncated;
+  std::string Stdout;
+  std::string Stderr;
+};
+
+// called with output as it arrives. returning false stops collecting it
+// into SubprocessResult
+using SubprocessOutputHandler = std::function<bool (SubprocessStream stream,
+  char const* buff, size_t n)>;
+
+// A child started with posix_spawn, stdin on /dev/null and stdout and
+// stderr on separate non-blocking pipes. A process that runs past its
+// timeout or writes more than its output limit is killed.
+class Subprocess
+{
+public:
+  Subprocess();
+  ~Subprocess();
+
+  // argv[0] is looked up in PATH. returns 0 or an errno
+  int start(std::vector<std::string> const& argv);
+
+  // reads output until both pipes close and then reaps the child.
+  // returns 0 or an errno
+  int wait(SubprocessOptions const& options, SubprocessOutputHandler const& onOutput,
+    SubprocessResult& result);
+
+  // safe to call from any thread while another is in wait
+  void kill(int sig);
+
+private:
+  void closePipes();
+  bool reap(int* status);
+
+private:
+  std::mutex  m_mutex;
+  pid_t       m_pid;
+  int         m_stdout;
+  int         m_stderr;
+};
+
+#endif
@@ -14,24 +14,31 @@
 // limitations under the License.
 //
 #include "wifiservice.h"
+#include "wpaclient.h"
+#include "wpaparser.h"
 
 #include "../defs.h"
 #include "../rpclogger.h"
 #include "../jsonrpc.h"
 #include "../util.h"
 
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
-#include <fcntl.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
 #include <queue>
-#include <pthread.h>
 #include <sstream>
 #include <vector>
 
@@ -40,514 +47,1397 @@
 
 JSONRPC_SERVICE_DEFINE(wifi, []{return new WiFiService();});
 
-static struct wpa_ctrl* wpa_request = nullptr;
-static int wpa_shutdown_pipe[2];
-static pthread_t wpa_notify_thread;
+namespace
+{
+  using WpaClock = std::chrono::steady_clock;
+
+  // how a pending event is merged with events that are already waiting
+  // to be sent.
+  //  Latest: newer events replace older ones in the same group
+  //  Unique: identical events are dropped
+  //  All:    every event is sent, but still batched
+  enum class WpaEventCoalesce
+  {
+    Latest,
+    Unique,
+    All
+  };
 
-static cJSON* wpaControl_createResponse(std::string const& s);
-static cJSON* wpaControl_createError(int err);
-static void*  wpaControl_readNotificationSocket(void* argp);
-static void   wpaControl_reportEvent(char const* buff, int n);
-static RpcNotificationFunction responseHandler = nullptr;
+  struct WpaEventPolicy
+  {
+    std::string       Name;
+    std::string       Group;
+    int               Window;
+    WpaEventCoalesce  Mode;
+  };
 
-static cJSON* wpaControl_parseScanResult(std::string const& line);
+  struct WpaPendingEvent
+  {
+    std::string         Group;
+    std::string         Topic;
+    std::string         Text;
+    WpaClock::time_point Deadline;
+  };
 
-static bool ssidCompare(char const* s, char const* t)
-{
-  if (!s || !t) return false;
-  if (*s == '"') s++;
-  if (*t == '"') t++;
-  if (!s || !t) return false;
+  class WpaEventCoalescer
+  {
+  public:
+    void init(cJSON const* conf);
+    void add(std::string const& topic, char const* event);
+    int nextTimeout() const;
+    bool isDue() const;
+    std::vector<WpaPendingEvent> flush();
+
+  private:
+    WpaEventPolicy const* findPolicy(char const* event) const;
+
+  private:
+    std::vector<WpaEventPolicy>   m_policies;
+    std::vector<WpaPendingEvent>  m_pending;
+    WpaEventPolicy                m_default_policy;
+  };
 
-  size_t n = std::min( strlen(s), strlen(t) );
-  return strncmp(s, t, n) == 0;
-}
+  int const kDefaultEventWindow = 250;
 
-static bool
-ok(std::string const& s)
-{
-  return s == "OK";
-}
-
-int
-wpaControl_init(char const* control_socket, RpcNotificationFunction const& callback)
-{
-  if (!control_socket)
+  WpaEventCoalesce
+  toCoalesceMode(char const* s)
   {
-    XLOG_WARN("NULL control socket path");
-    return EINVAL;
+    if (!s || strcmp(s, "latest") == 0)
+      return WpaEventCoalesce::Latest;
+    if (strcmp(s, "unique") == 0)
+      return WpaEventCoalesce::Unique;
+    if (strcmp(s, "all") == 0)
+      return WpaEventCoalesce::All;
+    XLOG_WARN("unknown event coalesce policy '%s', using latest", s);
+    return WpaEventCoalesce::Latest;
   }
 
-  if (!callback)
+  // the event text is prefixed with a log level <n>, e.g.
+  // <3>CTRL-EVENT-SCAN-RESULTS
+  char const*
+  skipEventLevel(char const* event)
   {
-    XLOG_WARN("NULL response callback handler");
-    return EINVAL;
+    char const* p = strchr(event, '>');
+    return p ? p + 1 : event;
   }
 
-  responseHandler = callback;
+  // <3>CTRL-EVENT-SCAN-RESULTS  -> wifi.scan-results
+  // <3>WPS-AP-AVAILABLE         -> wifi.wps-ap-available
+  std::string
+  eventTopic(char const* event)
+  {
+    static char const kEventPrefix[] = "CTRL-EVENT-";
+
+    char const* p = skipEventLevel(event);
+    if (strncmp(p, kEventPrefix, sizeof(kEventPrefix) - 1) == 0)
+      p += sizeof(kEventPrefix) - 1;
 
-  std::string wpa_socket_name = control_socket;
-  struct wpa_ctrl* wpa_notify = nullptr;
+    std::string topic("wifi.");
+    while (*p && !isspace(*p))
+      topic.push_back(static_cast<char>(tolower(*p++)));
+    return topic;
+  }
 
-  int ret = pipe2(wpa_shutdown_pipe, O_CLOEXEC);
-  if (ret == -1)
+  bool
+  isEvent(char const* event, char const* name)
   {
-    int err = errno;
-    XLOG_ERROR("failed to create shutdown pipe. %s", strerror(err));
-    return err;
+    return strncmp(skipEventLevel(event), name, strlen(name)) == 0;
   }
 
-  wpa_request = wpa_ctrl_open(wpa_socket_name.c_str());
-  if (!wpa_request) 
+  using WpaBss = std::map<std::string, std::string>;
+  using WpaBssMap = std::map<std::string, WpaBss>;
+
+  cJSON*
+  bssToJson(WpaBss const& bss)
   {
-    int err = errno;
-    XLOG_ERROR("failed to open:%s. %s", wpa_socket_name.c_str(), strerror(err));
-    return err;
+    cJSON* obj = cJSON_CreateObject();
+    for (auto const& field : bss)
+      cJSON_AddItemToObject(obj, field.first.c_str(), cJSON_CreateString(field.second.c_str()));
+    return obj;
   }
-  else
+
+  // the level of a bss moves a little on every scan, so only a change to
+  // what it is counts
+  bool
+  sameBss(WpaBss const& a, WpaBss const& b)
   {
-    XLOG_INFO("wpa request socket:%s opened for synchronous requests", wpa_socket_name.c_str());
+    for (char const* name : { "bssid", "freq", "flags", "ssid" })
+    {
+      auto x = a.find(name);
+      auto y = b.find(name);
+      if ((x == a.end()) != (y == b.end()) || (x != a.end() && x->second != y->second))
+        return false;
+    }
+    return true;
   }
 
-  wpa_notify = wpa_ctrl_open(wpa_socket_name.c_str());
-  if (!wpa_notify) 
+  // Scan results keyed by BSSID. The notification thread refreshes this
+  // whenever the supplicant reports new scan results so that wifi-scan
+  // can answer from memory. Each refresh is tagged with the number of
+  // CTRL-EVENT-SCAN-RESULTS seen when it started, so a scan can tell
+  // results that came in after it was asked for.
+  class WpaScanCache
+  {
+  public:
+    WpaScanCache()
+      : m_generation(0)
+      , m_scan(0)
+      , m_updated() { }
+
+    // replaces the contents and returns a diff against the previous
+    // results. the diff is only built if the caller asks for it. a
+    // refresh older than the one already cached is dropped
+    void update(WpaBssMap&& results, uint64_t scan, cJSON** diff);
+    cJSON* toJson() const;
+    bool isFresh(int maxAge) const;
+    bool hasScan(uint64_t scan) const;
+
+  private:
+    mutable std::mutex          m_mutex;
+    WpaBssMap                   m_results;
+    uint64_t                    m_generation;
+    uint64_t                    m_scan;
+    WpaClock::time_point        m_updated;
+  };
+
+  void
+  WpaScanCache::update(WpaBssMap&& results, uint64_t scan, cJSON** diff)
   {
-    int err = errno;
-    XLOG_ERROR("failed to open notify socket:%s. %s", wpa_socket_name.c_str(), strerror(err));
-    if (wpa_request)
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_generation > 0 && scan < m_scan)
+      return;
+
+    if (diff)
     {
-      wpa_ctrl_close(wpa_request);
-      wpa_request = nullptr;
+      cJSON* added = cJSON_CreateArray();
+      cJSON* changed = cJSON_CreateArray();
+      cJSON* removed = cJSON_CreateArray();
+
+      for (auto const& kv : results)
+      {
+        auto itr = m_results.find(kv.first);
+        if (itr == m_results.end())
+          cJSON_AddItemToArray(added, bssToJson(kv.second));
+        else if (!sameBss(itr->second, kv.second))
+          cJSON_AddItemToArray(changed, bssToJson(kv.second));
+      }
+
+      for (auto const& kv : m_results)
+      {
+        if (results.find(kv.first) == results.end())
+          cJSON_AddItemToArray(removed, cJSON_CreateString(kv.first.c_str()));
+      }
+
+      if (cJSON_GetArraySize(added) || cJSON_GetArraySize(changed) || cJSON_GetArraySize(removed))
+      {
+        *diff = cJSON_CreateObject();
+        cJSON_AddItemToObject(*diff, "added", added);
+        cJSON_AddItemToObject(*diff, "changed", changed);
+        cJSON_AddItemToObject(*diff, "removed", removed);
+      }
+      else
+      {
+        cJSON_Delete(added);
+        cJSON_Delete(changed);
+        cJSON_Delete(removed);
+      }
     }
-    return err;
+
+    m_results.swap(results);
+    m_updated = WpaClock::now();
+    m_generation++;
+    m_scan = scan;
   }
-  else
+
+  cJSON*
+  WpaScanCache::toJson() const
   {
-    XLOG_INFO("wpa request socket:%s opened for notification", wpa_socket_name.c_str());
+    cJSON* arr = cJSON_CreateArray();
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto const& kv : m_results)
+      cJSON_AddItemToArray(arr, bssToJson(kv.second));
+    return arr;
   }
 
-  ret = wpa_ctrl_attach(wpa_notify);
-  if (ret != 0)
+  bool
+  WpaScanCache::isFresh(int maxAge) const
   {
-    int err = errno;
-    XLOG_WARN("failed to attach to wpa interface for notification. %s", strerror(err));
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_generation == 0 || maxAge < 0)
+      return false;
+    return (WpaClock::now() - m_updated) <= std::chrono::seconds(maxAge);
   }
 
-  pthread_create(&wpa_notify_thread, nullptr, &wpaControl_readNotificationSocket, wpa_notify);
-  return 0;
-}
+  bool
+  WpaScanCache::hasScan(uint64_t scan) const
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_generation > 0 && m_scan >= scan;
+  }
 
-void
-wpaControl_reportEvent(char const* buff, int n)
-{
-  int i;
-  int pass;
+  // LIST_NETWORKS escapes ssids the same way printf would
+  std::string
+  unescapeSsid(char const* s, size_t n)
+  {
+    std::string t;
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (s[i] != '\\' || i + 1 == n)
+      {
+        t.push_back(s[i]);
+        continue;
+      }
 
-  static char const* const kEventWhitelist[] =
+      char c = s[++i];
+      switch (c)
+      {
+        case 'n': t.push_back('\n'); break;
+        case 'r': t.push_back('\r'); break;
+        case 't': t.push_back('\t'); break;
+        case 'e': t.push_back('\033'); break;
+        case 'x':
+          if (i + 2 < n)
+          {
+            char hex[3] = { s[i + 1], s[i + 2], '\0' };
+            t.push_back(static_cast<char>(strtol(hex, nullptr, 16)));
+            i += 2;
+          }
+          break;
+        default: t.push_back(c); break;
+      }
+    }
+    return t;
+  }
+
+  // Configured networks by ssid. It's loaded once from LIST_NETWORKS and
+  // then kept current from our own changes and from the supplicant's
+  // NETWORK-ADDED/REMOVED events, so connect doesn't have to probe each
+  // network id in turn.
+  class WpaNetworkIndex
   {
-    WPA_EVENT_CONNECTED,
-    WPA_EVENT_DISCONNECTED,
-    NULL
+  public:
+    WpaNetworkIndex()
+      : m_valid(false)
+      , m_unnamed(0) { }
+
+    // true when the index has to be reloaded before it can be trusted.
+    // that's before the first load, or when someone else added a network
+    // and we don't know its ssid
+    bool isStale() const;
+    void load(std::string const& list);
+    bool find(std::string const& ssid, int* id) const;
+    void add(int id, std::string const& ssid);
+    void onAdded(int id);
+    void onRemoved(int id);
+    void invalidate();
+
+  private:
+    mutable std::mutex          m_mutex;
+    std::map<std::string, int>  m_ids;
+    std::map<int, std::string>  m_ssids;
+    bool                        m_valid;
+    int                         m_unnamed;
   };
 
-  i = 0;
-  pass = 0;
+  bool
+  WpaNetworkIndex::isStale() const
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return !m_valid || m_unnamed > 0;
+  }
 
-  if (!buff || !n)
+  void
+  WpaNetworkIndex::load(std::string const& list)
   {
-    XLOG_INFO("null buffer or zero length string");
-    return;
+    // network id / ssid / bssid / flags
+    // 0\thome\tany\t[CURRENT]
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_ids.clear();
+    m_ssids.clear();
+    m_unnamed = 0;
+
+    size_t begin = list.find('\n');
+    while (begin != std::string::npos && begin < list.size())
+    {
+      begin++;
+      size_t end = list.find('\n', begin);
+      if (end == std::string::npos)
+        end = list.size();
+
+      size_t tab1 = list.find('\t', begin);
+      if (tab1 != std::string::npos && tab1 < end)
+      {
+        size_t tab2 = list.find('\t', tab1 + 1);
+        if (tab2 == std::string::npos || tab2 > end)
+          tab2 = end;
+
+        int id = static_cast<int>(strtol(list.c_str() + begin, nullptr, 10));
+        std::string ssid = unescapeSsid(list.c_str() + tab1 + 1, tab2 - tab1 - 1);
+        m_ids[ssid] = id;
+        m_ssids[id] = ssid;
+      }
+
+      begin = end;
+    }
+
+    m_valid = true;
+    XLOG_INFO("loaded %d configured networks", static_cast<int>(m_ids.size()));
   }
 
-  XLOG_DEBUG("event:%s", buff);
+  bool
+  WpaNetworkIndex::find(std::string const& ssid, int* id) const
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto itr = m_ids.find(ssid);
+    if (itr == m_ids.end())
+      return false;
+    *id = itr->second;
+    return true;
+  }
 
-  while (!pass && (kEventWhitelist[i] != NULL))
+  void
+  WpaNetworkIndex::add(int id, std::string const& ssid)
   {
-    // scan past the level <n>
-    // each event is prefixed with a log level type number
-    // <3>CTRL-EVENT-SCAN-RESULTS
-    char const* p  = strchr(buff, '>');
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto itr = m_ssids.find(id);
+    if (itr != m_ssids.end())
+    {
+      if (itr->second.empty())
+        m_unnamed--;
+      else
+        m_ids.erase(itr->second);
+    }
+    m_ids[ssid] = id;
+    m_ssids[id] = ssid;
+  }
 
-    if (p)
-      p++;
+  void
+  WpaNetworkIndex::onAdded(int id)
+  {
+    // our own ADD_NETWORK shows up here too, usually before the reply.
+    // the ssid gets filled in by add() once we've set it
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_ssids.find(id) == m_ssids.end())
+    {
+      m_ssids[id] = std::string();
+      m_unnamed++;
+    }
+  }
+
+  void
+  WpaNetworkIndex::onRemoved(int id)
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto itr = m_ssids.find(id);
+    if (itr == m_ssids.end())
+      return;
+
+    if (itr->second.empty())
+      m_unnamed--;
     else
-      p = buff;
+      m_ids.erase(itr->second);
+    m_ssids.erase(itr);
+  }
 
-    // XLOG_INFO("%s == %s (%d)", p, kEventWhitelist[i], strlen(kEventWhitelist[i]));
+  void
+  WpaNetworkIndex::invalidate()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_valid = false;
+  }
+
+  // The last STATUS we got from the supplicant, parsed and as it came. It's
+  // refreshed from the event loop whenever an event says the link changed,
+  // so get-status can answer from memory. The version goes up each time
+  // the contents change.
+  class WpaStatusModel
+  {
+  public:
+    WpaStatusModel()
+      : m_version(0)
+      , m_valid(false)
+      , m_refreshing(false)
+      , m_dirty(false) { }
+
+    bool isValid() const;
+    uint64_t get(WpaStatus& status, std::string* raw = nullptr) const;
+    bool update(std::string const& raw);
+    void invalidate();
+
+    // only one STATUS refresh is in flight at a time. beginRefresh returns
+    // false if one already is, and endRefresh returns true if another was
+    // asked for in the meantime
+    bool beginRefresh();
+    bool endRefresh();
+
+  private:
+    mutable std::mutex                m_mutex;
+    WpaStatus                         m_status;
+    std::string                       m_raw;
+    uint64_t                          m_version;
+    bool                              m_valid;
+    bool                              m_refreshing;
+    bool                              m_dirty;
+  };
 
-    if (strncmp(kEventWhitelist[i], p, strlen(kEventWhitelist[i])) == 0)
-      pass = 1;
-    i++;
+  bool
+  WpaStatusModel::isValid() const
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_valid;
   }
 
-  if (!pass)
+  uint64_t
+  WpaStatusModel::get(WpaStatus& status, std::string* raw) const
   {
-    XLOG_DEBUG("ignoring event");
-    return;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    status = m_status;
+    if (raw)
+      *raw = m_raw;
+    return m_version;
+  }
+
+  bool
+  WpaStatusModel::update(std::string const& raw)
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    bool changed = !m_valid || m_raw != raw;
+    m_valid = true;
+    if (!changed)
+      return false;
+
+    m_raw = raw;
+    m_status = WpaStatus();
+    wpaParseStatus(m_raw.c_str(), m_raw.size(), m_status);
+    m_version++;
+    return true;
+  }
+
+  void
+  WpaStatusModel::invalidate()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_valid = false;
+  }
+
+  bool
+  WpaStatusModel::beginRefresh()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_refreshing)
+    {
+      m_dirty = true;
+      return false;
+    }
+    m_refreshing = true;
+    m_dirty = false;
+    return true;
+  }
+
+  bool
+  WpaStatusModel::endRefresh()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_refreshing = false;
+    return m_dirty;
   }
 
-  XLOG_INFO("sending event");
+  int const kDefaultStatusTimeout = 30;
+  int const kMaxStatusTimeout = 300;
+  size_t const kMaxStatusWaiters = 8;
 
-  cJSON* e = cJSON_CreateObject();
-  cJSON_AddItemToObject(e, "jsonrpc", cJSON_CreateString(kJsonRpcVersion));
-  cJSON_AddItemToObject(e, "method", cJSON_CreateString("wpa_event"));
-  cJSON_AddItemToObject(e, "params", cJSON_CreateString(buff));
-  responseHandler(e);
-  cJSON_Delete(e);
+  // a get-status that waits for the version to change. it's answered
+  // from the event loop
+  struct WpaStatusWaiter
+  {
+    int                   RequestId;
+    uint64_t              Version;
+    WpaClock::time_point  Deadline;
+  };
+  int const kAddressPollInterval = 1000;
+
+  // fields we keep from BSS. ie, beacon_int, tsf, and friends are a lot
+  // of bytes nobody reads. age is left out since it's different on every
+  // scan
+  //   ID | BSSID | FREQ | LEVEL | FLAGS | SSID | DELIM
+  char const kBssMask[] = "0x21887";
+  int const kDefaultScanTimeout = 10;
+  int const kMaxScanTimeout = 60;
+  size_t const kMaxScanWaiters = 8;
 }
 
-void*
-wpaControl_readNotificationSocket(void* argp)
+// A wifi-scan waiting for its radios to report results. It's answered
+// from the event loop
+struct WpaScanWaiter
 {
-  struct wpa_ctrl* wpa_notify = reinterpret_cast<struct wpa_ctrl *>(argp);
-
-  int wpa_fd = wpa_ctrl_get_fd(wpa_notify);
-  int shutdown_fd = wpa_shutdown_pipe[0];
+  int                                         RequestId;
+  std::vector< std::shared_ptr<WpaSession> >  Sessions;
+
+  // the results each radio waits for, 0 for one that answers from its cache
+  std::vector<uint64_t>                       Scans;
+  WpaClock::time_point                        Deadline;
+};
+
+// One wpa_supplicant control interface. Everything that used to be kept
+// per process is kept per interface, so a service can manage several
+// radios. All sessions of a service share its event loop.
+class WpaSession
+{
+public:
+  WpaSession(std::string const& name, WpaEventLoop* loop, RpcNotifier const& notifier);
+  ~WpaSession();
+
+  int open(char const* control_socket, cJSON const* events);
+  void close();
+
+  std::string const& name() const
+    { return m_name; }
+
+  cJSON* getStatus(cJSON const* req);
+  cJSON* connect(cJSON const* req);
+  std::string getState();
+
+  // forgets get-status requests that are still waiting, without
+  // answering them
+  void dropStatusWaiters();
+
+  // a scan is started with beginScan, which returns false when the
+  // cached results will do. scan identifies the results that will, and
+  // hasScan says whether they're in yet
+  bool beginScan(int maxAge, uint64_t* scan);
+  bool hasScan(uint64_t scan) const;
+  cJSON* scanResults() const;
+
+private:
+  int runCommand(char const* cmd, std::string& res);
+  void reportEvent(char const* buff, size_t n);
+  void flushEvents();
+  int pollAddress();
+  void refreshScanResults();
+  void fetchScanResults(int first, uint64_t scan, std::shared_ptr<WpaBssMap> const& results);
+  void updateScanCache(WpaBssMap& results, uint64_t scan);
+  void refreshStatus();
+  int loadStatus();
+  void updateStatus(std::string const& raw);
+  int answerStatusWaiters();
+  cJSON* statusToJson(std::string& raw, uint64_t version) const;
+  int loadNetworks();
+  int createNetwork(int* networkId);
+  int configureWpa2Network(int networkId, char const* ssid, char const* wpa_pass);
+
+private:
+  std::string                  m_name;
+  WpaEventLoop*                m_loop;
+  RpcNotifier                  m_notifier;
+  WpaControlClient             m_client;
+  WpaEventCoalescer            m_events;
+  WpaScanCache                 m_scan_cache;
+  std::atomic<uint64_t>        m_scan_results;
+  WpaNetworkIndex              m_networks;
+  WpaStatusModel               m_status;
+  std::mutex                   m_waiters_mutex;
+  std::vector<WpaStatusWaiter> m_status_waiters;
+  std::vector<int>             m_timers;
+  WpaClock::time_point         m_next_address_poll;
+};
+
+static cJSON* wpaControl_createResponse(std::string& s);
+static cJSON* wpaControl_createError(int err);
 
-  int maxfd = wpa_fd;
-  if (shutdown_fd > maxfd)
-    maxfd = shutdown_fd;
+static bool
+ok(std::string const& s)
+{
+  return s == "OK";
+}
 
-  XLOG_INFO("notification thread running");
+// /var/run/wpa_supplicant/wlan0 -> wlan0
+static std::string
+interfaceName(char const* control_socket)
+{
+  char const* p = strrchr(control_socket, '/');
+  return std::string(p ? p + 1 : control_socket);
+}
 
-  bool running = true;
-  while (running)
+void
+WpaEventCoalescer::init(cJSON const* conf)
+{
+  // "events": {
+  //   "window": 250,
+  //   "policies": [
+  //     { "name": "CTRL-EVENT-CONNECTED", "group": "link", "policy": "latest" }
+  //   ]
+  // }
+  m_policies.clear();
+  m_pending.clear();
+
+  int window = kDefaultEventWindow;
+  cJSON const* policies = nullptr;
+  if (conf)
   {
-    fd_set readfds;
-    fd_set errfds;
+    window = JsonRpc::getInt(conf, "window", false, kDefaultEventWindow);
+    policies = cJSON_GetObjectItem(conf, "policies");
+  }
 
-    FD_ZERO(&readfds);
-    FD_ZERO(&errfds);
-    FD_SET(wpa_fd, &readfds);
-    FD_SET(shutdown_fd, &readfds);
-    FD_SET(wpa_fd, &errfds);
+  // events without a policy of their own are batched but never merged
+  m_default_policy = { std::string(), std::string(), window, WpaEventCoalesce::All };
 
-    int ret = select(maxfd + 1, &readfds, nullptr, &errfds, nullptr);
-    if (ret > 0)
-    {
-      if (FD_ISSET(shutdown_fd, &readfds))
-      {
-        running = false;
-      }
-      else if (FD_ISSET(wpa_fd, &readfds))
-      {
-        char buff[1024] = {0};
-        size_t n = sizeof(buff);
+  if (!policies)
+  {
+    m_policies.push_back({ WPA_EVENT_CONNECTED, "link", window, WpaEventCoalesce::Latest });
+    m_policies.push_back({ WPA_EVENT_DISCONNECTED, "link", window, WpaEventCoalesce::Latest });
+    return;
+  }
 
-        ret = wpa_ctrl_recv(wpa_notify, buff, &n);
-        if (ret < 0) 
-        {
-          XLOG_ERROR("error reading from WPA socket:%s", strerror(errno));
-        }
-        else
-        {
-          if (n < sizeof(buff))
-            buff[n] = '\0';
-          else
-            buff[sizeof(buff) - 1] = '\0';
+  for (int i = 0, n = cJSON_GetArraySize(policies); i < n; ++i)
+  {
+    cJSON const* item = cJSON_GetArrayItem(policies, i);
 
-          wpaControl_reportEvent(buff, n);
-        }
-      }
-    }
+    WpaEventPolicy policy;
+    policy.Name = JsonRpc::getString(item, "name", true);
+    policy.Group = JsonRpc::getString(item, "group", false, policy.Name.c_str());
+    policy.Window = JsonRpc::getInt(item, "window", false, window);
+    policy.Mode = toCoalesceMode(JsonRpc::getString(item, "policy", false));
+    m_policies.push_back(policy);
+
+    XLOG_DEBUG("event policy name:%s group:%s window:%d", policy.Name.c_str(),
+      policy.Group.c_str(), policy.Window);
   }
+}
 
-  wpa_ctrl_close(wpa_notify);
+WpaEventPolicy const*
+WpaEventCoalescer::findPolicy(char const* event) const
+{
+  char const* p = skipEventLevel(event);
+  for (WpaEventPolicy const& policy : m_policies)
+  {
+    if (strncmp(policy.Name.c_str(), p, policy.Name.size()) == 0)
+      return &policy;
+  }
   return nullptr;
 }
 
-int
-wpaControl_runCommand(char const* cmd, std::string& res, int max = 4096)
+void
+WpaEventCoalescer::add(std::string const& topic, char const* event)
 {
-  res.reserve(max);
-  res.resize(max);
+  WpaEventPolicy const* policy = findPolicy(event);
+  if (!policy)
+    policy = &m_default_policy;
 
-  size_t n = res.capacity();
+  WpaPendingEvent e;
+  e.Group = policy->Group.empty() ? topic : policy->Group;
+  e.Topic = topic;
+  e.Text = event;
+  e.Deadline = WpaClock::now() + std::chrono::milliseconds(policy->Window);
 
-  XLOG_INFO("wpa command:%s", cmd);
-  if (!wpa_request)
+  if (policy->Mode == WpaEventCoalesce::Latest)
   {
-    XLOG_ERROR("request handle is null");
-    return -EINVAL;
+    // the replacement keeps the deadline of the event it supersedes so
+    // a flapping link can't hold back the batch forever
+    auto itr = std::find_if(m_pending.begin(), m_pending.end(),
+      [&e](WpaPendingEvent const& t) { return t.Group == e.Group; });
+    if (itr != m_pending.end())
+    {
+      XLOG_DEBUG("superseding event:%s", itr->Text.c_str());
+      e.Deadline = std::min(e.Deadline, itr->Deadline);
+      m_pending.erase(itr);
+    }
   }
-
-  int ret = wpa_ctrl_request(wpa_request, cmd, strlen(cmd), &res[0], &n, nullptr);
-  if (ret < 0)
+  else if (policy->Mode == WpaEventCoalesce::Unique)
   {
-    int err = errno;
-    XLOG_WARN("failed to submit wpa control request:%s", strerror(err));
-    return err;
+    auto itr = std::find_if(m_pending.begin(), m_pending.end(),
+      [&e](WpaPendingEvent const& t) { return t.Text == e.Text; });
+    if (itr != m_pending.end())
+    {
+      XLOG_DEBUG("dropping duplicate event:%s", e.Text.c_str());
+      return;
+    }
   }
 
-  res.resize(n);
-  return 0;
+  m_pending.push_back(e);
 }
 
 int
-wpaControl_shutdown()
+WpaEventCoalescer::nextTimeout() const
 {
-  std::string s = "shutdown-now";
-  write(wpa_shutdown_pipe[1], s.c_str(), s.length());
+  if (m_pending.empty())
+    return -1;
 
-  void* retval = nullptr;
-  pthread_join(wpa_notify_thread, &retval);
-  return 0;
+  WpaClock::time_point deadline = m_pending[0].Deadline;
+  for (WpaPendingEvent const& e : m_pending)
+    deadline = std::min(deadline, e.Deadline);
+
+  auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+    deadline - WpaClock::now()).count();
+  return millis > 0 ? static_cast<int>(millis) : 0;
 }
 
-static int
-wpaControl_createNetwork(int* networkId)
+bool
+WpaEventCoalescer::isDue() const
 {
-  std::string res;
+  return nextTimeout() == 0;
+}
 
-  if (!networkId)
+std::vector<WpaPendingEvent>
+WpaEventCoalescer::flush()
+{
+  std::vector<WpaPendingEvent> events;
+  events.swap(m_pending);
+  return events;
+}
+
+WpaSession::WpaSession(std::string const& name, WpaEventLoop* loop, RpcNotifier const& notifier)
+  : m_name(name)
+  , m_loop(loop)
+  , m_notifier(notifier)
+  , m_scan_results(0)
+{
+}
+
+WpaSession::~WpaSession()
+{
+  close();
+}
+
+int
+WpaSession::open(char const* control_socket, cJSON const* events)
+{
+  if (!control_socket)
+  {
+    XLOG_WARN("NULL control socket path");
     return EINVAL;
+  }
 
-  int ret = wpaControl_runCommand("ADD_NETWORK", res);
-  if (ret != 0)
+  if (!m_notifier.Publish || !m_notifier.IsSubscribed)
   {
-    int err = errno;
-    XLOG_ERROR("ADD_NETWORK failed:%s", strerror(err));
-    return err;
+    XLOG_WARN("NULL notifier");
+    return EINVAL;
   }
 
-  *networkId = static_cast<int>(strtol(res.c_str(), NULL, 10));
+  m_events.init(events);
+
+  // pending events are flushed from the event loop when they come due
+  m_timers.push_back(m_loop->addTimer([this]
+  {
+    if (this->m_events.isDue())
+      this->flushEvents();
+    return this->m_events.nextTimeout();
+  }));
+
+  m_timers.push_back(m_loop->addTimer([this] { return this->pollAddress(); }));
+  m_timers.push_back(m_loop->addTimer([this] { return this->answerStatusWaiters(); }));
+
+  int ret = m_client.open(m_loop, control_socket, [this](char const* buff, size_t n)
+  {
+    this->reportEvent(buff, n);
+  });
+  if (ret)
+    return ret;
 
+  XLOG_INFO("opened supplicant session for %s", m_name.c_str());
+
+  // pick up whatever the supplicant already knows about
+  refreshScanResults();
+  refreshStatus();
   return 0;
 }
 
-static int
-wpaControl_configureWpa2Network(int networkId, char const* ssid, char const* wpa_pass)
+void
+WpaSession::close()
 {
-  std::string buff;
+  for (int id : m_timers)
+    m_loop->removeTimer(id);
+  m_timers.clear();
 
-  int ret;
-  char command_buff[512];
+  flushEvents();
+  dropStatusWaiters();
+  m_client.close();
+}
 
-  sprintf(command_buff, "SET_NETWORK %d ssid \"%s\"", networkId, ssid);
-  ret = wpaControl_runCommand(command_buff, buff);
-  if (ret < 0)
+void
+WpaSession::reportEvent(char const* buff, size_t n)
+{
+  if (!buff || !n)
   {
-    int err = errno;
-    XLOG_ERROR("wpaControl_connect_WPA2 set ssid failed");
-    return err;
+    XLOG_INFO("null buffer or zero length string");
+    return;
   }
 
-  sprintf(command_buff, "SET_NETWORK %d psk \"%s\"", networkId, wpa_pass);
-  ret = wpaControl_runCommand(command_buff, buff);
-  if (ret < 0)
+  XLOG_DEBUG("%s event:%s", m_name.c_str(), buff);
+
+  // the caches are kept current whether or not anyone wants the event
+  if (isEvent(buff, "CTRL-EVENT-SCAN-RESULTS"))
   {
-    int err = errno;
-    XLOG_ERROR("wpaControl_connect_WPA2 set psk failed");
-    return err;
+    m_scan_results++;
+    refreshScanResults();
   }
-
-  XLOG_DEBUG("SET_NETWORK successful %d", networkId);
-
-  sprintf(command_buff, "SELECT_NETWORK %d", networkId);
-  ret = wpaControl_runCommand(command_buff, buff);
-  if (ret < 0)
+  else if (isEvent(buff, "CTRL-EVENT-NETWORK-ADDED "))
+    m_networks.onAdded(atoi(skipEventLevel(buff) + strlen("CTRL-EVENT-NETWORK-ADDED ")));
+  else if (isEvent(buff, "CTRL-EVENT-NETWORK-REMOVED "))
+    m_networks.onRemoved(atoi(skipEventLevel(buff) + strlen("CTRL-EVENT-NETWORK-REMOVED ")));
+  else if (isEvent(buff, "CTRL-EVENT-TERMINATING"))
   {
-    int err = errno;
-    XLOG_ERROR("wpaControl_connect_WPA2 select network failed failed");
-    return err;
+    m_networks.invalidate();
+    m_status.invalidate();
   }
-  else
+  else if (isEvent(buff, WPA_EVENT_CONNECTED)
+    || isEvent(buff, WPA_EVENT_DISCONNECTED)
+    || isEvent(buff, "CTRL-EVENT-STATE-CHANGE")
+    || isEvent(buff, "CTRL-EVENT-SSID-TEMP-DISABLED"))
   {
-    XLOG_DEBUG("SELECT_NETWORK successful %d", networkId);
+    refreshStatus();
   }
 
-  ret = wpaControl_runCommand("SAVE_CONFIG", buff);
-  if (ret < 0)
+  std::string topic = eventTopic(buff);
+  if (!m_notifier.IsSubscribed(topic))
   {
-    int err = errno;
-    XLOG_WARN("Failed to save wpa_supplicant configuraton");
-    return err;
+    XLOG_DEBUG("ignoring event, no subscribers for %s", topic.c_str());
+    return;
   }
 
-  return 0;
+  m_events.add(topic, buff);
 }
 
-
-std::string
-wpaControl_getState()
+void
+WpaSession::flushEvents()
 {
-  std::string res;
-  wpaControl_runCommand("STATUS", res);
+  std::vector<WpaPendingEvent> events = m_events.flush();
+  if (events.empty())
+    return;
 
-  std::string::size_type begin = 0;
-  std::string::size_type end = 0;
+  XLOG_INFO("sending %d event(s) from %s", static_cast<int>(events.size()), m_name.c_str());
 
-  while (true)
+  // each run of events with the same topic is published on that topic, in
+  // the order they came, so the subscriptions are checked again when the
+  // batch goes out. a run of one is published as it is, a longer run as
+  // one message with the events in a list
+  for (size_t begin = 0, end = 0; begin < events.size(); begin = end)
   {
-    if (res.compare(begin, 10, "wpa_state=") == 0)
+    std::string const& topic = events[begin].Topic;
+    while (end < events.size() && events[end].Topic == topic)
+      end++;
+
+    cJSON* params = cJSON_CreateObject();
+    cJSON_AddStringToObject(params, "interface", m_name.c_str());
+    if (end - begin == 1)
+    {
+      cJSON_AddStringToObject(params, "event", events[begin].Text.c_str());
+    }
+    else
     {
-      begin += 10;
-      return res.substr(begin, (res.find('\n', begin) - begin));
+      cJSON* list = cJSON_CreateArray();
+      for (size_t i = begin; i < end; ++i)
+        cJSON_AddItemToArray(list, cJSON_CreateString(events[i].Text.c_str()));
+      cJSON_AddItemToObject(params, "events", list);
     }
+    m_notifier.Publish(topic, params);
+    cJSON_Delete(params);
+  }
+}
 
-    end = res.find('\n', begin + 1);
-    if (end == std::string::npos)
-      break;
+// the supplicant doesn't send an event when dhcp finishes, so once
+// associated keep asking for STATUS until the address shows up
+int
+WpaSession::pollAddress()
+{
+  WpaStatus status;
+  m_status.get(status);
+  if (status.State != "COMPLETED" || !status.IpAddress.empty())
+    return -1;
 
-    begin = end + 1;
+  WpaClock::time_point now = WpaClock::now();
+  if (now >= m_next_address_poll)
+  {
+    refreshStatus();
+    m_next_address_poll = now + std::chrono::milliseconds(kAddressPollInterval);
   }
 
-  return std::string();
+  return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+    m_next_address_poll - now).count());
+}
+
+int
+WpaSession::runCommand(char const* cmd, std::string& res)
+{
+  return m_client.request(cmd, res);
 }
 
-#if 0
-void*
-watch_wlan_state(void* UNUSED_PARAM(argp))
+static int
+wpaControl_parseBssRange(std::string const& buff, WpaBssMap& results, int* next)
 {
-  bool running = true;
-  int pre_req_id = connect_req_id;
-  XLOG_DEBUG("watch_wlan_state create new thread to check state, req_id= %d", pre_req_id);
-  usleep(1000 * 1200); // wait some time then start check
-  // the state should be from "4WAY_HANDSHAKE" to something else
-  while (true)
+  int count = 0;
+
+  WpaBss bss;
+  wpaForEachField(buff.c_str(), buff.size(), [&](WpaField const& f) -> bool
   {
-    if (!running || pre_req_id != connect_req_id) // ignore pre connect request thread
+    if (f.Line.equals("===="))
     {
-      XLOG_DEBUG("watch_wlan_state thread exit req_id = %d", pre_req_id);
-      return nullptr;
-    }
+      auto id = bss.find("id");
+      if (id != bss.end())
+        *next = static_cast<int>(strtol(id->second.c_str(), nullptr, 10)) + 1;
 
-    std::string state = get_wlan_state();
+      auto bssid = bss.find("bssid");
+      if (bssid != bss.end())
+        results[bssid->second] = std::move(bss);
 
-    if (!state.compare("SCANNING")
-        || !state.compare("DISCONNECTED")
-        || !state.compare("INACTIVE")
-        || !state.compare("INTERFACE_DISABLED")
-        ) // connect failed
-    {
-      cJSON* rsp = wpaControl_createAsyncConnectResponse("connect failed, maybe password wrong or something else",
-                                                         state);
-      responseHandler(rsp);
-      running = false;
-    } else if (!state.compare("COMPLETED"))
+      bss.clear();
+      count++;
+    }
+    else if (f.HasValue)
     {
+      bss[f.Name.toString()] = f.Value.toString();
+    }
+    return true;
+  });
 
-      cJSON* rsp = wpaControl_createAsyncConnectResponse("connect successful", state);
-      std::string statusBuffer;
-      wpaControl_runCommand("STATUS", statusBuffer);
-      cJSON_AddItemToObject(rsp, "wlanStatus", wpaControl_createResponse(statusBuffer));
+  return count;
+}
 
-      responseHandler(rsp);
-      running = false;
-    }
-    usleep(1000 * 100);  // 200 ms check
+void
+WpaSession::updateScanCache(WpaBssMap& results, uint64_t scan)
+{
+  XLOG_INFO("%s scan cache refreshed with %d bss", m_name.c_str(),
+    static_cast<int>(results.size()));
+
+  cJSON* diff = nullptr;
+  bool wantDiff = m_notifier.IsSubscribed("wifi.scan-update");
+  m_scan_cache.update(std::move(results), scan, wantDiff ? &diff : nullptr);
+
+  if (diff)
+  {
+    cJSON_AddStringToObject(diff, "interface", m_name.c_str());
+    m_notifier.Publish("wifi.scan-update", diff);
+    cJSON_Delete(diff);
   }
 }
-#endif
 
+void
+WpaSession::fetchScanResults(int first, uint64_t scan, std::shared_ptr<WpaBssMap> const& results)
+{
+  // BSS RANGE returns as many entries as fit in one reply, each followed
+  // by ====. keep asking from the id after the last one we got until the
+  // supplicant has nothing more to give. each step runs from the
+  // completion of the previous one so the event loop never blocks
+  char cmd[64];
+  snprintf(cmd, sizeof(cmd), "BSS RANGE=%d- MASK=%s", first, kBssMask);
+
+  m_client.submit(cmd, [this, first, scan, results](int err, std::string const& reply)
+  {
+    if (err)
+    {
+      XLOG_WARN("failed to fetch scan results:%s", strerror(err));
+      return;
+    }
 
-cJSON*
-wpaControl_connectToNetwork(cJSON const* req)
+    int next = first;
+    int count = wpaControl_parseBssRange(reply, *results, &next);
+    if (count > 0 && next > first)
+      this->fetchScanResults(next, scan, results);
+    else
+      this->updateScanCache(*results, scan);
+  });
+}
+
+void
+WpaSession::refreshScanResults()
 {
-  char* s = cJSON_Print(req);
-  if (s)
+  fetchScanResults(0, m_scan_results, std::make_shared<WpaBssMap>());
+}
+
+bool
+WpaSession::beginScan(int maxAge, uint64_t* scan)
+{
+  if (m_scan_cache.isFresh(maxAge))
+    return false;
+
+  // results refreshed for a CTRL-EVENT-SCAN-RESULTS that was already in
+  // by now may be from before this scan, even if they land afterwards
+  *scan = m_scan_results + 1;
+
+  m_client.submit("SCAN", [this](int err, std::string const& reply)
   {
-    XLOG_INFO("connect:%s", s);
-    free(s);
-  }
+    // FAIL-BUSY means a scan is already running, its results are
+    // just as good
+    if (err)
+      XLOG_WARN("error starting scan on %s:%s", this->m_name.c_str(), strerror(err));
+    else if (!ok(chomp(reply.c_str())))
+      XLOG_WARN("error starting scan on %s:%s", this->m_name.c_str(), reply.c_str());
+  });
+
+  return true;
+}
 
-  char const* pass = JsonRpc::getString(req, "/params/cred/pass", true);
-  char const* ssid = JsonRpc::getString(req, "/params/discovery/ssid", true);
+bool
+WpaSession::hasScan(uint64_t scan) const
+{
+  return m_scan_cache.hasScan(scan);
+}
 
-  int ret = 0;
-  int networkId = 0;
+cJSON*
+WpaSession::scanResults() const
+{
+  cJSON* results = m_scan_cache.toJson();
+  for (int i = 0, n = cJSON_GetArraySize(results); i < n; ++i)
+    cJSON_AddStringToObject(cJSON_GetArrayItem(results, i), "interface", m_name.c_str());
+  return results;
+}
 
-  // first list the configured networks.
-  // if one matches ssid, then simply update the password
-  int index = 0;
-  std::string buff;
+cJSON*
+WpaSession::statusToJson(std::string& raw, uint64_t version) const
+{
+  cJSON* res = wpaControl_createResponse(raw);
+  if (!res)
+    res = cJSON_CreateObject();
+  cJSON_AddStringToObject(res, "interface", m_name.c_str());
+  cJSON_AddNumberToObject(res, "version", version);
+  return res;
+}
+
+void
+WpaSession::updateStatus(std::string const& raw)
+{
+  if (!m_status.update(raw))
+    return;
 
-  do
+  WpaStatus status;
+  std::string current;
+  uint64_t version = m_status.get(status, &current);
+  XLOG_DEBUG("%s wpa_state:%s version:%d", m_name.c_str(), status.State.c_str(),
+    static_cast<int>(version));
+
+  if (m_notifier.IsSubscribed("wifi.status"))
   {
-    char cmd[64];
-    snprintf(cmd, sizeof(cmd), "GET_NETWORK %d ssid", index);
+    cJSON* params = statusToJson(current, version);
+    m_notifier.Publish("wifi.status", params);
+    cJSON_Delete(params);
+  }
 
-    ret = wpaControl_runCommand(cmd, buff);
-    if (ret == 0)
+  answerStatusWaiters();
+}
+
+// answers every waiter whose version is out of date or whose time is up,
+// and returns when the next one times out
+int
+WpaSession::answerStatusWaiters()
+{
+  std::vector<WpaStatusWaiter> due;
+  WpaStatus status;
+  std::string raw;
+  uint64_t version = 0;
+  int timeout = -1;
+  {
+    std::lock_guard<std::mutex> guard(m_waiters_mutex);
+    if (m_status_waiters.empty())
+      return -1;
+
+    version = m_status.get(status, &raw);
+    WpaClock::time_point now = WpaClock::now();
+    for (auto itr = m_status_waiters.begin(); itr != m_status_waiters.end();)
     {
-      buff = chomp(buff.c_str());
-      if (ssidCompare(buff.c_str(), ssid))
+      if (itr->Version != version || itr->Deadline <= now)
       {
-        XLOG_INFO("network '%s' already exists %d", ssid, index);
-        networkId = index;
+        due.push_back(*itr);
+        itr = m_status_waiters.erase(itr);
+        continue;
       }
+
+      int millis = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        itr->Deadline - now).count()) + 1;
+      if (timeout == -1 || millis < timeout)
+        timeout = millis;
+      ++itr;
+    }
+  }
+
+  for (WpaStatusWaiter const& waiter : due)
+  {
+    std::string copy = raw;
+    cJSON* res = JsonRpc::wrapResponse(0, statusToJson(copy, version), waiter.RequestId);
+    m_notifier.Notify(res);
+    cJSON_Delete(res);
+  }
+  return timeout;
+}
+
+void
+WpaSession::dropStatusWaiters()
+{
+  std::lock_guard<std::mutex> guard(m_waiters_mutex);
+  m_status_waiters.clear();
+}
+
+void
+WpaSession::refreshStatus()
+{
+  if (!m_status.beginRefresh())
+    return;
+
+  m_client.submit("STATUS", [this](int err, std::string const& reply)
+  {
+    if (err)
+    {
+      XLOG_WARN("failed to refresh status:%s", strerror(err));
     }
     else
     {
-      // GET_NETWORK <n> SSID where n is out of bounds
-      // returns FAIL also
-      buff = "FAIL";
+      this->updateStatus(reply);
     }
-    index++;
+
+    if (this->m_status.endRefresh())
+      this->refreshStatus();
+  });
+}
+
+// blocking STATUS round trip, for when the cached copy can't be used
+int
+WpaSession::loadStatus()
+{
+  std::string buff;
+  int ret = runCommand("STATUS", buff);
+  if (ret)
+    return ret;
+
+  updateStatus(buff);
+  return 0;
+}
+
+int
+WpaSession::createNetwork(int* networkId)
+{
+  std::string res;
+
+  if (!networkId)
+    return EINVAL;
+
+  int ret = runCommand("ADD_NETWORK", res);
+  if (ret != 0)
+  {
+    XLOG_ERROR("ADD_NETWORK failed:%s", strerror(ret));
+    return ret;
   }
-  while ((networkId == 0) && (buff != "FAIL"));
 
-  if (networkId == 0)
+  *networkId = static_cast<int>(strtol(res.c_str(), NULL, 10));
+
+  return 0;
+}
+
+// waits for every reply, and returns the first error. steps names each
+// command for the log
+static int
+wpaControl_collectReplies(std::vector< std::future<WpaReply> >& replies,
+  char const* const* steps)
+{
+  int ret = 0;
+  for (size_t i = 0; i < replies.size(); ++i)
   {
-    ret = wpaControl_createNetwork(&networkId);
+    WpaReply reply = replies[i].get();
     if (ret)
+      continue;
+
+    if (reply.Error)
     {
-      int err = errno;
-      return JsonRpc::makeError(err, "failed to create network. %s", strerror(err));
+      XLOG_ERROR("wpaControl_connect_WPA2 %s failed. %s", steps[i], strerror(reply.Error));
+      ret = reply.Error;
+    }
+    else if (reply.Text.compare(0, 4, "FAIL") == 0)
+    {
+      XLOG_ERROR("wpaControl_connect_WPA2 %s failed. %s", steps[i], reply.Text.c_str());
+      ret = EINVAL;
     }
-    XLOG_INFO("new network created, index = %d", networkId);
   }
+  replies.clear();
+  return ret;
+}
 
-  ret = wpaControl_configureWpa2Network(networkId, ssid, pass);
-  return cJSON_CreateString("ok");
+int
+WpaSession::configureWpa2Network(int networkId, char const* ssid, char const* wpa_pass)
+{
+  char command_buff[512];
+
+  // the SETs don't depend on each other, so they're sent back to back.
+  // the network is only selected and saved once both of them worked,
+  // so a bad psk never leaves a half configured network in use
+  std::vector< std::future<WpaReply> > replies;
+
+  snprintf(command_buff, sizeof(command_buff), "SET_NETWORK %d ssid \"%s\"", networkId, ssid);
+  replies.push_back(m_client.submit(command_buff));
+
+  snprintf(command_buff, sizeof(command_buff), "SET_NETWORK %d psk \"%s\"", networkId, wpa_pass);
+  replies.push_back(m_client.submit(command_buff));
+
+  static char const* const kSetSteps[] = { "set ssid", "set psk" };
+  int ret = wpaControl_collectReplies(replies, kSetSteps);
+  if (ret)
+    return ret;
+
+  snprintf(command_buff, sizeof(command_buff), "SELECT_NETWORK %d", networkId);
+  replies.push_back(m_client.submit(command_buff));
+  replies.push_back(m_client.submit("SAVE_CONFIG"));
+
+  static char const* const kSelectSteps[] = { "select network", "save config" };
+  ret = wpaControl_collectReplies(replies, kSelectSteps);
+  if (!ret)
+    XLOG_DEBUG("network %d configured and selected", networkId);
+
+  return ret;
 }
 
+std::string
+WpaSession::getState()
+{
+  if (!m_status.isValid())
+    loadStatus();
 
-cJSON*
-wpaControl_getStatus(cJSON const* UNUSED_PARAM(req))
+  WpaStatus status;
+  m_status.get(status);
+  return status.State;
+}
+
+int
+WpaSession::loadNetworks()
 {
   std::string buff;
+  int ret = runCommand("LIST_NETWORKS", buff);
+  if (ret)
+  {
+    XLOG_WARN("LIST_NETWORKS failed:%s", strerror(ret));
+    return ret;
+  }
 
-  cJSON* res = nullptr;
+  m_networks.load(buff);
+  return 0;
+}
 
-  int ret = wpaControl_runCommand("STATUS", buff);
-  if (ret)
-    res = wpaControl_createError(ret);
+cJSON*
+WpaSession::connect(cJSON const* req)
+{
+  char const* pass = JsonRpc::getString(req, "/params/cred/pass", true);
+  char const* ssid = JsonRpc::getString(req, "/params/discovery/ssid", true);
+
+  XLOG_INFO("connect %s to '%s'", m_name.c_str(), ssid);
+
+  uint64_t commands = m_client.commandCount();
+
+  int ret = 0;
+  int networkId = -1;
+  bool created = false;
+
+  // if a configured network matches ssid, then simply update the password
+  if (m_networks.isStale())
+    loadNetworks();
+
+  if (m_networks.find(ssid, &networkId))
+  {
+    XLOG_INFO("network '%s' already exists %d", ssid, networkId);
+  }
   else
-    res = wpaControl_createResponse(buff);
+  {
+    ret = createNetwork(&networkId);
+    if (ret)
+      return JsonRpc::makeError(ret, "failed to create network. %s", strerror(ret));
+    created = true;
+    XLOG_INFO("new network created, index = %d", networkId);
+  }
 
-  return res;
+  ret = configureWpa2Network(networkId, ssid, pass);
+
+  // only a network that took its ssid and psk goes in the index. one we
+  // just made is removed again rather than left half configured
+  if (!ret && created)
+  {
+    m_networks.add(networkId, ssid);
+  }
+  else if (ret && created)
+  {
+    char cmd[64];
+    std::string res;
+    snprintf(cmd, sizeof(cmd), "REMOVE_NETWORK %d", networkId);
+    if (runCommand(cmd, res) != 0 || !ok(chomp(res.c_str())))
+      XLOG_WARN("failed to remove network %d", networkId);
+  }
+
+  XLOG_INFO("connect to '%s' took %d supplicant round trips", ssid,
+    static_cast<int>(m_client.commandCount() - commands));
+
+  if (ret)
+    return JsonRpc::makeError(ret, "failed to configure network. %s", strerror(ret));
+
+  return cJSON_CreateString("ok");
 }
 
 cJSON*
-wpaControl_createResponse(std::string const& s)
+WpaSession::getStatus(cJSON const* req)
 {
-  cJSON* res = nullptr;
+  cJSON const* params = cJSON_GetObjectItem(req, "params");
 
-  if (!s.empty())
+  // "refresh": true skips the cached status. "version": n waits for a
+  // status other than version n, up to "timeout" seconds. the wait
+  // happens on the event loop, which answers when the status changes,
+  // so other requests aren't held up behind it
+  bool refresh = false;
+  int version = -1;
+  int timeout = kDefaultStatusTimeout;
+  if (params)
   {
-    res = cJSON_CreateObject();
+    cJSON const* item = cJSON_GetObjectItem(params, "refresh");
+    refresh = item && item->type == cJSON_True;
+    version = JsonRpc::getInt(params, "version", false, -1);
+    timeout = std::min(std::max(JsonRpc::getInt(params, "timeout", false,
+      kDefaultStatusTimeout), 0), kMaxStatusTimeout);
+  }
 
-    size_t begin = 0;
-    while (true)
-    {
-      size_t end = s.find('\n', begin);
-      if (end == std::string::npos)
-        break;
+  if (refresh || !m_status.isValid())
+  {
+    int ret = loadStatus();
+    if (ret)
+      return wpaControl_createError(ret);
+  }
 
-      std::string line(s.substr(begin, (end - begin)));
-      size_t mid = line.find('=');
+  // checked under the waiters lock, so a change that lands right now
+  // either shows up here or answers the waiter
+  std::lock_guard<std::mutex> guard(m_waiters_mutex);
 
-      if (mid != std::string::npos)
-      {
-        std::string name(line.substr(0, mid));
-        std::string value(line.substr(mid + 1));
+  WpaStatus status;
+  std::string raw;
+  uint64_t current = m_status.get(status, &raw);
+  if (version < 0 || current != static_cast<uint64_t>(version) || timeout == 0)
+    return statusToJson(raw, current);
 
-        cJSON_AddItemToObject(res, name.c_str(), cJSON_CreateString(value.c_str()));
-      }
+  if (m_status_waiters.size() >= kMaxStatusWaiters)
+    return JsonRpc::makeError(EBUSY, "too many get-status requests waiting");
 
-      begin = end + 1;
-    }
+  WpaStatusWaiter waiter;
+  waiter.RequestId = JsonRpc::getInt(req, "id", true);
+  waiter.Version = current;
+  waiter.Deadline = WpaClock::now() + std::chrono::seconds(timeout);
+  m_status_waiters.push_back(waiter);
+
+  // so the loop picks up the new deadline
+  m_loop->wakeup();
+  return JsonRpc::deferred();
+}
+
+cJSON*
+wpaControl_createResponse(std::string& s)
+{
+  cJSON* res = nullptr;
+
+  if (!s.empty())
+  {
+    res = cJSON_CreateObject();
+
+    // names and values are terminated in place, over the '=' and the
+    // '\n', so they can go straight to cJSON without copying them first
+    wpaForEachField(&s[0], s.size(), [res](WpaField const& f) -> bool
+    {
+      if (!f.HasValue)
+        return true;
+
+      const_cast<char *>(f.Name.Data)[f.Name.Size] = '\0';
+      const_cast<char *>(f.Value.Data)[f.Value.Size] = '\0';
+      cJSON_AddItemToObject(res, f.Name.Data, cJSON_CreateString(f.Value.Data));
+      return true;
+    });
   }
 
   return res;
@@ -564,37 +1454,111 @@ wpaControl_createError(int err)
 
 WiFiService::WiFiService()
   : BasicRpcService("wifi")
+  , m_loop(new WpaEventLoop())
+  , m_scan_timer(-1)
 {
 }
 
 WiFiService::~WiFiService()
 {
-  wpaControl_shutdown();
+  if (m_scan_timer != -1)
+    m_loop->removeTimer(m_scan_timer);
+  m_loop->stop();
+  m_sessions.clear();
 }
 
 void
-WiFiService::init(cJSON const* conf, RpcNotificationFunction const& callback)
+WiFiService::init(cJSON const* conf, RpcNotifier const& notifier)
 {
-  BasicRpcService::init(conf, callback);
+  BasicRpcService::init(conf, notifier);
+
+  // "interface": "/var/run/wpa_supplicant/wlan0" for a single radio, or
+  // "interfaces": [ "/var/run/wpa_supplicant/wlan0", ... ]. the first one
+  // is used when a request doesn't name an interface
+  std::vector<std::string> paths;
+  cJSON const* interfaces = JsonRpc::search(conf, "/settings/interfaces", false);
+  if (interfaces)
+  {
+    for (int i = 0, n = cJSON_GetArraySize(interfaces); i < n; ++i)
+    {
+      cJSON const* item = cJSON_GetArrayItem(interfaces, i);
+      if (item && item->valuestring)
+        paths.push_back(item->valuestring);
+    }
+  }
+  else
+  {
+    paths.push_back(JsonRpc::getString(conf, "/settings/interface", true));
+  }
+
+  cJSON const* events = JsonRpc::search(conf, "/settings/events", false);
+
+  int ret = m_loop->start();
+  if (ret)
+    XLOG_ERROR("failed to start wpa event loop. %s", strerror(ret));
 
-  char const* iface = JsonRpc::getString(conf, "/settings/interface", true);
-  wpaControl_init(iface, callback);
+  for (std::string const& path : paths)
+  {
+    std::shared_ptr<WpaSession> session(new WpaSession(interfaceName(path.c_str()),
+      m_loop.get(), notifier));
+
+    ret = session->open(path.c_str(), events);
+    if (ret)
+      XLOG_ERROR("failed to open %s. %s", path.c_str(), strerror(ret));
+
+    m_sessions.push_back(session);
+  }
+
+  m_scan_timer = m_loop->addTimer([this] { return this->answerScanWaiters(); });
 
   registerMethod("get-status", [this](cJSON const* req) -> cJSON* { return this->getStatus(req); });
   registerMethod("connect", [this](cJSON const* req) -> cJSON* { return this->connect(req); });
   registerMethod("scan", [this](cJSON const* req) -> cJSON* { return this->scan(req); });
 }
 
+void
+WiFiService::onClientChanged()
+{
+  for (std::shared_ptr<WpaSession> const& session : m_sessions)
+    session->dropStatusWaiters();
+
+  std::lock_guard<std::mutex> guard(m_scan_mutex);
+  m_scan_waiters.clear();
+}
+
+std::shared_ptr<WpaSession>
+WiFiService::findSession(char const* name) const
+{
+  if (!name)
+    return m_sessions.empty() ? nullptr : m_sessions[0];
+
+  for (std::shared_ptr<WpaSession> const& session : m_sessions)
+  {
+    if (session->name() == name)
+      return session;
+  }
+
+  return nullptr;
+}
+
 cJSON*
 WiFiService::getStatus(cJSON const* req)
 {
-  return wpaControl_getStatus(req);
+  char const* iface = JsonRpc::getString(req, "/params/interface", false);
+  std::shared_ptr<WpaSession> session = findSession(iface);
+  if (!session)
+    return JsonRpc::makeError(ENODEV, "no such interface %s", iface ? iface : "");
+  return session->getStatus(req);
 }
 
 cJSON*
 WiFiService::connect(cJSON const* req)
 {
-  return wpaControl_connectToNetwork(req);
+  char const* iface = JsonRpc::getString(req, "/params/interface", false);
+  std::shared_ptr<WpaSession> session = findSession(iface);
+  if (!session)
+    return JsonRpc::makeError(ENODEV, "no such interface %s", iface ? iface : "");
+  return session->connect(req);
 }
 
 cJSON*
@@ -603,47 +1567,159 @@ WiFiService::scan(cJSON const* req)
   cJSON const* params = cJSON_GetObjectItem(req, "params");
 
   int reqId = JsonRpc::getInt(req, "id", true);
-  char const* band = JsonRpc::getString(params, "band", false);
 
-  std::string buff;
+  // max-age lets the client take results that are at most this many
+  // seconds old without triggering a new scan
+  int maxAge = -1;
+  int timeout = kDefaultScanTimeout;
 
-  int ret = wpaControl_runCommand("SCAN", buff);
-  if (ret)
+  // "interface" is one name, a list of names, or "*" for every radio
+  std::vector< std::shared_ptr<WpaSession> > sessions;
+  cJSON const* iface = nullptr;
+  if (params)
+  {
+    maxAge = JsonRpc::getInt(params, "max-age", false, -1);
+    timeout = std::min(std::max(JsonRpc::getInt(params, "timeout", false,
+      kDefaultScanTimeout), 0), kMaxScanTimeout);
+    iface = cJSON_GetObjectItem(params, "interface");
+  }
+
+  if (!iface)
+  {
+    sessions.push_back(findSession(nullptr));
+  }
+  else if (iface->valuestring && strcmp(iface->valuestring, "*") == 0)
   {
-    XLOG_WARN("error starting scan:%s", strerror(ret));
+    sessions = m_sessions;
+  }
+  else if (iface->valuestring)
+  {
+    sessions.push_back(findSession(iface->valuestring));
   }
   else
   {
-    if (!ok(buff))
-      XLOG_WARN("error starting scan:%s", buff.c_str());
+    for (int i = 0, n = cJSON_GetArraySize(iface); i < n; ++i)
+    {
+      cJSON const* item = cJSON_GetArrayItem(iface, i);
+      if (!item || !item->valuestring)
+        return JsonRpc::makeError(EINVAL, "interface must be a name or a list of names");
+      sessions.push_back(findSession(item->valuestring));
+    }
+  }
+
+  if (sessions.empty() || std::find(sessions.begin(), sessions.end(), nullptr) != sessions.end())
+    return JsonRpc::makeError(ENODEV, "no such interface");
+
+  {
+    std::lock_guard<std::mutex> guard(m_scan_mutex);
+    if (m_scan_waiters.size() >= kMaxScanWaiters)
+      return JsonRpc::makeError(EBUSY, "too many wifi-scan requests waiting");
   }
 
   cJSON* start = cJSON_CreateObject();
   cJSON_AddStringToObject(start, "status", "start-scan");
   notifyAndDelete(JsonRpc::wrapResponse(0, start, reqId));
 
-  int id = 0;
-  while (true)
+  // start every scan before waiting on any of them. the radios scan in
+  // parallel, so they share one deadline
+  std::shared_ptr<WpaScanWaiter> waiter = std::make_shared<WpaScanWaiter>();
+  waiter->RequestId = reqId;
+  waiter->Sessions = sessions;
+  waiter->Scans.resize(sessions.size(), 0);
+  waiter->Deadline = WpaClock::now() + std::chrono::seconds(timeout);
+
+  bool cached = true;
+  for (size_t i = 0; i < sessions.size(); ++i)
   {
-    char cmd[16];
-    snprintf(cmd, sizeof(cmd), "BSS %d", id);
+    if (sessions[i]->beginScan(maxAge, &waiter->Scans[i]))
+      cached = false;
+  }
 
-    buff.resize(0);
-    ret = wpaControl_runCommand(cmd,  buff, 8192);
-    if (!ret)
-    {
-      cJSON* bss = wpaControl_createResponse(buff);
-      if (bss)
-        notifyAndDelete(JsonRpc::wrapResponse(0, bss, reqId));
-    }
+  if (cached)
+  {
+    sendScanResults(*waiter);
+    return scanDone(true);
+  }
 
-    id++;
+  {
+    std::lock_guard<std::mutex> guard(m_scan_mutex);
+    m_scan_waiters.push_back(waiter);
+  }
 
-    if (buff.size() == 0)
-      break;
+  // so the loop picks up the new deadline
+  m_loop->wakeup();
+  return JsonRpc::deferred();
+}
+
+void
+WiFiService::sendScanResults(WpaScanWaiter const& waiter)
+{
+  for (std::shared_ptr<WpaSession> const& session : waiter.Sessions)
+  {
+    cJSON* results = session->scanResults();
+    while (cJSON_GetArraySize(results) > 0)
+    {
+      notifyAndDelete(JsonRpc::wrapResponse(0, cJSON_DetachItemFromArray(results, 0),
+        waiter.RequestId));
+    }
+    cJSON_Delete(results);
   }
+}
 
+cJSON*
+WiFiService::scanDone(bool cached)
+{
   cJSON* res = cJSON_CreateObject();
   cJSON_AddStringToObject(res, "status", "scan-done");
+  cJSON_AddBoolToObject(res, "cached", cached);
   return res;
 }
+
+// answers every scan whose radios all have their results or whose time
+// is up, and returns when the next one times out
+int
+WiFiService::answerScanWaiters()
+{
+  std::vector< std::shared_ptr<WpaScanWaiter> > due;
+  int timeout = -1;
+  {
+    std::lock_guard<std::mutex> guard(m_scan_mutex);
+    WpaClock::time_point now = WpaClock::now();
+    for (auto itr = m_scan_waiters.begin(); itr != m_scan_waiters.end();)
+    {
+      std::shared_ptr<WpaScanWaiter> const& waiter = *itr;
+
+      bool done = true;
+      for (size_t i = 0; i < waiter->Sessions.size(); ++i)
+      {
+        if (waiter->Scans[i] != 0 && !waiter->Sessions[i]->hasScan(waiter->Scans[i]))
+        {
+          if (waiter->Deadline <= now)
+            XLOG_WARN("timed out waiting for scan results on %s, returning cached results",
+              waiter->Sessions[i]->name().c_str());
+          done = false;
+        }
+      }
+
+      if (done || waiter->Deadline <= now)
+      {
+        due.push_back(waiter);
+        itr = m_scan_waiters.erase(itr);
+        continue;
+      }
+
+      int millis = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        waiter->Deadline - now).count()) + 1;
+      if (timeout == -1 || millis < timeout)
+        timeout = millis;
+      ++itr;
+    }
+  }
+
+  for (std::shared_ptr<WpaScanWaiter> const& waiter : due)
+  {
+    sendScanResults(*waiter);
+    notifyAndDelete(JsonRpc::wrapResponse(0, scanDone(false), waiter->RequestId));
+  }
+  return timeout;
+}
@@ -19,16 +19,36 @@
 #include "../defs.h"
 #include "../rpcserver.h"
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class WpaEventLoop;
+class WpaSession;
+struct WpaScanWaiter;
+
 class WiFiService : public BasicRpcService
 {
 public:
   WiFiService();
   virtual ~WiFiService();
-  virtual void init(cJSON const* conf, RpcNotificationFunction const& callback) override;
+  virtual void init(cJSON const* conf, RpcNotifier const& notifier) override;
+  virtual void onClientChanged() override;
 private:
   cJSON* getStatus(cJSON const* req);
   cJSON* connect(cJSON const* req);
   cJSON* scan(cJSON const* req);
+  std::shared_ptr<WpaSession> findSession(char const* name) const;
+  void sendScanResults(WpaScanWaiter const& waiter);
+  cJSON* scanDone(bool cached);
+  int answerScanWaiters();
+
+private:
+  std::unique_ptr<WpaEventLoop>                 m_loop;
+  std::vector< std::shared_ptr<WpaSession> >    m_sessions;
+  std::mutex                                    m_scan_mutex;
+  std::vector< std::shared_ptr<WpaScanWaiter> > m_scan_waiters;
+  int                                           m_scan_timer;
 };
 
 #endif
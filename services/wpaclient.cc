@@ -0,0 +1,543 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "wpaclient.h"
+#include "../rpclogger.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <wpa_ctrl.h>
+
+namespace
+{
+  int const kMaxEvents = 16;
+  int const kReplyBufferSize = 16384;
+  int const kRequestTimeout = 10000;
+}
+
+WpaEventLoop::WpaEventLoop()
+  : m_epoll_fd(-1)
+  , m_wakeup_fd(-1)
+  , m_thread()
+  , m_mutex()
+  , m_readers()
+  , m_timers()
+  , m_next_timer(1)
+  , m_running(false)
+{
+}
+
+WpaEventLoop::~WpaEventLoop()
+{
+  stop();
+}
+
+int
+WpaEventLoop::start()
+{
+  if (m_running)
+    return 0;
+
+  m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll_fd == -1)
+  {
+    int err = errno;
+    XLOG_ERROR("failed to create epoll fd. %s", strerror(err));
+    return err;
+  }
+
+  m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_wakeup_fd == -1)
+  {
+    int err = errno;
+    XLOG_ERROR("failed to create wakeup fd. %s", strerror(err));
+    ::close(m_epoll_fd);
+    m_epoll_fd = -1;
+    return err;
+  }
+
+  epoll_event e;
+  memset(&e, 0, sizeof(e));
+  e.events = EPOLLIN;
+  e.data.fd = m_wakeup_fd;
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &e);
+
+  m_running = true;
+  m_thread = std::thread([this] { this->run(); });
+  return 0;
+}
+
+void
+WpaEventLoop::stop()
+{
+  if (!m_running)
+    return;
+
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_running = false;
+  }
+
+  wakeup();
+  m_thread.join();
+
+  ::close(m_wakeup_fd);
+  ::close(m_epoll_fd);
+  m_wakeup_fd = -1;
+  m_epoll_fd = -1;
+}
+
+bool
+WpaEventLoop::isLoopThread() const
+{
+  return std::this_thread::get_id() == m_thread.get_id();
+}
+
+int
+WpaEventLoop::addReader(int fd, WpaReadHandler const& handler)
+{
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_readers[fd] = handler;
+  }
+
+  epoll_event e;
+  memset(&e, 0, sizeof(e));
+  e.events = EPOLLIN;
+  e.data.fd = fd;
+
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &e) == -1)
+  {
+    int err = errno;
+    XLOG_ERROR("failed to add fd:%d to epoll. %s", fd, strerror(err));
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_readers.erase(fd);
+    return err;
+  }
+
+  return 0;
+}
+
+void
+WpaEventLoop::removeReader(int fd)
+{
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_readers.erase(fd);
+}
+
+int
+WpaEventLoop::addTimer(WpaTimerFunction const& timer)
+{
+  int id = 0;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    id = m_next_timer++;
+    m_timers[id] = timer;
+  }
+
+  // the new timer may want to run sooner than epoll_wait is set for
+  wakeup();
+  return id;
+}
+
+void
+WpaEventLoop::removeTimer(int id)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_timers.erase(id);
+}
+
+void
+WpaEventLoop::wakeup()
+{
+  if (m_wakeup_fd == -1)
+    return;
+
+  uint64_t one = 1;
+  ssize_t n = write(m_wakeup_fd, &one, sizeof(one));
+  if (n != sizeof(one))
+    XLOG_DEBUG("failed to wakeup event loop. %s", strerror(errno));
+}
+
+void
+WpaEventLoop::run()
+{
+  XLOG_INFO("wpa event loop running");
+
+  epoll_event events[kMaxEvents];
+
+  while (true)
+  {
+    std::vector<WpaTimerFunction> timers;
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      if (!m_running)
+        break;
+      for (auto const& kv : m_timers)
+        timers.push_back(kv.second);
+    }
+
+    int timeout = -1;
+    for (WpaTimerFunction const& timer : timers)
+    {
+      int t = timer();
+      if (t >= 0 && (timeout == -1 || t < timeout))
+        timeout = t;
+    }
+
+    int n = epoll_wait(m_epoll_fd, events, kMaxEvents, timeout);
+    if (n == -1)
+    {
+      if (errno != EINTR)
+        XLOG_ERROR("epoll_wait failed. %s", strerror(errno));
+      continue;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+      int fd = events[i].data.fd;
+      if (fd == m_wakeup_fd)
+      {
+        uint64_t value = 0;
+        ssize_t bytes = read(m_wakeup_fd, &value, sizeof(value));
+        (void) bytes;
+        continue;
+      }
+
+      WpaReadHandler handler;
+      {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto itr = m_readers.find(fd);
+        if (itr != m_readers.end())
+          handler = itr->second;
+      }
+
+      if (handler)
+        handler();
+    }
+  }
+
+  XLOG_INFO("wpa event loop stopped");
+}
+
+WpaControlClient::WpaControlClient()
+  : m_loop(nullptr)
+  , m_path()
+  , m_request(nullptr)
+  , m_monitor(nullptr)
+  , m_on_event(nullptr)
+  , m_mutex()
+  , m_pending()
+  , m_buff(kReplyBufferSize)
+  , m_timer(-1)
+  , m_commands(0)
+{
+}
+
+WpaControlClient::~WpaControlClient()
+{
+  close();
+}
+
+int
+WpaControlClient::open(WpaEventLoop* loop, char const* path, WpaEventHandler const& onEvent)
+{
+  if (!loop || !path)
+  {
+    XLOG_WARN("NULL event loop or control socket path");
+    return EINVAL;
+  }
+
+  m_loop = loop;
+  m_path = path;
+  m_on_event = onEvent;
+
+  m_request = wpa_ctrl_open(m_path.c_str());
+  if (!m_request)
+  {
+    int err = errno;
+    XLOG_ERROR("failed to open:%s. %s", m_path.c_str(), strerror(err));
+    return err;
+  }
+  XLOG_INFO("wpa request socket:%s opened", m_path.c_str());
+
+  m_monitor = wpa_ctrl_open(m_path.c_str());
+  if (!m_monitor)
+  {
+    int err = errno;
+    XLOG_ERROR("failed to open notify socket:%s. %s", m_path.c_str(), strerror(err));
+    wpa_ctrl_close(m_request);
+    m_request = nullptr;
+    return err;
+  }
+  XLOG_INFO("wpa request socket:%s opened for notification", m_path.c_str());
+
+  if (wpa_ctrl_attach(m_monitor) != 0)
+  {
+    int err = errno;
+    XLOG_WARN("failed to attach to wpa interface for notification. %s", strerror(err));
+  }
+
+  m_loop->addReader(wpa_ctrl_get_fd(m_request), [this] { this->readReply(); });
+  m_loop->addReader(wpa_ctrl_get_fd(m_monitor), [this] { this->readEvent(); });
+  m_timer = m_loop->addTimer([this] { return this->expireCommands(); });
+
+  return 0;
+}
+
+void
+WpaControlClient::close()
+{
+  if (m_loop)
+  {
+    m_loop->removeTimer(m_timer);
+    if (m_request)
+      m_loop->removeReader(wpa_ctrl_get_fd(m_request));
+    if (m_monitor)
+      m_loop->removeReader(wpa_ctrl_get_fd(m_monitor));
+    m_loop = nullptr;
+  }
+
+  failPending(ECANCELED);
+
+  if (m_monitor)
+  {
+    wpa_ctrl_detach(m_monitor);
+    wpa_ctrl_close(m_monitor);
+    m_monitor = nullptr;
+  }
+
+  if (m_request)
+  {
+    wpa_ctrl_close(m_request);
+    m_request = nullptr;
+  }
+}
+
+void
+WpaControlClient::submit(char const* cmd, WpaCompletion const& done)
+{
+  XLOG_INFO("wpa command:%s", cmd);
+
+  int err = 0;
+  bool first = false;
+  {
+    // the queue and the socket have to agree on ordering, so both happen
+    // under the lock
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_request)
+    {
+      err = EINVAL;
+    }
+    else if (send(wpa_ctrl_get_fd(m_request), cmd, strlen(cmd), 0) < 0)
+    {
+      err = errno;
+    }
+    else
+    {
+      PendingCommand pending;
+      pending.Command = cmd;
+      pending.Done = done;
+      pending.Deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(kRequestTimeout);
+      m_pending.push_back(std::move(pending));
+      first = (m_pending.size() == 1);
+      m_commands++;
+    }
+  }
+
+  if (err)
+  {
+    XLOG_WARN("failed to submit wpa control request:%s", strerror(err));
+    if (done)
+      done(err, std::string());
+  }
+  else if (first && m_loop)
+  {
+    // arm the request timeout
+    m_loop->wakeup();
+  }
+}
+
+std::future<WpaReply>
+WpaControlClient::submit(char const* cmd)
+{
+  std::shared_ptr< std::promise<WpaReply> > promise(new std::promise<WpaReply>());
+  std::future<WpaReply> future = promise->get_future();
+
+  submit(cmd, [promise](int err, std::string const& reply)
+  {
+    WpaReply res;
+    res.Error = err;
+    res.Text = reply;
+    promise->set_value(std::move(res));
+  });
+
+  return future;
+}
+
+int
+WpaControlClient::request(char const* cmd, std::string& reply)
+{
+  if (m_loop && m_loop->isLoopThread())
+  {
+    XLOG_ERROR("synchronous wpa request '%s' from event loop thread", cmd);
+    return EDEADLK;
+  }
+
+  WpaReply res = submit(cmd).get();
+  reply = std::move(res.Text);
+  return res.Error;
+}
+
+void
+WpaControlClient::readReply()
+{
+  while (true)
+  {
+    PendingCommand pending;
+    std::string reply;
+
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      if (!m_request)
+        return;
+
+      ssize_t n = recv(wpa_ctrl_get_fd(m_request), &m_buff[0], m_buff.size(), MSG_DONTWAIT);
+      if (n < 0)
+      {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          XLOG_ERROR("error reading from WPA socket:%s", strerror(errno));
+        return;
+      }
+
+      // unsolicited messages only show up here if this socket was
+      // attached. they don't belong to any command
+      if (n > 0 && m_buff[0] == '<')
+        continue;
+
+      if (m_pending.empty())
+      {
+        XLOG_WARN("wpa reply with no outstanding command");
+        continue;
+      }
+
+      pending = std::move(m_pending.front());
+      m_pending.pop_front();
+      reply.assign(&m_buff[0], n);
+    }
+
+    if (pending.Done)
+      pending.Done(0, reply);
+  }
+}
+
+void
+WpaControlClient::readEvent()
+{
+  char buff[1024];
+  size_t n = sizeof(buff) - 1;
+
+  int ret = wpa_ctrl_recv(m_monitor, buff, &n);
+  if (ret < 0)
+  {
+    XLOG_ERROR("error reading from WPA socket:%s", strerror(errno));
+    return;
+  }
+
+  buff[n] = '\0';
+  if (m_on_event)
+    m_on_event(buff, n);
+}
+
+int
+WpaControlClient::expireCommands()
+{
+  auto now = std::chrono::steady_clock::now();
+
+  bool expired = false;
+  int timeout = -1;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_pending.empty())
+    {
+      auto deadline = m_pending.front().Deadline;
+      if (deadline <= now)
+      {
+        XLOG_WARN("wpa command '%s' timed out", m_pending.front().Command.c_str());
+        expired = true;
+      }
+      else
+      {
+        timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - now).count());
+      }
+    }
+  }
+
+  // a late reply would be matched to the wrong command, so everything
+  // outstanding is failed and the request socket starts over
+  if (expired)
+  {
+    failPending(ETIMEDOUT);
+    reopenRequestSocket();
+  }
+
+  return timeout;
+}
+
+int
+WpaControlClient::reopenRequestSocket()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_request)
+  {
+    m_loop->removeReader(wpa_ctrl_get_fd(m_request));
+    wpa_ctrl_close(m_request);
+  }
+
+  m_request = wpa_ctrl_open(m_path.c_str());
+  if (!m_request)
+  {
+    int err = errno;
+    XLOG_ERROR("failed to reopen:%s. %s", m_path.c_str(), strerror(err));
+    return err;
+  }
+
+  return m_loop->addReader(wpa_ctrl_get_fd(m_request), [this] { this->readReply(); });
+}
+
+void
+WpaControlClient::failPending(int err)
+{
+  std::deque<PendingCommand> pending;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    pending.swap(m_pending);
+  }
+
+  for (PendingCommand const& cmd : pending)
+  {
+    if (cmd.Done)
+      cmd.Done(err, std::string());
+  }
+}
@@ -0,0 +1,129 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __WPA_CLIENT_H__
+#define __WPA_CLIENT_H__
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct wpa_ctrl;
+
+struct WpaReply
+{
+  int         Error;
+  std::string Text;
+};
+
+using WpaCompletion = std::function<void (int err, std::string const& reply)>;
+using WpaEventHandler = std::function<void (char const* event, size_t n)>;
+using WpaReadHandler = std::function<void ()>;
+
+// called on every pass of the event loop. does whatever work is due and
+// returns the number of milliseconds until it needs to run again, or -1
+using WpaTimerFunction = std::function<int ()>;
+
+// One epoll thread that every supplicant socket is multiplexed on
+class WpaEventLoop
+{
+public:
+  WpaEventLoop();
+  ~WpaEventLoop();
+
+  int start();
+  void stop();
+  bool isLoopThread() const;
+
+  int addReader(int fd, WpaReadHandler const& handler);
+  void removeReader(int fd);
+  int addTimer(WpaTimerFunction const& timer);
+  void removeTimer(int id);
+  void wakeup();
+
+private:
+  void run();
+
+private:
+  int                               m_epoll_fd;
+  int                               m_wakeup_fd;
+  std::thread                       m_thread;
+  std::mutex                        m_mutex;
+  std::map<int, WpaReadHandler>     m_readers;
+  std::map<int, WpaTimerFunction>   m_timers;
+  int                               m_next_timer;
+  bool                              m_running;
+};
+
+// Non-blocking wpa_supplicant control interface client. Commands are
+// written to the request socket as soon as they're submitted, so several
+// can be in flight at once. The supplicant answers in order, so each
+// reply completes the oldest outstanding command.
+class WpaControlClient
+{
+public:
+  WpaControlClient();
+  ~WpaControlClient();
+
+  int open(WpaEventLoop* loop, char const* path, WpaEventHandler const& onEvent);
+  void close();
+
+  void submit(char const* cmd, WpaCompletion const& done);
+  std::future<WpaReply> submit(char const* cmd);
+
+  // blocks the calling thread until the reply arrives. must not be
+  // called from the event loop thread
+  int request(char const* cmd, std::string& reply);
+
+  // total number of commands sent to the supplicant
+  uint64_t commandCount() const
+    { return m_commands; }
+
+private:
+  struct PendingCommand
+  {
+    std::string                             Command;
+    WpaCompletion                           Done;
+    std::chrono::steady_clock::time_point   Deadline;
+  };
+
+  void readReply();
+  void readEvent();
+  int expireCommands();
+  int reopenRequestSocket();
+  void failPending(int err);
+
+private:
+  WpaEventLoop*               m_loop;
+  std::string                 m_path;
+  wpa_ctrl*                   m_request;
+  wpa_ctrl*                   m_monitor;
+  WpaEventHandler             m_on_event;
+  std::mutex                  m_mutex;
+  std::deque<PendingCommand>  m_pending;
+  std::vector<char>           m_buff;
+  int                         m_timer;
+  std::atomic<uint64_t>       m_commands;
+};
+
+#endif
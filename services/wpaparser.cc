@@ -0,0 +1,69 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "wpaparser.h"
+
+int
+WpaSpan::toInt(int def) const
+{
+  if (Size == 0)
+    return def;
+
+  size_t i = 0;
+  bool negative = false;
+  if (Data[0] == '-')
+  {
+    negative = true;
+    i++;
+  }
+
+  if (i == Size)
+    return def;
+
+  int n = 0;
+  for (; i < Size; ++i)
+  {
+    if (Data[i] < '0' || Data[i] > '9')
+      return def;
+    n = (n * 10) + (Data[i] - '0');
+  }
+
+  return negative ? -n : n;
+}
+
+void
+wpaParseStatus(char const* s, size_t n, WpaStatus& status)
+{
+  wpaForEachField(s, n, [&status](WpaField const& f) -> bool
+  {
+    if (f.Name.equals("wpa_state"))
+      status.State = f.Value.toString();
+    else if (f.Name.equals("ssid"))
+      status.Ssid = f.Value.toString();
+    else if (f.Name.equals("bssid"))
+      status.Bssid = f.Value.toString();
+    else if (f.Name.equals("ip_address"))
+      status.IpAddress = f.Value.toString();
+    else if (f.Name.equals("key_mgmt"))
+      status.KeyManagement = f.Value.toString();
+    else if (f.Name.equals("address"))
+      status.Address = f.Value.toString();
+    else if (f.Name.equals("freq"))
+      status.Frequency = f.Value.toInt(0);
+    else if (f.Name.equals("id"))
+      status.NetworkId = f.Value.toInt(-1);
+    return true;
+  });
+}
@@ -0,0 +1,104 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __WPA_PARSER_H__
+#define __WPA_PARSER_H__
+
+#include <string>
+#include <stddef.h>
+#include <string.h>
+
+// A piece of a supplicant reply. It points into the reply buffer and is
+// not null terminated
+struct WpaSpan
+{
+  char const* Data;
+  size_t      Size;
+
+  bool equals(char const* s) const
+    { return strlen(s) == Size && memcmp(Data, s, Size) == 0; }
+  std::string toString() const
+    { return std::string(Data, Size); }
+  int toInt(int def) const;
+};
+
+// One line of a reply. For name=value lines Name is everything before the
+// first '=' and Value everything after. Lines without an '=' have the
+// whole line in Name, an empty Value and HasValue false.
+struct WpaField
+{
+  WpaSpan Line;
+  WpaSpan Name;
+  WpaSpan Value;
+  bool    HasValue;
+};
+
+// STATUS reply fields that the service uses
+struct WpaStatus
+{
+  WpaStatus()
+    : Frequency(0)
+    , NetworkId(-1) { }
+
+  std::string State;
+  std::string Ssid;
+  std::string Bssid;
+  std::string IpAddress;
+  std::string KeyManagement;
+  std::string Address;
+  int         Frequency;
+  int         NetworkId;
+};
+
+// Calls fn(WpaField const&) for each line of the reply, in a single pass
+// and without copying. Stops early if fn returns false.
+template<class Function>
+void
+wpaForEachField(char const* s, size_t n, Function fn)
+{
+  char const* end = s + n;
+  while (s < end)
+  {
+    char const* eol = static_cast<char const *>(memchr(s, '\n', end - s));
+    if (!eol)
+      eol = end;
+
+    WpaField field;
+    field.Line = { s, static_cast<size_t>(eol - s) };
+
+    char const* eq = static_cast<char const *>(memchr(s, '=', eol - s));
+    if (eq)
+    {
+      field.Name = { s, static_cast<size_t>(eq - s) };
+      field.Value = { eq + 1, static_cast<size_t>(eol - eq - 1) };
+      field.HasValue = true;
+    }
+    else
+    {
+      field.Name = field.Line;
+      field.Value = { eol, 0 };
+      field.HasValue = false;
+    }
+
+    if (!fn(field))
+      return;
+
+    s = eol + 1;
+  }
+}
+
+void wpaParseStatus(char const* s, size_t n, WpaStatus& status);
+
+#endif
@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# Runs bench_wifi against fake_wpa_supplicant. Any arguments are passed
+# to the fake supplicant, e.g.
+#   tests/bench-wifi.sh -b 200 -l 2 -l SCAN=20
+#
+BIN=${BIN:-.}
+SOCK=${SOCK:-/tmp/bleconfd-bench/wlan0}
+ITERATIONS=${ITERATIONS:-10}
+
+$BIN/fake_wpa_supplicant -p $SOCK "$@" &
+FAKE_PID=$!
+trap 'kill $FAKE_PID 2>/dev/null' EXIT
+
+sleep 1
+$BIN/bench_wifi -p $SOCK -i $ITERATIONS
+
+# the fake prints per-command counts on exit
+kill $FAKE_PID
+wait $FAKE_PID
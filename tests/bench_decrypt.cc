@@ -0,0 +1,256 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Times decrypting secure Wi-Fi settings and counts the heap allocations
+// each decrypt makes, for the single pass ECDH_DecryptJson against the
+// BIO decode and copies it replaced. The server key is made in a temporary
+// directory and the client's in memory.
+
+#include <cJSON.h>
+#include "../ecdh.h"
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+
+extern "C"
+{
+  void* __libc_malloc(size_t n);
+  void* __libc_calloc(size_t n, size_t size);
+  void* __libc_realloc(void* p, size_t n);
+}
+
+namespace
+{
+  bool counting = false;
+  long allocations = 0;
+
+  char const kSettings[] = "{\"ssid\":\"home network\",\"psk\":\"correct horse battery staple\","
+    "\"key_mgmt\":\"WPA-PSK\",\"priority\":1}";
+
+  std::string
+  toBase64(unsigned char const* p, int n)
+  {
+    std::string s(4 * ((n + 2) / 3) + 1, '\0');
+    s.resize(EVP_EncodeBlock(reinterpret_cast<unsigned char *>(&s[0]), p, n));
+    return s;
+  }
+
+  // what baFromBase64 used to do
+  int
+  fromBase64(char const* s, unsigned char** out)
+  {
+    size_t n = strlen(s);
+    BIO* b64 = BIO_new(BIO_f_base64());
+    BIO* buff = BIO_new_mem_buf(s, n);
+    buff = BIO_push(b64, buff);
+    BIO_set_flags(buff, BIO_FLAGS_BASE64_NO_NL);
+
+    *out = static_cast<unsigned char *>(malloc(n));
+    memset(*out, 0, n);
+    int length = BIO_read(buff, *out, n);
+    BIO_free_all(buff);
+    return length;
+  }
+
+  // what ECDH_Decrypt and ECDH_DecryptWiFiSettings used to do, with a
+  // cipher context per call. the shared key is taken as already derived
+  cJSON*
+  decryptWithCopies(unsigned char const* key, char const* iv, char const* data)
+  {
+    unsigned char* ivBytes = nullptr;
+    unsigned char* encrypted = nullptr;
+    fromBase64(iv, &ivBytes);
+    int length = fromBase64(data, &encrypted);
+
+    int n = 0;
+    int m = 0;
+    char* clear = static_cast<char *>(malloc(length + EVP_MAX_BLOCK_LENGTH + 1));
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    bool ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key, ivBytes) == 1 &&
+      EVP_DecryptUpdate(ctx, reinterpret_cast<unsigned char *>(clear), &n, encrypted, length) == 1 &&
+      EVP_DecryptFinal_ex(ctx, reinterpret_cast<unsigned char *>(clear) + n, &m) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    free(ivBytes);
+    free(encrypted);
+
+    cJSON* json = nullptr;
+    if (ok)
+    {
+      clear[n + m] = '\0';
+      json = cJSON_Parse(clear);
+    }
+    free(clear);
+    return json;
+  }
+
+  cJSON*
+  decryptSinglePass(char const* iv, char const* data)
+  {
+    unsigned char buff[2048];
+    cJSON* json = nullptr;
+    ECDH_DecryptJson(nullptr, iv, data, buff, sizeof(buff), &json);
+    return json;
+  }
+
+  int
+  run(char const* name, int iterations, std::function<cJSON* ()> const& fn)
+  {
+    cJSON* json = fn();
+    cJSON const* psk = cJSON_GetObjectItem(json, "psk");
+    if (!psk || strcmp(psk->valuestring, "correct horse battery staple") != 0)
+    {
+      printf("%s didn't decrypt the settings\n", name);
+      return 1;
+    }
+    cJSON_Delete(json);
+
+    allocations = 0;
+    counting = true;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+      cJSON_Delete(fn());
+    auto end = std::chrono::steady_clock::now();
+    counting = false;
+
+    // cJSON's own nodes are in both counts
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    printf("%-16s %10.1f us/op %8.1f allocs/op\n", name, ns / 1000,
+      static_cast<double>(allocations) / iterations);
+    return 0;
+  }
+}
+
+extern "C" void*
+malloc(size_t n)
+{
+  if (counting)
+    allocations++;
+  return __libc_malloc(n);
+}
+
+extern "C" void*
+calloc(size_t n, size_t size)
+{
+  if (counting)
+    allocations++;
+  return __libc_calloc(n, size);
+}
+
+extern "C" void*
+realloc(void* p, size_t n)
+{
+  if (counting)
+    allocations++;
+  return __libc_realloc(p, n);
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = 20000;
+  if (argc > 1)
+    iterations = atoi(argv[1]);
+
+  char dir[] = "/tmp/bench_decrypt.XXXXXX";
+  if (!mkdtemp(dir))
+  {
+    printf("failed to create temporary directory. %s\n", strerror(errno));
+    return 1;
+  }
+
+  EcdhKeyOptions options;
+  options.PrivateKeyPath = std::string(dir) + "/private.pem";
+  options.PublicKeyPath = std::string(dir) + "/public.pem";
+
+  EcdhKeyManager& keys = EcdhKeyManager::keyManager();
+  keys.start(options);
+
+  std::string serverKey;
+  while (keys.getPublicKey(serverKey) == EAGAIN)
+    usleep(1000);
+
+  // the client's half of the exchange
+  unsigned char der[256];
+  int derLength = EVP_DecodeBlock(der, reinterpret_cast<unsigned char const *>(serverKey.c_str()),
+    serverKey.size());
+  unsigned char const* p = der;
+  EVP_PKEY* serverPublic = d2i_PUBKEY(nullptr, &p, derLength);
+
+  EVP_PKEY* client = nullptr;
+  EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  EVP_PKEY_keygen_init(ctx);
+  EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1);
+  EVP_PKEY_keygen(ctx, &client);
+  EVP_PKEY_CTX_free(ctx);
+
+  unsigned char secret[32];
+  size_t secretLength = sizeof(secret);
+  ctx = EVP_PKEY_CTX_new(client, nullptr);
+  EVP_PKEY_derive_init(ctx);
+  EVP_PKEY_derive_set_peer(ctx, serverPublic);
+  EVP_PKEY_derive(ctx, secret, &secretLength);
+  EVP_PKEY_CTX_free(ctx);
+
+  unsigned char* clientDer = nullptr;
+  int clientDerLength = i2d_PUBKEY(client, &clientDer);
+  if (keys.setSessionPeer(toBase64(clientDer, clientDerLength)) != 0)
+  {
+    printf("failed to set client key\n");
+    return 1;
+  }
+  OPENSSL_free(clientDer);
+
+  unsigned char iv[16];
+  unsigned char encrypted[sizeof(kSettings) + 16];
+  int n = 0;
+  int m = 0;
+  RAND_bytes(iv, sizeof(iv));
+  EVP_CIPHER_CTX* cipher = EVP_CIPHER_CTX_new();
+  EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, secret, iv);
+  EVP_EncryptUpdate(cipher, encrypted, &n, reinterpret_cast<unsigned char const *>(kSettings),
+    strlen(kSettings));
+  EVP_EncryptFinal_ex(cipher, encrypted + n, &m);
+  EVP_CIPHER_CTX_free(cipher);
+
+  std::string ivText = toBase64(iv, sizeof(iv));
+  std::string data = toBase64(encrypted, n + m);
+
+  int ret = run("decrypt/copies", iterations,
+    [&] { return decryptWithCopies(secret, ivText.c_str(), data.c_str()); });
+  if (ret == 0)
+    ret = run("decrypt/single", iterations, [&] { return decryptSinglePass(ivText.c_str(), data.c_str()); });
+
+  EVP_PKEY_free(client);
+  EVP_PKEY_free(serverPublic);
+
+  // the key thread may still be writing the key it made
+  keys.stop();
+  unlink(options.PrivateKeyPath.c_str());
+  unlink(options.PublicKeyPath.c_str());
+  rmdir(dir);
+  return ret;
+}
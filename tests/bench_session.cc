@@ -0,0 +1,152 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Times sealing and opening encrypted session records against copying
+// the same JSON into a delimited text record, for a few record sizes.
+// Both ends run in this process, so every record is checked on the way.
+
+#include "../rpcsession.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+
+namespace
+{
+  size_t const kSizes[] = { 64, 256, 1024, 4096 };
+
+  std::string
+  makeJson(size_t n)
+  {
+    std::string s = "{\"jsonrpc\":\"2.0\",\"result\":{\"data\":\"";
+    while (s.size() + 4 < n)
+      s.push_back('a' + (s.size() % 26));
+    s += "\"},\"id\":1}";
+    return s;
+  }
+
+  double
+  nsPerOp(std::chrono::steady_clock::time_point start, int iterations)
+  {
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+  }
+
+  int
+  benchCipher(RpcCipher cipher, int iterations)
+  {
+    uint8_t keys[RpcSession::kKeyMaterialSize];
+    RAND_bytes(keys, sizeof(keys));
+
+    RpcSession server;
+    RpcSession client;
+    if (server.init(cipher, keys, sizeof(keys), true) != 0 ||
+        client.init(cipher, keys, sizeof(keys), false) != 0)
+    {
+      printf("failed to set up %s\n", RpcSession::cipherName(cipher));
+      return 1;
+    }
+
+    for (size_t size : kSizes)
+    {
+      std::string json = makeJson(size);
+      std::vector<char> record;
+      std::vector<char> clear;
+
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < iterations; ++i)
+      {
+        record.clear();
+        server.seal(json.data(), json.size(), record);
+        if (client.open(record.data(), record.size(), clear) != 0 ||
+            clear.size() != json.size() || memcmp(clear.data(), json.data(), json.size()) != 0)
+        {
+          printf("record %d of %zd bytes didn't round trip\n", i, json.size());
+          return 1;
+        }
+      }
+
+      char name[64];
+      snprintf(name, sizeof(name), "%s/%zd", RpcSession::cipherName(cipher), json.size());
+      printf("%-24s %10.1f ns/record  +%zd bytes\n", name, nsPerOp(start, iterations),
+        record.size() - json.size());
+    }
+
+    // a flipped bit has to be caught, and must not cost the real record
+    // its place in the sequence
+    std::string json = makeJson(64);
+    std::vector<char> record;
+    std::vector<char> clear;
+    server.seal(json.data(), json.size(), record);
+    record[RpcSession::kHeaderSize] ^= 1;
+    if (client.open(record.data(), record.size(), clear) == 0)
+    {
+      printf("tampered record opened\n");
+      return 1;
+    }
+    record[RpcSession::kHeaderSize] ^= 1;
+    if (client.open(record.data(), record.size(), clear) != 0)
+    {
+      printf("record after a tampered one didn't open\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  // what the delimited text path costs: one copy and a separator
+  void
+  benchText(int iterations)
+  {
+    for (size_t size : kSizes)
+    {
+      std::string json = makeJson(size);
+      std::vector<char> record;
+
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < iterations; ++i)
+      {
+        record.clear();
+        record.insert(record.end(), json.begin(), json.end());
+        record.push_back(30);
+      }
+
+      char name[64];
+      snprintf(name, sizeof(name), "text/%zd", json.size());
+      printf("%-24s %10.1f ns/record  +%zd bytes\n", name, nsPerOp(start, iterations),
+        record.size() - json.size());
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = 100000;
+  if (argc > 1)
+    iterations = atoi(argv[1]);
+
+  benchText(iterations);
+  if (benchCipher(RpcCipher::Aes256Gcm, iterations) != 0)
+    return 1;
+  if (benchCipher(RpcCipher::ChaCha20Poly1305, iterations) != 0)
+    return 1;
+  return 0;
+}
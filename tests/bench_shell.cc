@@ -0,0 +1,174 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Times cmd-exec's argv templates and direct spawn against the string
+// expansion and popen through /bin/sh they replaced.
+
+#include "../services/argvtemplate.h"
+#include "../services/subprocess.h"
+
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+  char const kCommand[] = "/bin/echo --name=${name} ${count:int}";
+
+  // what JsonRpc::getStringWithExpansion used to do
+  std::string
+  expandString(char const* s, cJSON const* replacements)
+  {
+    std::stringstream buff;
+    for (int i = 0, n = static_cast<int>(strlen(s)); i < n; ++i)
+    {
+      if (s[i] != '$')
+      {
+        buff << s[i];
+      }
+      else
+      {
+        i += 2;
+
+        int j = i;
+        char token[64];
+        memset(token, 0, sizeof(token));
+
+        while (j < n && s[j] != '}')
+          j++;
+
+        strncpy(token, s + i, (j - i));
+
+        // the old code had no types, drop the suffix
+        char* colon = strchr(token, ':');
+        if (colon)
+          *colon = '\0';
+
+        cJSON const* t = cJSON_GetObjectItem(replacements, token);
+        if (t && t->valuestring)
+          buff << t->valuestring;
+        else if (t)
+          buff << t->valueint;
+
+        i = j;
+      }
+    }
+    return buff.str();
+  }
+
+  // what invokeShellCommand used to do
+  size_t
+  runPopen(std::string const& cmd)
+  {
+    std::stringstream output;
+    FILE* in = popen(cmd.c_str(), "r");
+    if (!in)
+      return 0;
+
+    char buff[256];
+    memset(buff, 0, sizeof(buff));
+    while (fgets(buff, sizeof(buff), in))
+    {
+      output << buff;
+      memset(buff, 0, sizeof(buff));
+    }
+    pclose(in);
+    return output.str().size();
+  }
+
+  size_t
+  runSpawn(std::vector<std::string> const& argv)
+  {
+    SubprocessOptions options;
+    options.Timeout = 5000;
+    options.MaxOutput = 64 * 1024;
+
+    Subprocess process;
+    if (process.start(argv) != 0)
+      return 0;
+
+    SubprocessResult result;
+    process.wait(options, nullptr, result);
+    return result.Stdout.size();
+  }
+
+  volatile size_t sink;
+
+  void
+  run(char const* name, int iterations, char const* unit, std::function<size_t ()> const& fn)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+      sink = fn();
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    if (strcmp(unit, "us") == 0)
+      printf("%-16s %10.1f us/op\n", name, ns / 1000);
+    else
+      printf("%-16s %10.1f ns/op\n", name, ns);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = 200;
+  if (argc > 1)
+    iterations = atoi(argv[1]);
+
+  cJSON* args = cJSON_CreateObject();
+  cJSON_AddItemToObject(args, "name", cJSON_CreateString("bench"));
+  cJSON_AddItemToObject(args, "count", cJSON_CreateNumber(42));
+
+  ArgvTemplate argvTemplate;
+  std::string err;
+  if (argvTemplate.parse(kCommand, &err) != 0)
+  {
+    printf("failed to parse %s. %s\n", kCommand, err.c_str());
+    return 1;
+  }
+
+  run("expand/string", iterations * 100, "ns", [&]
+  {
+    return expandString(kCommand, args).size();
+  });
+  run("expand/argv", iterations * 100, "ns", [&]
+  {
+    std::vector<std::string> v;
+    argvTemplate.expand(args, v, &err);
+    return v.size();
+  });
+  run("exec/popen", iterations, "us", [&]
+  {
+    return runPopen(expandString(kCommand, args));
+  });
+  run("exec/spawn", iterations, "us", [&]
+  {
+    std::vector<std::string> v;
+    argvTemplate.expand(args, v, &err);
+    return runSpawn(v);
+  });
+
+  cJSON_Delete(args);
+  return 0;
+}
@@ -0,0 +1,250 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Drives WiFiService scan and connect end to end against a control socket,
+// normally the one from fake_wpa_supplicant, and reports how long each
+// call took.
+
+#include "../defs.h"
+#include "../jsonrpc.h"
+#include "../rpclogger.h"
+#include "../rpcserver.h"
+#include "../services/wifiservice.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <cJSON.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+  // requests whose deferred response has come in, by id
+  std::mutex doneMutex;
+  std::condition_variable doneCond;
+  std::set<int> done;
+
+  void
+  onNotify(cJSON const* json, std::atomic<int>& notifications)
+  {
+    notifications++;
+
+    cJSON const* id = cJSON_GetObjectItem(json, "id");
+    cJSON const* status = cJSON_GetObjectItem(cJSON_GetObjectItem(json, "result"), "status");
+    if (!id || !status || !status->valuestring || strcmp(status->valuestring, "scan-done") != 0)
+      return;
+
+    std::lock_guard<std::mutex> guard(doneMutex);
+    done.insert(id->valueint);
+    doneCond.notify_all();
+  }
+
+  bool
+  waitForDone(int id)
+  {
+    std::unique_lock<std::mutex> guard(doneMutex);
+    return doneCond.wait_for(guard, std::chrono::seconds(120),
+      [id] { return done.count(id) > 0; });
+  }
+  struct Timing
+  {
+    std::string         Name;
+    std::vector<double> Samples;
+    int                 Errors = 0;
+  };
+
+  cJSON*
+  makeRequest(char const* method, int id, cJSON* params)
+  {
+    cJSON* req = cJSON_CreateObject();
+    cJSON_AddStringToObject(req, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(req, "method", method);
+    cJSON_AddNumberToObject(req, "id", id);
+    cJSON_AddItemToObject(req, "params", params);
+    return req;
+  }
+
+  void
+  invoke(WiFiService& wifi, char const* method, cJSON* req, Timing& timing)
+  {
+    auto start = std::chrono::steady_clock::now();
+    cJSON* res = wifi.invokeMethod(method, req);
+
+    // a scan that has to wait for the radio is answered later
+    bool ok = res && !cJSON_GetObjectItem(res, "code");
+    if (res == JsonRpc::deferred())
+    {
+      ok = waitForDone(JsonRpc::getInt(req, "id", true));
+      res = nullptr;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    timing.Samples.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    if (!ok)
+      timing.Errors++;
+
+    if (res)
+      cJSON_Delete(res);
+    cJSON_Delete(req);
+  }
+
+  void
+  printTiming(Timing const& timing)
+  {
+    if (timing.Samples.empty())
+      return;
+
+    double total = 0;
+    for (double d : timing.Samples)
+      total += d;
+
+    printf("%-10s n=%-4d errors=%-3d min=%8.3fms avg=%8.3fms max=%8.3fms\n",
+      timing.Name.c_str(),
+      static_cast<int>(timing.Samples.size()),
+      timing.Errors,
+      *std::min_element(timing.Samples.begin(), timing.Samples.end()),
+      total / timing.Samples.size(),
+      *std::max_element(timing.Samples.begin(), timing.Samples.end()));
+  }
+}
+
+void
+printHelp()
+{
+  printf("\n");
+  printf("bench_wifi [args]\n");
+  printf("\t-p  --path       <file> Control socket path\n");
+  printf("\t-i  --iterations <n>    Number of times to run each method\n");
+  printf("\t-s  --ssid       <ssid> Network to connect to\n");
+  printf("\t-m  --max-age    <sec>  max-age param for scan, -1 always scans\n");
+  printf("\t-d  --debug             Enable debug logging\n");
+  printf("\t-h  --help              Print this help and exit\n");
+  exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+  std::string path = "/tmp/wpa_supplicant/wlan0";
+  std::string ssid = "ap-1";
+  int iterations = 10;
+  int maxAge = -1;
+
+  RpcLogger::logger().setLevel(RpcLogLevel::Warning);
+
+  while (true)
+  {
+    static struct option longOptions[] =
+    {
+      { "path",       required_argument, 0, 'p' },
+      { "iterations", required_argument, 0, 'i' },
+      { "ssid",       required_argument, 0, 's' },
+      { "max-age",    required_argument, 0, 'm' },
+      { "debug",      no_argument, 0, 'd' },
+      { "help",       no_argument, 0, 'h' },
+      { 0, 0, 0, 0 }
+    };
+
+    int optionIndex = 0;
+    int c = getopt_long(argc, argv, "p:i:s:m:dh", longOptions, &optionIndex);
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+      case 'p':
+        path = optarg;
+        break;
+      case 'i':
+        iterations = atoi(optarg);
+        break;
+      case 's':
+        ssid = optarg;
+        break;
+      case 'm':
+        maxAge = atoi(optarg);
+        break;
+      case 'd':
+        RpcLogger::logger().setLevel(RpcLogLevel::Debug);
+        break;
+      case 'h':
+        printHelp();
+        break;
+      default:
+        break;
+    }
+  }
+
+  cJSON* conf = cJSON_CreateObject();
+  cJSON* settings = cJSON_CreateObject();
+  cJSON_AddStringToObject(settings, "interface", path.c_str());
+  cJSON_AddItemToObject(conf, "settings", settings);
+
+  // partial responses from scan are counted, not sent anywhere
+  std::atomic<int> notifications(0);
+
+  RpcNotifier notifier;
+  notifier.IsSubscribed = [](std::string const& UNUSED_PARAM(topic)) { return false; };
+  notifier.Publish = [](std::string const& UNUSED_PARAM(topic), cJSON const* UNUSED_PARAM(params)) { };
+  notifier.Notify = [&notifications](cJSON const* json) { onNotify(json, notifications); };
+
+  WiFiService wifi;
+  wifi.init(conf, notifier);
+  cJSON_Delete(conf);
+
+  Timing scan;
+  scan.Name = "scan";
+  for (int i = 0; i < iterations; ++i)
+  {
+    cJSON* params = cJSON_CreateObject();
+    cJSON_AddNumberToObject(params, "max-age", maxAge);
+    invoke(wifi, "scan", makeRequest("wifi-scan", i, params), scan);
+  }
+
+  Timing connect;
+  connect.Name = "connect";
+  for (int i = 0; i < iterations; ++i)
+  {
+    cJSON* params = cJSON_CreateObject();
+    cJSON* discovery = cJSON_CreateObject();
+    cJSON_AddStringToObject(discovery, "ssid", ssid.c_str());
+    cJSON_AddItemToObject(params, "discovery", discovery);
+    cJSON* cred = cJSON_CreateObject();
+    cJSON_AddStringToObject(cred, "pass", "password");
+    cJSON_AddItemToObject(params, "cred", cred);
+    invoke(wifi, "connect", makeRequest("wifi-connect", i, params), connect);
+  }
+
+  Timing status;
+  status.Name = "get-status";
+  for (int i = 0; i < iterations; ++i)
+    invoke(wifi, "get-status", makeRequest("wifi-get-status", i, cJSON_CreateObject()), status);
+
+  printTiming(scan);
+  printTiming(connect);
+  printTiming(status);
+  printf("notifications:%d\n", notifications.load());
+
+  return 0;
+}
@@ -0,0 +1,168 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Times the supplicant reply parser against the substr based splitting it
+// replaced, on captured STATUS and BSS replies.
+
+#include "../services/wpaparser.h"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace
+{
+  char const kStatus[] =
+    "bssid=a0:63:91:2b:7e:4d\n"
+    "freq=5180\n"
+    "ssid=home-5g\n"
+    "id=0\n"
+    "mode=station\n"
+    "pairwise_cipher=CCMP\n"
+    "group_cipher=CCMP\n"
+    "key_mgmt=WPA2-PSK\n"
+    "wpa_state=COMPLETED\n"
+    "ip_address=192.168.1.117\n"
+    "p2p_device_address=b8:27:eb:3c:51:0a\n"
+    "address=b8:27:eb:3c:51:0a\n"
+    "uuid=9c0f3a1e-0d1b-5b8e-8e2c-4b5a7d1c2e3f\n";
+
+  char const kBss[] =
+    "id=41\n"
+    "bssid=a0:63:91:2b:7e:4d\n"
+    "freq=5180\n"
+    "beacon_int=100\n"
+    "capabilities=0x0011\n"
+    "qual=0\n"
+    "noise=-89\n"
+    "level=-47\n"
+    "tsf=0000012345678901\n"
+    "age=3\n"
+    "ie=0007686f6d652d3567010882848b960c12182432043048606c\n"
+    "flags=[WPA2-PSK-CCMP][ESS]\n"
+    "ssid=home-5g\n"
+    "====\n";
+
+  // what wpaControl_createResponse and wpaControl_getState used to do
+  size_t
+  substrFields(std::string const& s)
+  {
+    size_t n = 0;
+    size_t begin = 0;
+    while (true)
+    {
+      size_t end = s.find('\n', begin);
+      if (end == std::string::npos)
+        break;
+
+      std::string line(s.substr(begin, (end - begin)));
+      size_t mid = line.find('=');
+      if (mid != std::string::npos)
+      {
+        std::string name(line.substr(0, mid));
+        std::string value(line.substr(mid + 1));
+        n += name.size() + value.size();
+      }
+
+      begin = end + 1;
+    }
+    return n;
+  }
+
+  std::string
+  substrState(std::string const& res)
+  {
+    std::string::size_type begin = 0;
+    std::string::size_type end = 0;
+
+    while (true)
+    {
+      if (res.compare(begin, 10, "wpa_state=") == 0)
+      {
+        begin += 10;
+        return res.substr(begin, (res.find('\n', begin) - begin));
+      }
+
+      end = res.find('\n', begin + 1);
+      if (end == std::string::npos)
+        break;
+
+      begin = end + 1;
+    }
+
+    return std::string();
+  }
+
+  size_t
+  spanFields(std::string const& s)
+  {
+    size_t n = 0;
+    wpaForEachField(s.c_str(), s.size(), [&n](WpaField const& f) -> bool
+    {
+      if (f.HasValue)
+        n += f.Name.Size + f.Value.Size;
+      return true;
+    });
+    return n;
+  }
+
+  std::string
+  spanState(std::string const& s)
+  {
+    WpaStatus status;
+    wpaParseStatus(s.c_str(), s.size(), status);
+    return status.State;
+  }
+
+  volatile size_t sink;
+
+  void
+  run(char const* name, int iterations, std::function<size_t ()> const& fn)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+      sink = fn();
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf("%-16s %10.1f ns/op\n", name, ns / iterations);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = 200000;
+  if (argc > 1)
+    iterations = atoi(argv[1]);
+
+  std::string status(kStatus);
+  std::string bss;
+  for (int i = 0; i < 32; ++i)
+    bss += kBss;
+
+  run("status/substr", iterations, [&] { return substrFields(status); });
+  run("status/span", iterations, [&] { return spanFields(status); });
+  run("state/substr", iterations, [&] { return substrState(status).size(); });
+  run("state/span", iterations, [&] { return spanState(status).size(); });
+  run("bss/substr", iterations / 32, [&] { return substrFields(bss); });
+  run("bss/span", iterations / 32, [&] { return spanFields(bss); });
+
+  return 0;
+}
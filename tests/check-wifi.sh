@@ -0,0 +1,13 @@
+#!/bin/sh
+#
+# Runs check_wifi against fake_wpa_supplicant and exits with its status.
+#
+BIN=${BIN:-.}
+SOCK=${SOCK:-/tmp/bleconfd-check/wlan0}
+
+$BIN/fake_wpa_supplicant -p $SOCK 2>/dev/null &
+FAKE_PID=$!
+trap 'kill $FAKE_PID 2>/dev/null' EXIT
+
+sleep 1
+$BIN/check_wifi -p $SOCK
@@ -0,0 +1,345 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Checks net-get-dns against a fixture resolv.conf, and net-probe's
+// endpoint check against listeners on the loopback: one that accepts,
+// one that's gone and one that never answers. Exits with 1 if any case
+// fails.
+
+#include "../defs.h"
+#include "../jsonrpc.h"
+#include "../rpclogger.h"
+#include "../rpcserver.h"
+#include "../services/netservice.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cJSON.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace
+{
+  // responses the service sent later through Notify, by request id
+  std::mutex notifyMutex;
+  std::condition_variable notifyCond;
+  std::map<int, cJSON*> responses;
+  std::map<int, int> partials;
+
+  void
+  onNotify(cJSON const* json)
+  {
+    cJSON const* id = cJSON_GetObjectItem(json, "id");
+    cJSON const* result = cJSON_GetObjectItem(json, "result");
+    if (!id || !result)
+      return;
+
+    std::lock_guard<std::mutex> guard(notifyMutex);
+    if (cJSON_GetObjectItem(result, "checks"))
+      responses[id->valueint] = cJSON_Duplicate(result, true);
+    else
+      partials[id->valueint]++;
+    notifyCond.notify_all();
+  }
+
+  // waits for the response to request id. the caller deletes it
+  cJSON*
+  waitForResponse(int id, int seconds)
+  {
+    std::unique_lock<std::mutex> guard(notifyMutex);
+    notifyCond.wait_for(guard, std::chrono::seconds(seconds),
+      [id] { return responses.count(id) > 0; });
+
+    auto itr = responses.find(id);
+    if (itr == responses.end())
+      return nullptr;
+    cJSON* res = itr->second;
+    responses.erase(itr);
+    return res;
+  }
+
+  int
+  partialCount(int id)
+  {
+    std::lock_guard<std::mutex> guard(notifyMutex);
+    return partials[id];
+  }
+
+  cJSON*
+  invoke(NetService& net, char const* method, int id, cJSON* params)
+  {
+    cJSON* req = cJSON_CreateObject();
+    cJSON_AddStringToObject(req, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(req, "method", (std::string("net-") + method).c_str());
+    cJSON_AddNumberToObject(req, "id", id);
+    cJSON_AddItemToObject(req, "params", params ? params : cJSON_CreateObject());
+
+    cJSON* res = net.invokeMethod(method, req);
+    cJSON_Delete(req);
+    return res;
+  }
+
+  // a loopback listener on a port of its own. with a backlog of 0 and one
+  // connection waiting to be accepted, the next connect is never answered
+  int
+  listenOnLoopback(int* port, bool full)
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t n = sizeof(addr);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(fd, full ? 0 : 4) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &n) != 0)
+    {
+      printf("failed to listen on the loopback. %s\n", strerror(errno));
+      exit(1);
+    }
+    *port = ntohs(addr.sin_port);
+
+    if (full)
+    {
+      int client = socket(AF_INET, SOCK_STREAM, 0);
+      if (connect(client, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+      {
+        printf("failed to fill the backlog. %s\n", strerror(errno));
+        exit(1);
+      }
+      // closed along with the process
+    }
+    return fd;
+  }
+
+  bool
+  sameStrings(cJSON const* array, std::vector<std::string> const& expected)
+  {
+    if (!array || cJSON_GetArraySize(array) != static_cast<int>(expected.size()))
+      return false;
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+      cJSON const* item = cJSON_GetArrayItem(array, i);
+      if (!item->valuestring || expected[i] != item->valuestring)
+        return false;
+    }
+    return true;
+  }
+
+  int
+  checkDns(NetService& net)
+  {
+    cJSON* res = invoke(net, "get-dns", 1, nullptr);
+
+    int failed = 0;
+    if (!sameStrings(cJSON_GetObjectItem(res, "nameservers"), { "192.168.1.1", "2001:db8::53" }))
+    {
+      printf("FAIL get-dns: wrong nameservers\n");
+      failed = 1;
+    }
+
+    // the last search or domain line wins
+    if (!sameStrings(cJSON_GetObjectItem(res, "search"), { "lan", "example.com" }))
+    {
+      printf("FAIL get-dns: wrong search domains\n");
+      failed = 1;
+    }
+
+    if (!failed)
+      printf("ok   get-dns from resolv-conf\n");
+    cJSON_Delete(res);
+    return failed;
+  }
+
+  // probes port on the loopback and compares the endpoint check against
+  // what's expected. the probe has to answer within seconds
+  int
+  checkProbe(NetService& net, char const* name, int id, int port, int timeout, int error,
+    int seconds)
+  {
+    cJSON* params = cJSON_CreateObject();
+    cJSON_AddStringToObject(params, "host", "127.0.0.1");
+    cJSON_AddNumberToObject(params, "port", port);
+    cJSON_AddNumberToObject(params, "timeout", timeout);
+
+    cJSON* res = invoke(net, "probe", id, params);
+    if (res != JsonRpc::deferred())
+    {
+      printf("FAIL %s: answered in place\n", name);
+      if (res)
+        cJSON_Delete(res);
+      return 1;
+    }
+
+    // another probe has to wait for this one
+    if (error == ETIMEDOUT)
+    {
+      cJSON* busy = invoke(net, "probe", id + 1, nullptr);
+      cJSON const* code = cJSON_GetObjectItem(busy, "code");
+      if (busy == JsonRpc::deferred() || !code || code->valueint != EBUSY)
+      {
+        printf("FAIL %s: second probe wasn't refused\n", name);
+        if (busy != JsonRpc::deferred())
+          cJSON_Delete(busy);
+        waitForResponse(id + 1, seconds);
+        return 1;
+      }
+      cJSON_Delete(busy);
+    }
+
+    res = waitForResponse(id, seconds);
+    if (!res)
+    {
+      printf("FAIL %s: never answered\n", name);
+      return 1;
+    }
+
+    cJSON const* endpoint = nullptr;
+    cJSON const* checks = cJSON_GetObjectItem(res, "checks");
+    for (int i = 0, n = cJSON_GetArraySize(checks); i < n; ++i)
+    {
+      cJSON const* check = cJSON_GetArrayItem(checks, i);
+      cJSON const* kind = cJSON_GetObjectItem(check, "check");
+      if (kind && kind->valuestring && strcmp(kind->valuestring, "endpoint") == 0)
+        endpoint = check;
+    }
+
+    char target[64];
+    snprintf(target, sizeof(target), "127.0.0.1:%d", port);
+
+    int failed = 0;
+    cJSON const* item = endpoint ? cJSON_GetObjectItem(endpoint, "target") : nullptr;
+    cJSON const* code = endpoint ? cJSON_GetObjectItem(endpoint, "error") : nullptr;
+    if (!endpoint)
+    {
+      printf("FAIL %s: no endpoint check\n", name);
+      failed = 1;
+    }
+    else if (!item || !item->valuestring || strcmp(item->valuestring, target) != 0)
+    {
+      printf("FAIL %s: endpoint target isn't %s\n", name, target);
+      failed = 1;
+    }
+    else if ((code ? code->valueint : 0) != error)
+    {
+      printf("FAIL %s: endpoint error %d, expected %d\n", name, code ? code->valueint : 0, error);
+      failed = 1;
+    }
+    else if (partialCount(id) < 1)
+    {
+      printf("FAIL %s: no partial results\n", name);
+      failed = 1;
+    }
+
+    if (!failed)
+      printf("ok   %s\n", name);
+    cJSON_Delete(res);
+    return failed;
+  }
+}
+
+void
+printHelp()
+{
+  printf("\n");
+  printf("check_net [args]\n");
+  printf("\t-r  --resolv-conf <file> Fixture for net-get-dns\n");
+  printf("\t-d  --debug              Enable debug logging\n");
+  printf("\t-h  --help               Print this help and exit\n");
+  exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+  std::string resolvConf = "tests/resolv.conf";
+
+  RpcLogger::logger().setLevel(RpcLogLevel::Critical);
+
+  while (true)
+  {
+    static struct option longOptions[] =
+    {
+      { "resolv-conf", required_argument, 0, 'r' },
+      { "debug",       no_argument, 0, 'd' },
+      { "help",        no_argument, 0, 'h' },
+      { 0, 0, 0, 0 }
+    };
+
+    int optionIndex = 0;
+    int c = getopt_long(argc, argv, "r:dh", longOptions, &optionIndex);
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+      case 'r':
+        resolvConf = optarg;
+        break;
+      case 'd':
+        RpcLogger::logger().setLevel(RpcLogLevel::Debug);
+        break;
+      case 'h':
+        printHelp();
+        break;
+      default:
+        break;
+    }
+  }
+
+  cJSON* conf = cJSON_CreateObject();
+  cJSON* settings = cJSON_CreateObject();
+  cJSON_AddStringToObject(settings, "resolv-conf", resolvConf.c_str());
+  cJSON_AddItemToObject(conf, "settings", settings);
+
+  RpcNotifier notifier;
+  notifier.IsSubscribed = [](std::string const& UNUSED_PARAM(topic)) { return false; };
+  notifier.Publish = [](std::string const& UNUSED_PARAM(topic), cJSON const* UNUSED_PARAM(params)) { };
+  notifier.Notify = &onNotify;
+
+  NetService net;
+  net.init(conf, notifier);
+  cJSON_Delete(conf);
+
+  int failed = checkDns(net);
+
+  int port = 0;
+  int fd = listenOnLoopback(&port, false);
+  failed += checkProbe(net, "probe endpoint up", 10, port, 2000, 0, 5);
+
+  close(fd);
+  failed += checkProbe(net, "probe endpoint gone", 20, port, 2000, ECONNREFUSED, 5);
+
+  // the timeout asked for is far past the limit, so the probe gives up
+  // at the limit instead
+  fd = listenOnLoopback(&port, true);
+  failed += checkProbe(net, "probe timeout is capped", 30, port, 600000, ETIMEDOUT, 15);
+  close(fd);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,436 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Checks the commands WiFiService sends fake_wpa_supplicant for
+// wifi-connect, exactly, and that a command the supplicant rejects stops
+// the connect where it should. Also checks that a wifi-get-status waiting
+// for a change and a wifi-scan waiting for results return at once and are
+// answered later. Exits with 1 if any case fails.
+
+#include "../defs.h"
+#include "../jsonrpc.h"
+#include "../rpclogger.h"
+#include "../rpcserver.h"
+#include "../services/wifiservice.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cJSON.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wpa_ctrl.h>
+
+namespace
+{
+  using Counts = std::map<std::string, int>;
+
+  // the commands a connect is allowed to send. the rest come from the
+  // service's own status and scan refreshes, whenever they like
+  char const* const kConnectCommands[] = { "LIST_NETWORKS", "ADD_NETWORK", "REMOVE_NETWORK",
+    "SET_NETWORK", "SELECT_NETWORK", "SAVE_CONFIG" };
+
+  struct wpa_ctrl* control = nullptr;
+
+  // responses the service sent later through Notify, by request id
+  std::mutex notifyMutex;
+  std::condition_variable notifyCond;
+  std::map<int, int> notifiedVersions;
+  std::map<int, bool> scansDone;
+
+  std::string
+  request(char const* cmd)
+  {
+    char buff[4096];
+    size_t n = sizeof(buff) - 1;
+    if (wpa_ctrl_request(control, cmd, strlen(cmd), buff, &n, nullptr) != 0)
+      return std::string();
+    return std::string(buff, n);
+  }
+
+  Counts
+  takeCounts()
+  {
+    Counts counts;
+    std::string s = request("TEST_COUNT");
+    for (size_t begin = 0; begin < s.size();)
+    {
+      size_t end = s.find('\n', begin);
+      if (end == std::string::npos)
+        end = s.size();
+
+      size_t eq = s.find('=', begin);
+      if (eq != std::string::npos && eq < end)
+        counts[s.substr(begin, eq - begin)] = atoi(s.c_str() + eq + 1);
+      begin = end + 1;
+    }
+    return counts;
+  }
+
+  bool
+  connect(WiFiService& wifi, char const* ssid)
+  {
+    cJSON* req = cJSON_CreateObject();
+    cJSON_AddStringToObject(req, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(req, "method", "wifi-connect");
+    cJSON_AddNumberToObject(req, "id", 1);
+    cJSON* params = cJSON_CreateObject();
+    cJSON* discovery = cJSON_CreateObject();
+    cJSON_AddStringToObject(discovery, "ssid", ssid);
+    cJSON_AddItemToObject(params, "discovery", discovery);
+    cJSON* cred = cJSON_CreateObject();
+    cJSON_AddStringToObject(cred, "pass", "password");
+    cJSON_AddItemToObject(params, "cred", cred);
+    cJSON_AddItemToObject(req, "params", params);
+
+    cJSON* res = wifi.invokeMethod("connect", req);
+    bool ok = res && !cJSON_GetObjectItem(res, "code");
+    if (res)
+      cJSON_Delete(res);
+    cJSON_Delete(req);
+    return ok;
+  }
+
+  cJSON*
+  getStatus(WiFiService& wifi, int id, int version, int timeout)
+  {
+    cJSON* req = cJSON_CreateObject();
+    cJSON_AddStringToObject(req, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(req, "method", "wifi-get-status");
+    cJSON_AddNumberToObject(req, "id", id);
+    cJSON* params = cJSON_CreateObject();
+    if (version >= 0)
+    {
+      cJSON_AddNumberToObject(params, "version", version);
+      cJSON_AddNumberToObject(params, "timeout", timeout);
+    }
+    cJSON_AddItemToObject(req, "params", params);
+
+    cJSON* res = wifi.invokeMethod("get-status", req);
+    cJSON_Delete(req);
+    return res;
+  }
+
+  void
+  onNotify(cJSON const* json)
+  {
+    cJSON const* id = cJSON_GetObjectItem(json, "id");
+    cJSON const* result = cJSON_GetObjectItem(json, "result");
+    if (!id || !result)
+      return;
+
+    cJSON const* version = cJSON_GetObjectItem(result, "version");
+    cJSON const* status = cJSON_GetObjectItem(result, "status");
+
+    std::lock_guard<std::mutex> guard(notifyMutex);
+    if (version)
+      notifiedVersions[id->valueint] = version->valueint;
+    else if (status && status->valuestring && strcmp(status->valuestring, "scan-done") == 0)
+      scansDone[id->valueint] = cJSON_GetObjectItem(result, "cached")->type == cJSON_True;
+    notifyCond.notify_all();
+  }
+
+  // waits for the response to request id, and returns its version or -1
+  int
+  waitForResponse(int id, int seconds)
+  {
+    std::unique_lock<std::mutex> guard(notifyMutex);
+    notifyCond.wait_for(guard, std::chrono::seconds(seconds),
+      [id] { return notifiedVersions.count(id) > 0; });
+    auto itr = notifiedVersions.find(id);
+    return itr != notifiedVersions.end() ? itr->second : -1;
+  }
+
+  cJSON*
+  scan(WiFiService& wifi, int id, cJSON* params)
+  {
+    cJSON* req = cJSON_CreateObject();
+    cJSON_AddStringToObject(req, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(req, "method", "wifi-scan");
+    cJSON_AddNumberToObject(req, "id", id);
+    cJSON_AddItemToObject(req, "params", params);
+
+    cJSON* res = wifi.invokeMethod("scan", req);
+    cJSON_Delete(req);
+    return res;
+  }
+
+  // a scan that has to wait for the radio must not hold up the caller,
+  // and is answered once the results are in. one asked for with a max-age
+  // right after is answered in place from the cache. a list of interfaces
+  // with something other than a name in it is refused
+  int
+  checkScan(WiFiService& wifi)
+  {
+    cJSON* params = cJSON_CreateObject();
+    cJSON_AddNumberToObject(params, "timeout", 3600);
+    auto start = std::chrono::steady_clock::now();
+    cJSON* res = scan(wifi, 200, params);
+    auto took = std::chrono::steady_clock::now() - start;
+    if (res != JsonRpc::deferred() || took > std::chrono::milliseconds(500))
+    {
+      printf("FAIL scan: answered in place\n");
+      if (res != JsonRpc::deferred())
+        cJSON_Delete(res);
+      return 1;
+    }
+
+    {
+      std::unique_lock<std::mutex> guard(notifyMutex);
+      notifyCond.wait_for(guard, std::chrono::seconds(5), [] { return scansDone.count(200) > 0; });
+      if (!scansDone.count(200) || scansDone[200])
+      {
+        printf("FAIL scan: %s\n", scansDone.count(200) ? "answered from the cache" : "never answered");
+        return 1;
+      }
+    }
+    printf("ok   scan waits for results\n");
+
+    params = cJSON_CreateObject();
+    cJSON_AddNumberToObject(params, "max-age", 60);
+    res = scan(wifi, 201, params);
+    cJSON const* cached = res != JsonRpc::deferred() ? cJSON_GetObjectItem(res, "cached") : nullptr;
+    if (!cached || cached->type != cJSON_True)
+    {
+      printf("FAIL scan max-age: not answered from the cache\n");
+      if (res != JsonRpc::deferred())
+        cJSON_Delete(res);
+      return 1;
+    }
+    cJSON_Delete(res);
+    printf("ok   scan max-age\n");
+
+    params = cJSON_CreateObject();
+    cJSON* names = cJSON_CreateArray();
+    cJSON_AddItemToArray(names, cJSON_CreateNumber(1));
+    cJSON_AddItemToObject(params, "interface", names);
+    res = scan(wifi, 202, params);
+    cJSON const* code = res != JsonRpc::deferred() ? cJSON_GetObjectItem(res, "code") : nullptr;
+    if (!code || code->valueint != EINVAL)
+    {
+      printf("FAIL scan interface list: not refused\n");
+      if (res != JsonRpc::deferred())
+        cJSON_Delete(res);
+      return 1;
+    }
+    cJSON_Delete(res);
+    printf("ok   scan interface list\n");
+    return 0;
+  }
+
+  // a get-status that waits for a change must not hold up the caller. it
+  // should be answered when a connect changes the status, and again with
+  // the same version when the wait times out
+  int
+  checkStatusWait(WiFiService& wifi)
+  {
+    cJSON* res = getStatus(wifi, 100, -1, 0);
+    cJSON const* item = cJSON_GetObjectItem(res, "version");
+    int version = item ? item->valueint : -1;
+    cJSON_Delete(res);
+    if (version < 0)
+    {
+      printf("FAIL get-status: no version\n");
+      return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    res = getStatus(wifi, 101, version, 5);
+    auto took = std::chrono::steady_clock::now() - start;
+    if (res != JsonRpc::deferred() || took > std::chrono::milliseconds(500))
+    {
+      printf("FAIL get-status wait: answered in place\n");
+      if (res != JsonRpc::deferred())
+        cJSON_Delete(res);
+      return 1;
+    }
+
+    connect(wifi, "ap-3");
+    int changed = waitForResponse(101, 3);
+    if (changed <= version)
+    {
+      printf("FAIL get-status wait: %s\n", changed < 0 ? "never answered" : "answered unchanged");
+      return 1;
+    }
+    printf("ok   get-status wait for a change\n");
+
+    res = getStatus(wifi, 102, changed, 1);
+    if (res != JsonRpc::deferred())
+    {
+      printf("FAIL get-status timeout: answered in place\n");
+      cJSON_Delete(res);
+      return 1;
+    }
+
+    // the status can still move on after the connect, so this only
+    // checks that the wait ends
+    if (waitForResponse(102, 3) < 0)
+    {
+      printf("FAIL get-status timeout: never answered\n");
+      return 1;
+    }
+    printf("ok   get-status wait times out\n");
+    return 0;
+  }
+
+  // connects to ssid, with fail armed in the supplicant first if there
+  // is one, and compares what was sent against expected
+  int
+  check(WiFiService& wifi, char const* name, char const* ssid, char const* fail,
+    bool succeeds, Counts const& expected)
+  {
+    takeCounts();
+    if (fail)
+    {
+      std::string cmd = std::string("TEST_FAIL ") + fail;
+      request(cmd.c_str());
+    }
+
+    bool ok = connect(wifi, ssid);
+    Counts counts = takeCounts();
+
+    int failed = 0;
+    if (ok != succeeds)
+    {
+      printf("FAIL %s: connect %s\n", name, ok ? "succeeded" : "failed");
+      failed = 1;
+    }
+
+    for (char const* cmd : kConnectCommands)
+    {
+      auto want = expected.find(cmd);
+      int n = want != expected.end() ? want->second : 0;
+      if (counts[cmd] != n)
+      {
+        printf("FAIL %s: %s sent %d times, expected %d\n", name, cmd, counts[cmd], n);
+        failed = 1;
+      }
+    }
+
+    if (!failed)
+      printf("ok   %s\n", name);
+    return failed;
+  }
+}
+
+void
+printHelp()
+{
+  printf("\n");
+  printf("check_wifi [args]\n");
+  printf("\t-p  --path       <file> Control socket of fake_wpa_supplicant\n");
+  printf("\t-d  --debug             Enable debug logging\n");
+  printf("\t-h  --help              Print this help and exit\n");
+  exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+  std::string path = "/tmp/wpa_supplicant/wlan0";
+
+  RpcLogger::logger().setLevel(RpcLogLevel::Critical);
+
+  while (true)
+  {
+    static struct option longOptions[] =
+    {
+      { "path",       required_argument, 0, 'p' },
+      { "debug",      no_argument, 0, 'd' },
+      { "help",       no_argument, 0, 'h' },
+      { 0, 0, 0, 0 }
+    };
+
+    int optionIndex = 0;
+    int c = getopt_long(argc, argv, "p:dh", longOptions, &optionIndex);
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+      case 'p':
+        path = optarg;
+        break;
+      case 'd':
+        RpcLogger::logger().setLevel(RpcLogLevel::Debug);
+        break;
+      case 'h':
+        printHelp();
+        break;
+      default:
+        break;
+    }
+  }
+
+  control = wpa_ctrl_open(path.c_str());
+  if (!control)
+  {
+    printf("failed to open %s\n", path.c_str());
+    return 1;
+  }
+
+  cJSON* conf = cJSON_CreateObject();
+  cJSON* settings = cJSON_CreateObject();
+  cJSON_AddStringToObject(settings, "interface", path.c_str());
+  cJSON_AddItemToObject(conf, "settings", settings);
+
+  RpcNotifier notifier;
+  notifier.IsSubscribed = [](std::string const& UNUSED_PARAM(topic)) { return false; };
+  notifier.Publish = [](std::string const& UNUSED_PARAM(topic), cJSON const* UNUSED_PARAM(params)) { };
+  notifier.Notify = &onNotify;
+
+  WiFiService wifi;
+  wifi.init(conf, notifier);
+  cJSON_Delete(conf);
+
+  int failed = 0;
+
+  // the first connect loads the configured networks, after that a known
+  // ssid is found without asking the supplicant
+  failed += check(wifi, "new network", "ap-1", nullptr, true,
+    { { "LIST_NETWORKS", 1 }, { "ADD_NETWORK", 1 }, { "SET_NETWORK", 2 },
+      { "SELECT_NETWORK", 1 }, { "SAVE_CONFIG", 1 } });
+
+  failed += check(wifi, "known network", "ap-1", nullptr, true,
+    { { "SET_NETWORK", 2 }, { "SELECT_NETWORK", 1 }, { "SAVE_CONFIG", 1 } });
+
+  // a rejected psk must not leave the network selected or saved, and a
+  // network made for the connect is removed again
+  failed += check(wifi, "new network, psk rejected", "ap-2", "SET_NETWORK psk", false,
+    { { "ADD_NETWORK", 1 }, { "SET_NETWORK", 2 }, { "REMOVE_NETWORK", 1 } });
+
+  failed += check(wifi, "new network after a rejected one", "ap-2", nullptr, true,
+    { { "ADD_NETWORK", 1 }, { "SET_NETWORK", 2 }, { "SELECT_NETWORK", 1 },
+      { "SAVE_CONFIG", 1 } });
+
+  failed += check(wifi, "known network, psk rejected", "ap-1", "SET_NETWORK psk", false,
+    { { "SET_NETWORK", 2 } });
+
+  failed += check(wifi, "known network, ssid rejected", "ap-1", "SET_NETWORK ssid", false,
+    { { "SET_NETWORK", 2 } });
+
+  failed += checkStatusWait(wifi);
+  failed += checkScan(wifi);
+
+  wpa_ctrl_close(control);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,769 @@
+//
+// Copyright [2018] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Stand-in for the wpa_supplicant control interface. It speaks the subset
+// of commands WiFiService uses over the same unix datagram socket, with a
+// configurable number of access points and injected per-command latency,
+// so the service can be exercised and timed without a radio.
+//
+// Two commands of its own let a test drive it. Neither is counted.
+//   TEST_FAIL <command> [<name>]  the next matching command replies FAIL,
+//                                 e.g. TEST_FAIL SET_NETWORK psk
+//   TEST_COUNT                    per-command counts since the last
+//                                 TEST_COUNT, as NAME=n lines
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  // same values as WPA_BSS_MASK_* in wpa_ctrl.h
+  uint32_t const kMaskId      = 0x00001;
+  uint32_t const kMaskBssid   = 0x00002;
+  uint32_t const kMaskFreq    = 0x00004;
+  uint32_t const kMaskLevel   = 0x00080;
+  uint32_t const kMaskFlags   = 0x00800;
+  uint32_t const kMaskSsid    = 0x01000;
+  uint32_t const kMaskDelim   = 0x20000;
+  uint32_t const kMaskAll     = 0xffffffff & ~kMaskDelim;
+
+  // wpa_supplicant's control interface reply buffer
+  size_t const kMaxReply = 4096;
+
+  struct Bss
+  {
+    int         Id;
+    std::string Bssid;
+    int         Freq;
+    int         Level;
+    std::string Flags;
+    std::string Ssid;
+  };
+
+  struct Network
+  {
+    std::string Ssid;
+    std::string Psk;
+    bool        Disabled;
+  };
+
+  struct TimedAction
+  {
+    Clock::time_point     Deadline;
+    std::function<void()> Action;
+  };
+
+  struct Options
+  {
+    std::string                 Path = "/tmp/wpa_supplicant/wlan0";
+    int                         BssCount = 32;
+    int                         Networks = 0;
+    int                         ScanTime = 100;
+    int                         ConnectTime = 50;
+    int                         Latency = 0;
+    std::map<std::string, int>  CommandLatency;
+    bool                        Verbose = false;
+  };
+
+  volatile sig_atomic_t running = 1;
+
+  void
+  onSignal(int)
+  {
+    running = 0;
+  }
+
+  std::string
+  format(char const* fmt, ...)
+  {
+    char buff[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buff, sizeof(buff), fmt, args);
+    va_end(args);
+    return std::string(buff);
+  }
+
+  std::string
+  unquote(std::string const& s)
+  {
+    if (s.size() >= 2 && s.front() == '"' && s.back() == '"')
+      return s.substr(1, s.size() - 2);
+    return s;
+  }
+
+  std::vector<std::string>
+  split(std::string const& s, size_t maxParts)
+  {
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    while (begin < s.size())
+    {
+      if (parts.size() + 1 == maxParts)
+      {
+        parts.push_back(s.substr(begin));
+        break;
+      }
+
+      size_t end = s.find(' ', begin);
+      if (end == std::string::npos)
+        end = s.size();
+      if (end > begin)
+        parts.push_back(s.substr(begin, end - begin));
+      begin = end + 1;
+    }
+    return parts;
+  }
+}
+
+class FakeSupplicant
+{
+public:
+  FakeSupplicant(Options const& opts)
+    : m_opts(opts)
+    , m_fd(-1)
+    , m_next_network(0)
+    , m_current(-1)
+    , m_scanning(false)
+  {
+    for (int i = 0; i < m_opts.BssCount; ++i)
+    {
+      Bss bss;
+      bss.Id = i;
+      bss.Bssid = format("02:00:00:%02x:%02x:%02x", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+      bss.Freq = (i % 2) ? 5180 + 20 * (i % 8) : 2412 + 5 * (i % 11);
+      bss.Level = -30 - (i % 60);
+      bss.Flags = "[WPA2-PSK-CCMP][ESS]";
+      bss.Ssid = format("ap-%d", i);
+      m_bss.push_back(bss);
+    }
+
+    for (int i = 0; i < m_opts.Networks; ++i)
+      m_networks[m_next_network++] = Network { format("net-%d", i), "", false };
+  }
+
+  ~FakeSupplicant()
+  {
+    if (m_fd != -1)
+    {
+      close(m_fd);
+      unlink(m_opts.Path.c_str());
+    }
+  }
+
+  int open()
+  {
+    std::string dir = m_opts.Path.substr(0, m_opts.Path.rfind('/'));
+    if (!dir.empty())
+      mkdir(dir.c_str(), 0770);
+    unlink(m_opts.Path.c_str());
+
+    m_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (m_fd == -1)
+      return errno;
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, m_opts.Path.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (bind(m_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+      return errno;
+
+    return 0;
+  }
+
+  void run()
+  {
+    std::vector<char> buff(8192);
+    while (running)
+    {
+      pollfd fds;
+      fds.fd = m_fd;
+      fds.events = POLLIN;
+      fds.revents = 0;
+
+      int ret = poll(&fds, 1, runTimers());
+      if (ret == -1)
+      {
+        if (errno == EINTR)
+          continue;
+        fprintf(stderr, "poll:%s\n", strerror(errno));
+        break;
+      }
+
+      if (ret == 0)
+        continue;
+
+      sockaddr_un from;
+      socklen_t len = sizeof(from);
+      ssize_t n = recvfrom(m_fd, &buff[0], buff.size() - 1, 0,
+        reinterpret_cast<sockaddr *>(&from), &len);
+      if (n <= 0)
+        continue;
+
+      std::string cmd(&buff[0], n);
+      while (!cmd.empty() && (cmd.back() == '\n' || cmd.back() == '\r'))
+        cmd.pop_back();
+
+      std::string name = cmd.substr(0, cmd.find(' '));
+      if (name.compare(0, 5, "TEST_") != 0)
+      {
+        m_counts[name]++;
+        m_recent[name]++;
+      }
+
+      int latency = m_opts.Latency;
+      auto itr = m_opts.CommandLatency.find(name);
+      if (itr != m_opts.CommandLatency.end())
+        latency = itr->second;
+
+      // the real supplicant is single threaded, a slow command holds up
+      // everything behind it
+      if (latency > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+
+      std::string reply = dispatch(cmd, from, len);
+      if (m_opts.Verbose)
+        fprintf(stderr, "%s -> %d bytes\n", cmd.c_str(), static_cast<int>(reply.size()));
+
+      sendto(m_fd, reply.c_str(), reply.size(), 0, reinterpret_cast<sockaddr *>(&from), len);
+    }
+  }
+
+  void printStats() const
+  {
+    int total = 0;
+    for (auto const& count : m_counts)
+    {
+      fprintf(stderr, "%-16s %d\n", count.first.c_str(), count.second);
+      total += count.second;
+    }
+    fprintf(stderr, "%-16s %d\n", "total", total);
+  }
+
+private:
+  std::string dispatch(std::string const& cmd, sockaddr_un const& from, socklen_t len)
+  {
+    std::vector<std::string> argv = split(cmd, 4);
+    if (argv.empty())
+      return "UNKNOWN COMMAND\n";
+
+    std::string const& name = argv[0];
+    if (name == "TEST_FAIL")
+      return testFail(argv);
+    if (name == "TEST_COUNT")
+      return testCount();
+    if (injectFailure(argv))
+      return "FAIL\n";
+    if (name == "PING")
+      return "PONG\n";
+    if (name == "ATTACH")
+      return attach(from, len);
+    if (name == "DETACH")
+      return detach(from, len);
+    if (name == "STATUS")
+      return status();
+    if (name == "SCAN")
+      return scan();
+    if (name == "SCAN_RESULTS")
+      return scanResults();
+    if (name == "BSS")
+      return bss(argv);
+    if (name == "LIST_NETWORKS")
+      return listNetworks();
+    if (name == "ADD_NETWORK")
+      return addNetwork();
+    if (name == "REMOVE_NETWORK")
+      return removeNetwork(argv);
+    if (name == "GET_NETWORK")
+      return getNetwork(argv);
+    if (name == "SET_NETWORK")
+      return setNetwork(argv);
+    if (name == "SELECT_NETWORK")
+      return selectNetwork(argv);
+    if (name == "SAVE_CONFIG")
+      return "OK\n";
+
+    return "UNKNOWN COMMAND\n";
+  }
+
+  std::string testFail(std::vector<std::string> const& argv)
+  {
+    if (argv.size() < 2)
+      return "FAIL\n";
+    m_failures.push_back(std::make_pair(argv[1], argv.size() > 2 ? argv[2] : std::string()));
+    return "OK\n";
+  }
+
+  std::string testCount()
+  {
+    std::string s;
+    for (auto const& count : m_recent)
+      s += format("%s=%d\n", count.first.c_str(), count.second);
+    m_recent.clear();
+    return s;
+  }
+
+  // the name is the network variable for SET_NETWORK and GET_NETWORK
+  bool injectFailure(std::vector<std::string> const& argv)
+  {
+    for (auto itr = m_failures.begin(); itr != m_failures.end(); ++itr)
+    {
+      if (itr->first != argv[0])
+        continue;
+      if (!itr->second.empty() && (argv.size() < 3 || argv[2] != itr->second))
+        continue;
+
+      m_failures.erase(itr);
+      return true;
+    }
+    return false;
+  }
+
+  std::string attach(sockaddr_un const& from, socklen_t len)
+  {
+    m_monitors.push_back(std::make_pair(from, len));
+    return "OK\n";
+  }
+
+  std::string detach(sockaddr_un const& from, socklen_t len)
+  {
+    for (auto itr = m_monitors.begin(); itr != m_monitors.end(); ++itr)
+    {
+      if (itr->second == len && memcmp(&itr->first, &from, len) == 0)
+      {
+        m_monitors.erase(itr);
+        return "OK\n";
+      }
+    }
+    return "FAIL\n";
+  }
+
+  std::string status() const
+  {
+    std::string s;
+    if (m_current != -1)
+    {
+      Bss const* bss = findBss(m_networks.at(m_current).Ssid);
+      s += format("bssid=%s\n", bss ? bss->Bssid.c_str() : "02:00:00:ff:ff:ff");
+      s += format("freq=%d\n", bss ? bss->Freq : 2412);
+      s += format("ssid=%s\n", m_networks.at(m_current).Ssid.c_str());
+      s += format("id=%d\n", m_current);
+      s += "mode=station\n";
+      s += "pairwise_cipher=CCMP\n";
+      s += "group_cipher=CCMP\n";
+      s += "key_mgmt=WPA2-PSK\n";
+      s += "wpa_state=COMPLETED\n";
+      s += "ip_address=192.168.1.100\n";
+    }
+    else
+    {
+      s += "wpa_state=DISCONNECTED\n";
+    }
+    s += "address=02:00:00:00:00:01\n";
+    s += "uuid=5b1d5b5c-8a58-5e8b-9b1a-3a2f0d9e4c11\n";
+    return s;
+  }
+
+  std::string scan()
+  {
+    if (m_scanning)
+      return "FAIL-BUSY\n";
+
+    m_scanning = true;
+    sendEvent("CTRL-EVENT-SCAN-STARTED ");
+    addTimer(m_opts.ScanTime, [this] {
+      m_scanning = false;
+      sendEvent("CTRL-EVENT-SCAN-RESULTS ");
+    });
+    return "OK\n";
+  }
+
+  std::string scanResults() const
+  {
+    std::string s = "bssid / frequency / signal level / flags / ssid\n";
+    for (Bss const& bss : m_bss)
+      s += format("%s\t%d\t%d\t%s\t%s\n", bss.Bssid.c_str(), bss.Freq, bss.Level,
+        bss.Flags.c_str(), bss.Ssid.c_str());
+    return s;
+  }
+
+  // BSS <id>, BSS RANGE=<first>-[<last>] [MASK=0x...]
+  std::string bss(std::vector<std::string> const& argv) const
+  {
+    if (argv.size() < 2)
+      return "FAIL\n";
+
+    uint32_t mask = kMaskAll;
+    if (argv.size() > 2 && argv[2].compare(0, 5, "MASK=") == 0)
+      mask = static_cast<uint32_t>(strtoul(argv[2].c_str() + 5, nullptr, 16));
+
+    if (argv[1].compare(0, 6, "RANGE=") != 0)
+    {
+      int id = atoi(argv[1].c_str());
+      if (id < 0 || id >= static_cast<int>(m_bss.size()))
+        return "";
+      return bssToString(m_bss[id], mask);
+    }
+
+    char* dash = nullptr;
+    int first = static_cast<int>(strtol(argv[1].c_str() + 6, &dash, 10));
+    int last = static_cast<int>(m_bss.size()) - 1;
+    if (dash && *dash == '-' && *(dash + 1))
+      last = std::min(last, atoi(dash + 1));
+
+    // like the real one, only whole entries that fit in one reply
+    std::string s;
+    for (int i = std::max(first, 0); i <= last; ++i)
+    {
+      std::string entry = bssToString(m_bss[i], mask);
+      if (s.size() + entry.size() > kMaxReply)
+        break;
+      s += entry;
+    }
+    return s;
+  }
+
+  std::string bssToString(Bss const& bss, uint32_t mask) const
+  {
+    std::string s;
+    if (mask & kMaskId)
+      s += format("id=%d\n", bss.Id);
+    if (mask & kMaskBssid)
+      s += format("bssid=%s\n", bss.Bssid.c_str());
+    if (mask & kMaskFreq)
+      s += format("freq=%d\n", bss.Freq);
+    if (mask & kMaskLevel)
+      s += format("level=%d\n", bss.Level);
+    if (mask & kMaskFlags)
+      s += format("flags=%s\n", bss.Flags.c_str());
+    if (mask & kMaskSsid)
+      s += format("ssid=%s\n", bss.Ssid.c_str());
+    if (mask & kMaskDelim)
+      s += "====\n";
+    return s;
+  }
+
+  std::string listNetworks() const
+  {
+    std::string s = "network id / ssid / bssid / flags\n";
+    for (auto const& net : m_networks)
+    {
+      char const* flags = "";
+      if (net.first == m_current)
+        flags = "[CURRENT]";
+      else if (net.second.Disabled)
+        flags = "[DISABLED]";
+      s += format("%d\t%s\tany\t%s\n", net.first, net.second.Ssid.c_str(), flags);
+    }
+    return s;
+  }
+
+  std::string addNetwork()
+  {
+    int id = m_next_network++;
+    m_networks[id] = Network { "", "", true };
+    sendEvent(format("CTRL-EVENT-NETWORK-ADDED %d", id));
+    return format("%d\n", id);
+  }
+
+  std::string removeNetwork(std::vector<std::string> const& argv)
+  {
+    if (argv.size() < 2)
+      return "FAIL\n";
+
+    int id = atoi(argv[1].c_str());
+    if (m_networks.erase(id) == 0)
+      return "FAIL\n";
+
+    if (id == m_current)
+      disconnect();
+    sendEvent(format("CTRL-EVENT-NETWORK-REMOVED %d", id));
+    return "OK\n";
+  }
+
+  std::string getNetwork(std::vector<std::string> const& argv) const
+  {
+    if (argv.size() < 3)
+      return "FAIL\n";
+
+    auto itr = m_networks.find(atoi(argv[1].c_str()));
+    if (itr == m_networks.end())
+      return "FAIL\n";
+
+    if (argv[2] == "ssid")
+      return format("\"%s\"", itr->second.Ssid.c_str());
+    if (argv[2] == "psk")
+      return "*";
+    if (argv[2] == "disabled")
+      return itr->second.Disabled ? "1" : "0";
+
+    return "FAIL\n";
+  }
+
+  std::string setNetwork(std::vector<std::string> const& argv)
+  {
+    if (argv.size() < 4)
+      return "FAIL\n";
+
+    auto itr = m_networks.find(atoi(argv[1].c_str()));
+    if (itr == m_networks.end())
+      return "FAIL\n";
+
+    if (argv[2] == "ssid")
+      itr->second.Ssid = unquote(argv[3]);
+    else if (argv[2] == "psk")
+      itr->second.Psk = unquote(argv[3]);
+    else if (argv[2] != "key_mgmt" && argv[2] != "scan_ssid" && argv[2] != "priority")
+      return "FAIL\n";
+
+    return "OK\n";
+  }
+
+  std::string selectNetwork(std::vector<std::string> const& argv)
+  {
+    if (argv.size() < 2)
+      return "FAIL\n";
+
+    int id = atoi(argv[1].c_str());
+    auto itr = m_networks.find(id);
+    if (itr == m_networks.end())
+      return "FAIL\n";
+
+    for (auto& net : m_networks)
+      net.second.Disabled = (net.first != id);
+
+    if (m_current != -1)
+      disconnect();
+
+    addTimer(m_opts.ConnectTime, [this, id] {
+      auto net = m_networks.find(id);
+      if (net == m_networks.end() || net->second.Disabled)
+        return;
+
+      Bss const* bss = findBss(net->second.Ssid);
+      if (!bss)
+      {
+        sendEvent("CTRL-EVENT-NETWORK-NOT-FOUND");
+        return;
+      }
+
+      m_current = id;
+      sendEvent(format("CTRL-EVENT-CONNECTED - Connection to %s completed [id=%d id_str=]",
+        bss->Bssid.c_str(), id));
+    });
+
+    return "OK\n";
+  }
+
+  void disconnect()
+  {
+    if (m_current == -1)
+      return;
+
+    auto net = m_networks.find(m_current);
+    Bss const* bss = net != m_networks.end() ? findBss(net->second.Ssid) : nullptr;
+    m_current = -1;
+    sendEvent(format("CTRL-EVENT-DISCONNECTED bssid=%s reason=3 locally_generated=1",
+      bss ? bss->Bssid.c_str() : "00:00:00:00:00:00"));
+  }
+
+  Bss const* findBss(std::string const& ssid) const
+  {
+    for (Bss const& bss : m_bss)
+    {
+      if (bss.Ssid == ssid)
+        return &bss;
+    }
+    return nullptr;
+  }
+
+  void sendEvent(std::string const& event)
+  {
+    std::string s = "<3>" + event;
+    for (auto const& mon : m_monitors)
+      sendto(m_fd, s.c_str(), s.size(), 0, reinterpret_cast<sockaddr const *>(&mon.first),
+        mon.second);
+  }
+
+  void addTimer(int ms, std::function<void()> const& action)
+  {
+    m_timers.push_back(TimedAction { Clock::now() + std::chrono::milliseconds(ms), action });
+  }
+
+  // runs whatever is due, returns the poll timeout until the next one
+  int runTimers()
+  {
+    Clock::time_point now = Clock::now();
+
+    std::vector<TimedAction> due;
+    for (auto itr = m_timers.begin(); itr != m_timers.end();)
+    {
+      if (itr->Deadline <= now)
+      {
+        due.push_back(*itr);
+        itr = m_timers.erase(itr);
+      }
+      else
+      {
+        ++itr;
+      }
+    }
+
+    for (TimedAction const& t : due)
+      t.Action();
+
+    int timeout = -1;
+    for (TimedAction const& t : m_timers)
+    {
+      int ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        t.Deadline - now).count()) + 1;
+      if (timeout == -1 || ms < timeout)
+        timeout = ms;
+    }
+    return timeout;
+  }
+
+private:
+  Options                                           m_opts;
+  int                                               m_fd;
+  std::vector<Bss>                                  m_bss;
+  std::map<int, Network>                            m_networks;
+  int                                               m_next_network;
+  int                                               m_current;
+  bool                                              m_scanning;
+  std::vector< std::pair<sockaddr_un, socklen_t> >  m_monitors;
+  std::vector<TimedAction>                          m_timers;
+  std::map<std::string, int>                        m_counts;
+  std::map<std::string, int>                        m_recent;
+  std::vector< std::pair<std::string, std::string> > m_failures;
+};
+
+void
+printHelp()
+{
+  printf("\n");
+  printf("fake_wpa_supplicant [args]\n");
+  printf("\t-p  --path     <file>       Control socket path\n");
+  printf("\t-b  --bss      <n>          Number of access points in scan results\n");
+  printf("\t-n  --networks <n>          Number of pre-configured networks\n");
+  printf("\t-s  --scan-time <ms>        Time from SCAN to SCAN-RESULTS\n");
+  printf("\t-c  --connect-time <ms>     Time from SELECT_NETWORK to CONNECTED\n");
+  printf("\t-l  --latency [CMD=]<ms>    Delay before each reply, or before CMD replies\n");
+  printf("\t-v  --verbose               Log each command\n");
+  printf("\t-h  --help                  Print this help and exit\n");
+  exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+  Options opts;
+
+  while (true)
+  {
+    static struct option longOptions[] =
+    {
+      { "path",         required_argument, 0, 'p' },
+      { "bss",          required_argument, 0, 'b' },
+      { "networks",     required_argument, 0, 'n' },
+      { "scan-time",    required_argument, 0, 's' },
+      { "connect-time", required_argument, 0, 'c' },
+      { "latency",      required_argument, 0, 'l' },
+      { "verbose",      no_argument, 0, 'v' },
+      { "help",         no_argument, 0, 'h' },
+      { 0, 0, 0, 0 }
+    };
+
+    int optionIndex = 0;
+    int c = getopt_long(argc, argv, "p:b:n:s:c:l:vh", longOptions, &optionIndex);
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+      case 'p':
+        opts.Path = optarg;
+        break;
+      case 'b':
+        opts.BssCount = atoi(optarg);
+        break;
+      case 'n':
+        opts.Networks = atoi(optarg);
+        break;
+      case 's':
+        opts.ScanTime = atoi(optarg);
+        break;
+      case 'c':
+        opts.ConnectTime = atoi(optarg);
+        break;
+      case 'l':
+      {
+        char const* eq = strchr(optarg, '=');
+        if (eq)
+          opts.CommandLatency[std::string(optarg, eq - optarg)] = atoi(eq + 1);
+        else
+          opts.Latency = atoi(optarg);
+        break;
+      }
+      case 'v':
+        opts.Verbose = true;
+        break;
+      case 'h':
+        printHelp();
+        break;
+      default:
+        break;
+    }
+  }
+
+  signal(SIGINT, &onSignal);
+  signal(SIGTERM, &onSignal);
+
+  FakeSupplicant supplicant(opts);
+  int ret = supplicant.open();
+  if (ret)
+  {
+    fprintf(stderr, "failed to open %s:%s\n", opts.Path.c_str(), strerror(ret));
+    return 1;
+  }
+
+  fprintf(stderr, "listening on %s with %d bss\n", opts.Path.c_str(), opts.BssCount);
+  supplicant.run();
+  supplicant.printStats();
+
+  return 0;
+}